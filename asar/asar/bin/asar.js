@@ -21,12 +21,21 @@ program.version('v' + packageJSON.version)
 program.command('pack <dir> <output>')
   .alias('p')
   .description('create asar archive')
-  .option('--ordering <file path>', 'path to a text file for ordering contents')
+  .option('--ordering <file path>', 'path to a text file for ordering contents, such as the .prefetch manifest of a previous run')
   .option('--unpack <expression>', 'do not pack files matching glob <expression>')
   .option('--unpack-dir <expression>', 'do not pack dirs matching glob <expression> or starting with literal <expression>')
   .option('--exclude-hidden', 'exclude hidden files')
+  .option('--encrypt-key <key>', 'encrypt file contents with <key>')
+  .option('--compression <algorithm>', 'compress encrypted file contents with <algorithm>, only brotli is supported')
+  .option('--stable', 'encrypt unchanged files identically from one build to the next, for overlays')
+  .option('--entry-keys', 'encrypt every file with a key of its own, derived from <key>')
+  .option('--binary-header', 'also write a precompiled binary header')
+  .option('--mime', 'record the MIME type of every file in the header')
   .action(function (dir, output, options) {
     options = {
+      encrypt: options.encryptKey ? { key: options.encryptKey, compression: options.compression, stable: options.stable, entryKeys: options.entryKeys } : undefined,
+      binaryHeader: options.binaryHeader,
+      mime: options.mime,
       unpack: options.unpack,
       unpackDir: options.unpackDir,
       ordering: options.ordering,
@@ -72,6 +81,19 @@ program.command('extract <archive> <dest>')
     asar.extractAll(archive, dest)
   })
 
+program.command('overlay <base> <target> <output>')
+  .alias('o')
+  .description('write the overlay updating archive <base> to archive <target>, to be installed as <base>.overlay')
+  .option('--encrypt-key <key>', 'key of both archives')
+  .option('--binary-header', 'also write a precompiled binary header')
+  .action(function (base, target, output, options) {
+    var result = asar.createOverlay(base, target, output, {
+      key: options.encryptKey,
+      binaryHeader: options.binaryHeader
+    })
+    console.log('Reused ' + result.reused + ' files, added ' + result.added + ' files (' + result.size + ' bytes).')
+  })
+
 program.command('*')
   .action(function (cmd) {
     console.log('asar: \'%s\' is not an asar command. See \'asar --help\'.', cmd)
@@ -0,0 +1,275 @@
+'use strict'
+
+// Startup benchmark of the protection modes of the README. The sample app in
+// ../dist is packed in every mode, then launched with probe.js, cold and warm,
+// and the time until its window is ready to show is reported with the time
+// spent decrypting, the CPU time of the main process, the bytes read from
+// disk and the peak RSS of all the processes of the app.
+//
+//   node bench.js --electron <path> [--runs 10] [--modes plain,encrypted,...]
+//
+// The Electron must be the one built with electron_changeFiles, which reads
+// the encrypted archives with the key given here, its default key unless a
+// KeyProvider is registered. On Linux without a display, run it in xvfb-run.
+//
+// A cold launch gets a new user data directory and code cache directory, and
+// the page cache is dropped first with the --drop-caches command, such as
+// "sync && echo 3 | sudo tee /proc/sys/vm/drop_caches" on Linux or
+// "sudo purge" on macOS. Without it the archive stays in the page cache and
+// only the caches of Electron start cold. Warm launches share their
+// directories after a first launch which is not counted.
+
+const childProcess = require('child_process')
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+const program = require('commander')
+
+const asar = require('../../lib/asar')
+const { encryptAll } = require('../../lib/encrypt')
+
+const DIST = path.join(__dirname, '..', 'dist')
+const PROBE = path.join(__dirname, 'probe.js')
+const BYTECODE = path.join(__dirname, 'bytecode.js')
+const PREFIX = 'asar-bench:'
+const MODES = ['plain', 'encrypted', 'enc', 'bytecode', 'snapshot']
+
+// How each mode packs the sample app into |out|, returning the archive.
+const PACKERS = {
+  // The archive as asar packs it.
+  plain: async function (out) {
+    const archive = path.join(out, 'plain.asar')
+    await asar.createPackage(DIST, archive)
+    return archive
+  },
+  // Encrypted while packing.
+  encrypted: async function (out, options) {
+    const archive = path.join(out, 'encrypted.asar')
+    await asar.createPackageWithOptions(DIST, archive, { encrypt: { key: options.key } })
+    return archive
+  },
+  // The plain archive encrypted by encryptAll, as the enc.asar of the repo.
+  enc: async function (out, options) {
+    const archive = path.join(out, 'enc.asar')
+    await encryptAll(await PACKERS.plain(out), archive, { key: options.key })
+    return archive
+  },
+  // The modules of the main process compiled to V8 bytecode, see bytecode.js.
+  // The preload runs in a sandboxed renderer and keeps its source.
+  bytecode: async function (out, options) {
+    const dir = path.join(out, 'bytecode')
+    removeDirectory(dir)
+    copyDirectory(DIST, dir)
+    const result = childProcess.spawnSync(options.electron, [BYTECODE, dir, 'preload.js'], {
+      env: Object.assign({}, process.env, { ELECTRON_RUN_AS_NODE: '1' }),
+      stdio: 'inherit'
+    })
+    if (result.status !== 0) throw new Error(`Compiling ${dir} to bytecode failed`)
+    const archive = path.join(out, 'bytecode.asar')
+    await asar.createPackage(dir, archive)
+    return archive
+  },
+  // The plain archive, run by the Electron of --snapshot-electron, whose V8
+  // snapshot was rebuilt with the code of the app by electron-mksnapshot.
+  snapshot: async function (out) {
+    return PACKERS.plain(out)
+  }
+}
+
+const copyDirectory = function (src, dest) {
+  fs.mkdirSync(dest, { recursive: true })
+  for (const entry of fs.readdirSync(src, { withFileTypes: true })) {
+    if (entry.isDirectory()) {
+      copyDirectory(path.join(src, entry.name), path.join(dest, entry.name))
+    } else {
+      fs.copyFileSync(path.join(src, entry.name), path.join(dest, entry.name))
+    }
+  }
+}
+
+// fs.rmSync is Node 14.14, and fs.rmdirSync throws when |dir| is missing from
+// Node 16.
+const removeDirectory = function (dir) {
+  (fs.rmSync || fs.rmdirSync)(dir, { recursive: true, force: true })
+}
+
+/**
+ * Launches |electron| on the app |archive| once, with the user data and code
+ * cache directories in |profile|. Resolves with the stats of probe.js and
+ * `readyMs`, the time from the spawn to the window being ready to show.
+ */
+const launch = function (electron, archive, profile, timeout) {
+  return new Promise((resolve, reject) => {
+    const start = process.hrtime.bigint()
+    const child = childProcess.spawn(electron, [PROBE], {
+      env: Object.assign({}, process.env, {
+        ASAR_BENCH_APP: archive,
+        ASAR_BENCH_USER_DATA: path.join(profile, 'user-data'),
+        ELECTRON_ASAR_CODE_CACHE: path.join(profile, 'code-cache'),
+        ELECTRON_NO_HELP: '1'
+      }),
+      stdio: ['ignore', 'pipe', 'pipe']
+    })
+
+    let readyMs
+    let stats
+    let output = ''
+    let errors = ''
+    const timer = setTimeout(() => child.kill(), timeout)
+    child.stdout.on('data', (chunk) => {
+      output += chunk
+      let end
+      while ((end = output.indexOf('\n')) !== -1) {
+        const line = output.slice(0, end)
+        output = output.slice(end + 1)
+        if (line === `${PREFIX}ready`) {
+          readyMs = Number(process.hrtime.bigint() - start) / 1e6
+        } else if (line.startsWith(PREFIX)) {
+          stats = JSON.parse(line.slice(PREFIX.length))
+        }
+      }
+    })
+    child.stderr.on('data', (chunk) => { errors += chunk })
+    child.on('error', reject)
+    child.on('exit', (code) => {
+      clearTimeout(timer)
+      if (readyMs === undefined || !stats) {
+        return reject(new Error(`${archive} did not get ready to show (exit code ${code}):\n${errors.slice(-2000)}`))
+      }
+      resolve(Object.assign({ readyMs }, stats))
+    })
+  })
+}
+
+// The numbers kept of a launch, bytes read and peak RSS summed over the
+// processes of the app, null when the platform does not tell.
+const summarize = function (result) {
+  const sum = function (field) {
+    const values = result.processes.map(stats => stats[field]).filter(value => value !== undefined)
+    return values.length ? values.reduce((a, b) => a + b, 0) : null
+  }
+  return {
+    readyMs: result.readyMs,
+    decryptMs: result.archive ? result.archive.decryptTime : null,
+    decryptedBytes: result.archive ? result.archive.decryptedBytes : null,
+    mainCpuMs: result.mainCpuMs,
+    readBytes: sum('readBytes'),
+    peakRssKb: sum('peakRssKb')
+  }
+}
+
+const makeProfile = function (out) {
+  return fs.mkdtempSync(path.join(out, 'profile-'))
+}
+
+// Runs the |runs| cold then warm launches of |archive|.
+const benchmark = async function (electron, archive, options) {
+  const cold = []
+  for (let i = 0; i < options.runs; ++i) {
+    if (options.dropCaches) childProcess.execSync(options.dropCaches, { stdio: 'inherit' })
+    const profile = makeProfile(options.out)
+    try {
+      cold.push(summarize(await launch(electron, archive, profile, options.timeout)))
+    } finally {
+      removeDirectory(profile)
+    }
+  }
+
+  const warm = []
+  const profile = makeProfile(options.out)
+  try {
+    await launch(electron, archive, profile, options.timeout)
+    for (let i = 0; i < options.runs; ++i) {
+      warm.push(summarize(await launch(electron, archive, profile, options.timeout)))
+    }
+  } finally {
+    removeDirectory(profile)
+  }
+  return { cold, warm }
+}
+
+const percentile = function (values, p) {
+  values = values.filter(value => value !== null).sort((a, b) => a - b)
+  if (!values.length) return null
+  return values[Math.min(values.length - 1, Math.floor(values.length * p))]
+}
+
+const format = function (value, scale) {
+  return value === null ? '-' : (value / scale).toFixed(1)
+}
+
+const printTable = function (results) {
+  const columns = ['mode', 'launch', 'ready ms', 'ready p90', 'decrypt ms', 'main cpu ms', 'read MB', 'peak RSS MB']
+  const rows = [columns]
+  for (const [mode, launches] of Object.entries(results)) {
+    for (const [kind, runs] of Object.entries(launches)) {
+      const median = field => percentile(runs.map(run => run[field]), 0.5)
+      rows.push([
+        mode,
+        kind,
+        format(median('readyMs'), 1),
+        format(percentile(runs.map(run => run.readyMs), 0.9), 1),
+        format(median('decryptMs'), 1),
+        format(median('mainCpuMs'), 1),
+        format(median('readBytes'), 1024 * 1024),
+        format(median('peakRssKb'), 1024)
+      ])
+    }
+  }
+  const widths = columns.map((column, i) => Math.max(...rows.map(row => row[i].length)))
+  for (const row of rows) {
+    console.log(row.map((cell, i) => i < 2 ? cell.padEnd(widths[i]) : cell.padStart(widths[i])).join('  '))
+  }
+}
+
+const main = async function () {
+  program
+    .description('Benchmark the startup of the sample app in every protection mode')
+    .option('--electron <path>', 'Electron to launch, $ELECTRON_PATH by default')
+    .option('--runs <count>', 'launches of every kind and mode', 10)
+    .option('--modes <modes>', `comma-separated modes among ${MODES.join(', ')}`, MODES.join(','))
+    .option('--key <key>', 'key of the encrypted modes, the default key of the runtime', 'testtesttesttest')
+    .option('--snapshot-electron <path>', 'Electron with a V8 snapshot of the app, for the snapshot mode')
+    .option('--drop-caches <command>', 'command dropping the page cache before every cold launch')
+    .option('--timeout <ms>', 'time a launch may take', 60000)
+    .option('--out <dir>', 'directory for the archives', path.join(os.tmpdir(), 'asar-bench'))
+    .option('--json <file>', 'also write every launch to <file>')
+    .parse(process.argv)
+
+  const options = {
+    electron: program.electron || process.env.ELECTRON_PATH,
+    runs: parseInt(program.runs),
+    key: program.key,
+    dropCaches: program.dropCaches,
+    timeout: parseInt(program.timeout),
+    out: path.resolve(program.out)
+  }
+  if (!options.electron) throw new Error('Give the Electron to launch with --electron or $ELECTRON_PATH')
+  fs.mkdirSync(options.out, { recursive: true })
+
+  const results = {}
+  for (const mode of program.modes.split(',')) {
+    if (!PACKERS[mode]) throw new Error(`Unknown mode ${mode}`)
+    let electron = options.electron
+    if (mode === 'snapshot') {
+      if (!program.snapshotElectron) {
+        console.log('Skipping the snapshot mode, which needs --snapshot-electron')
+        continue
+      }
+      electron = program.snapshotElectron
+    }
+    const archive = await PACKERS[mode](options.out, options)
+    console.log(`Launching ${mode} (${fs.statSync(archive).size} bytes) ${options.runs} times cold and warm`)
+    results[mode] = await benchmark(electron, archive, options)
+  }
+
+  printTable(results)
+  if (program.json) {
+    fs.writeFileSync(program.json, JSON.stringify({ electron: options.electron, runs: options.runs, results }, null, 2))
+  }
+}
+
+main().catch((error) => {
+  console.error(error.stack || error)
+  process.exit(1)
+})
@@ -0,0 +1,33 @@
+'use strict'
+
+// Runs a module compiled to V8 bytecode by bytecode.js. The stub left in
+// place of the module calls us with the name of its .jsc and the length of
+// the wrapped source, which V8 checks the cache against.
+
+const fs = require('fs')
+const path = require('path')
+const v8 = require('v8')
+const vm = require('vm')
+
+// The functions were all compiled eagerly, V8 must neither compile them again
+// from the placeholder source nor drop their bytecode.
+v8.setFlagsFromString('--no-lazy')
+v8.setFlagsFromString('--no-flush-bytecode')
+
+// Hash of the V8 flags of this process, which a cache has to carry to be
+// accepted. The process compiling the modules ran with other flags.
+let flagsHash
+
+module.exports = function (module, require, file, length) {
+  const data = fs.readFileSync(path.join(path.dirname(module.filename), file))
+  if (!flagsHash) flagsHash = new vm.Script('').createCachedData().slice(12, 16)
+  flagsHash.copy(data, 12)
+
+  const source = '"' + '\u200b'.repeat(length - 2) + '"'
+  const script = new vm.Script(source, { filename: module.filename, cachedData: data })
+  if (script.cachedDataRejected) {
+    throw new Error(`${file} was not compiled by the V8 of this Electron`)
+  }
+  const wrapper = script.runInThisContext()
+  return wrapper.call(module.exports, module.exports, require, module, module.filename, path.dirname(module.filename))
+}
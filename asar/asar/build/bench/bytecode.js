@@ -0,0 +1,59 @@
+'use strict'
+
+// Compiles the modules of an app to V8 bytecode, the bytecode protection of
+// the README: every module is replaced by a stub running its .jsc through
+// bytecode-loader.js, and its source is gone. Bytecode only loads in the V8
+// which made it, so bench.js runs this with the Electron it benchmarks:
+//
+//   ELECTRON_RUN_AS_NODE=1 electron bytecode.js <dir> [excluded module...]
+
+const fs = require('fs')
+const path = require('path')
+const v8 = require('v8')
+const vm = require('vm')
+const Module = require('module')
+
+const LOADER = 'bytecode-loader.js'
+
+// Every function is compiled now, the placeholder source bytecode-loader.js
+// gives V8 cannot be compiled again.
+v8.setFlagsFromString('--no-lazy')
+
+// Replaces the module |file| by its bytecode and a stub loading it.
+const compileModule = function (dir, file) {
+  const source = Module.wrap(fs.readFileSync(file, 'utf8'))
+  const script = new vm.Script(source, { filename: file })
+  fs.writeFileSync(`${file}c`, script.createCachedData())
+
+  let loader = path.relative(path.dirname(file), path.join(dir, LOADER)).split(path.sep).join('/')
+  if (!loader.startsWith('.')) loader = `./${loader}`
+  const stub = `require(${JSON.stringify(loader)})(module, require, ${JSON.stringify(`${path.basename(file)}c`)}, ${source.length})\n`
+  fs.writeFileSync(file, stub)
+}
+
+/**
+ * Compiles every .js module under |dir| but the |excluded| ones, given
+ * relative to |dir|, such as the preloads of sandboxed renderers, which
+ * cannot require the loader.
+ */
+const compileApp = function (dir, excluded) {
+  const visit = function (current) {
+    for (const entry of fs.readdirSync(current, { withFileTypes: true })) {
+      const file = path.join(current, entry.name)
+      if (entry.isDirectory()) {
+        if (entry.name !== 'node_modules') visit(file)
+      } else if (entry.name.endsWith('.js') && !excluded.includes(path.relative(dir, file))) {
+        compileModule(dir, file)
+      }
+    }
+  }
+  visit(dir)
+  fs.copyFileSync(path.join(__dirname, LOADER), path.join(dir, LOADER))
+}
+
+if (require.main === module) {
+  const [dir, ...excluded] = process.argv.slice(2)
+  compileApp(path.resolve(dir), excluded)
+}
+
+module.exports.compileApp = compileApp
@@ -0,0 +1,68 @@
+'use strict'
+
+// The app bench.js launches in place of the packaged one. It starts the app
+// in ASAR_BENCH_APP as Electron starts a packaged app, prints a line when the
+// first window of the app is ready to show, then a line with what the launch
+// cost, and quits.
+
+const { app } = require('electron')
+const fs = require('fs')
+const Module = require('module')
+
+const PREFIX = 'asar-bench:'
+const appPath = process.env.ASAR_BENCH_APP
+
+// Returns the "name: value" fields of /proc/|pid|/|name| as numbers, undefined
+// when the file cannot be read, as off Linux.
+const readProc = function (pid, name) {
+  try {
+    const fields = {}
+    for (const line of fs.readFileSync(`/proc/${pid}/${name}`, 'latin1').split('\n')) {
+      const [field, value] = line.split(':')
+      if (value) fields[field] = parseInt(value)
+    }
+    return fields
+  } catch (error) {
+    return undefined
+  }
+}
+
+// Returns what the process of |metric|, from app.getAppMetrics(), has read and
+// the most memory it has used, in KB.
+const processStats = function (metric) {
+  const stats = { type: metric.type, pid: metric.pid }
+  const io = readProc(metric.pid, 'io')
+  if (io) {
+    stats.readBytes = io.read_bytes
+    stats.readChars = io.rchar
+  }
+  const status = readProc(metric.pid, 'status')
+  stats.peakRssKb = status && status.VmHWM ? status.VmHWM
+    : metric.memory.peakWorkingSetSize || metric.memory.workingSetSize
+  return stats
+}
+
+const report = function () {
+  process.stdout.write(`${PREFIX}ready\n`)
+
+  // The registry of the runtime hands out the archive the app was read from,
+  // with the counters of every read of it, the renderers' ones included.
+  const archive = process._linkedBinding('electron_common_asar').createArchive(appPath)
+  const cpu = process.cpuUsage()
+  const stats = {
+    archive: archive ? archive.getStats() : null,
+    mainCpuMs: (cpu.user + cpu.system) / 1000,
+    processes: app.getAppMetrics().map(processStats)
+  }
+  process.stdout.write(`${PREFIX}${JSON.stringify(stats)}\n`, () => app.exit(0))
+}
+
+app._setDefaultAppPaths(appPath)
+app.setPath('userData', process.env.ASAR_BENCH_USER_DATA)
+app.once('browser-window-created', (event, window) => {
+  window.once('ready-to-show', report)
+})
+
+// The sample app opens its index.html when it is not given a file to open.
+process.argv = [process.argv[0]]
+Module._load(appPath, module, true)
@@ -7,6 +7,7 @@ const minimatch = require('minimatch')
 const Filesystem = require('./filesystem')
 const disk = require('./disk')
 const crawlFilesystem = require('./crawlfs')
+const { parseOrdering, sortByOrdering } = require('./ordering')
 
 /**
  * Whether a directory should be excluded from packing due to the `--unpack-dir" option.
@@ -63,39 +64,11 @@ module.exports.createPackageFromFiles = async function (src, dest, filenames, me
 
   let filenamesSorted = []
   if (options.ordering) {
-    const orderingFiles = (await fs.readFile(options.ordering)).toString().split('\n').map(line => {
-      if (line.includes(':')) { line = line.split(':').pop() }
-      line = line.trim()
-      if (line.startsWith('/')) { line = line.slice(1) }
-      return line
-    })
-
-    const ordering = []
-    for (const file of orderingFiles) {
-      const pathComponents = file.split(path.sep)
-      let str = src
-      for (const pathComponent of pathComponents) {
-        str = path.join(str, pathComponent)
-        ordering.push(str)
-      }
-    }
+    const ordering = parseOrdering((await fs.readFile(options.ordering)).toString())
+    const { sorted, missing } = sortByOrdering(src, filenames, ordering)
+    filenamesSorted = sorted
 
-    let missing = 0
     const total = filenames.length
-
-    for (const file of ordering) {
-      if (!filenamesSorted.includes(file) && filenames.includes(file)) {
-        filenamesSorted.push(file)
-      }
-    }
-
-    for (const file of filenames) {
-      if (!filenamesSorted.includes(file)) {
-        filenamesSorted.push(file)
-        missing += 1
-      }
-    }
-
     console.log(`Ordering file has ${((total - missing) / total) * 100}% coverage.`)
   } else {
     filenamesSorted = filenames
@@ -137,7 +110,7 @@ module.exports.createPackageFromFiles = async function (src, dest, filenames, me
 
   const insertsDone = async function () {
     await fs.mkdirp(path.dirname(dest))
-    return disk.writeFilesystem(dest, filesystem, files, metadata)
+    return disk.writeFilesystem(dest, filesystem, files, metadata, options)
   }
 
   const names = filenamesSorted.slice()
@@ -203,6 +176,10 @@ module.exports.extractAll = function (archive, dest) {
   }
 }
 
+module.exports.createOverlay = function (base, target, dest, options) {
+  return require('./overlay').createOverlay(base, target, dest, options)
+}
+
 module.exports.uncache = function (archive) {
   return disk.uncacheFilesystem(archive)
 }
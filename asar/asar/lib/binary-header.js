@@ -0,0 +1,260 @@
+'use strict'
+
+// Precompiled form of the JSON header, which the runtime uses in place from
+// the mapped archive instead of parsing the JSON. It is appended to the end of
+// the archive, after the file contents, and located through a fixed footer:
+//
+//   index:  IndexHeader, block offsets, entries, hash buckets, children,
+//           string table
+//   footer: uint64 offset of the index, "ASARIDX1"
+//
+// Everything is little-endian, and the index starts at a multiple of 8. The
+// layout has to match HeaderIndex in archive.cc.
+
+const MAGIC = Buffer.from('ASARIDX1')
+const VERSION = 2
+const HEADER_SIZE = 32
+const ENTRY_SIZE = 72
+const FOOTER_SIZE = 16
+
+const DIRECTORY = 1 << 0
+const LINK = 1 << 1
+const UNPACKED = 1 << 2
+const EXECUTABLE = 1 << 3
+const ENCRYPTED = 1 << 4
+const INVALID = 1 << 5
+const OVERLAY = 1 << 6
+const ENTRY_KEY = 1 << 7
+
+const GCM_TAG_SIZE = 16
+
+// Values of Entry.compression.
+const COMPRESSION = { brotli: 1 }
+
+// FNV-1a of the UTF-8 bytes of a path.
+const hashPath = function (pathBuf) {
+  let hash = 0x811c9dc5
+  for (const c of pathBuf) {
+    hash ^= c
+    hash = Math.imul(hash, 16777619) >>> 0
+  }
+  return hash
+}
+
+const isUInt32 = (value) => Number.isInteger(value) && value >= 0 && value <= 0xffffffff
+
+// Mirrors FillFileInfoWithNode in archive.cc, nodes it rejects are flagged as
+// invalid.
+const fillFileEntry = function (entry, node, blockOffsets) {
+  // The runtime reads these with GetInteger, which only accepts int32.
+  const isInt = (value) => Number.isInteger(value) && value >= 0 && value <= 0x7fffffff
+  if (!isInt(node.size)) return false
+  entry.size = node.size
+  if (node.unpacked === true) {
+    entry.flags |= UNPACKED
+    return true
+  }
+  if (typeof node.offset !== 'string' || !/^[0-9]+$/.test(node.offset)) return false
+  entry.offset = BigInt(node.offset)
+  if (node.executable === true) entry.flags |= EXECUTABLE
+  if (node.overlay === true) entry.flags |= OVERLAY
+  if (isInt(node.len)) entry.len = node.len
+  if (node.encrypted !== true) return true
+
+  entry.flags |= ENCRYPTED
+  if (node.compression !== undefined) {
+    if (!Object.prototype.hasOwnProperty.call(COMPRESSION, node.compression)) return false
+    entry.compression = COMPRESSION[node.compression]
+  }
+  if (!node.encryption) {
+    entry.encryptionVersion = 1
+    return !entry.compression
+  }
+
+  const { version, blockSize, blocks, nonce, entryKey } = node.encryption
+  if (version === 3) {
+    if (!isInt(blockSize) || blockSize === 0) return false
+    if (typeof nonce !== 'string' || !/^[0-9a-fA-F]{16}$/.test(nonce)) return false
+    entry.nonce = BigInt('0x' + nonce)
+    if (entryKey === true) entry.flags |= ENTRY_KEY
+    if (!entry.compression) {
+      if (entry.size !== entry.len + Math.ceil(entry.len / blockSize) * GCM_TAG_SIZE) return false
+      entry.encryptionVersion = version
+      entry.blockSize = blockSize
+      return true
+    }
+  } else if (version !== 2) {
+    return false
+  }
+  // Compressed entries of both versions have a table, like version 2.
+  if (!isInt(blockSize) || blockSize === 0 || !Array.isArray(blocks)) return false
+  if (blocks.length !== Math.ceil(entry.len / blockSize)) return false
+  const offsets = [0]
+  for (const stored of blocks) {
+    if (!isInt(stored) || stored === 0) return false
+    offsets.push(offsets[offsets.length - 1] + stored)
+  }
+  if (offsets[offsets.length - 1] !== entry.size) return false
+  entry.encryptionVersion = version
+  entry.blockSize = blockSize
+  if (blocks.length > 0) {
+    entry.firstBlock = blockOffsets.length
+    entry.blockCount = blocks.length
+    blockOffsets.push(...offsets)
+  }
+  return true
+}
+
+/**
+ * Builds the binary index of |header|.
+ *
+ * @param {object} header: the JSON header of the archive.
+ * @param {number} headerSize: offset of the file contents in the archive.
+ * @returns {Buffer} the index, without its footer.
+ */
+const buildIndex = function (header, headerSize) {
+  const entries = []
+  const children = []
+  const blockOffsets = []
+  const strings = []
+  let stringsSize = 0
+
+  const addString = function (string) {
+    const buf = Buffer.from(string)
+    const offset = stringsSize
+    strings.push(buf)
+    stringsSize += buf.length
+    return { offset, size: buf.length, buf }
+  }
+
+  const addNode = function (pathString, node) {
+    const entry = {
+      offset: 0n,
+      nonce: 0n,
+      flags: 0,
+      size: 0,
+      len: 0,
+      encryptionVersion: 0,
+      blockSize: 0,
+      firstBlock: 0,
+      blockCount: 0,
+      firstChild: 0,
+      childCount: 0,
+      linkOffset: 0,
+      linkSize: 0,
+      compression: 0
+    }
+    const p = addString(pathString)
+    entry.pathOffset = p.offset
+    entry.pathSize = p.size
+    entry.hash = hashPath(p.buf)
+    if (typeof node.link === 'string') {
+      entry.flags = LINK
+      const link = addString(node.link)
+      entry.linkOffset = link.offset
+      entry.linkSize = link.size
+    } else if (node.files !== undefined) {
+      entry.flags = DIRECTORY
+    } else if (!fillFileEntry(entry, node, blockOffsets)) {
+      entry.flags = INVALID
+    } else if (typeof node.mime === 'string') {
+      // Files keep their MIME type where links keep their target.
+      const mime = addString(node.mime)
+      entry.linkOffset = mime.offset
+      entry.linkSize = mime.size
+    }
+    entries.push(entry)
+    return entries.length - 1
+  }
+
+  // The children of a directory are contiguous and in the byte order of their
+  // names, like the keys of a DictionaryValue.
+  const addChildren = function (dirIndex, pathString, node) {
+    if (!node.files || typeof node.files !== 'object') throw new Error('Invalid directory node')
+    const prefix = pathString === '' ? '' : pathString + '/'
+    const names = Object.keys(node.files).sort((a, b) => Buffer.compare(Buffer.from(a), Buffer.from(b)))
+    const subdirs = []
+    entries[dirIndex].firstChild = children.length
+    for (const name of names) {
+      const child = node.files[name]
+      if (!child || typeof child !== 'object') continue
+      const index = addNode(prefix + name, child)
+      children.push(index)
+      if (entries[index].flags & DIRECTORY) subdirs.push([index, prefix + name, child])
+    }
+    entries[dirIndex].childCount = children.length - entries[dirIndex].firstChild
+    for (const [index, subdirPath, child] of subdirs) {
+      addChildren(index, subdirPath, child)
+    }
+  }
+
+  addNode('', header)
+  addChildren(0, '', header)
+
+  let bucketCount = 16
+  while (bucketCount < entries.length * 2) bucketCount *= 2
+  const buckets = new Uint32Array(bucketCount)
+  entries.forEach((entry, i) => {
+    let slot = entry.hash & (bucketCount - 1)
+    while (buckets[slot]) slot = (slot + 1) & (bucketCount - 1)
+    buckets[slot] = i + 1
+  })
+
+  for (const entry of entries) {
+    for (const field of ['size', 'len', 'blockSize', 'firstBlock', 'blockCount', 'firstChild', 'childCount']) {
+      if (!isUInt32(entry[field])) throw new Error('Header too large for a binary index')
+    }
+  }
+  if (!isUInt32(stringsSize)) throw new Error('Header too large for a binary index')
+
+  const blockBytes = blockOffsets.length * 8
+  const entryBytes = entries.length * ENTRY_SIZE
+  const bucketBytes = bucketCount * 4
+  const childBytes = children.length * 4
+  const out = Buffer.alloc(HEADER_SIZE + blockBytes + entryBytes + bucketBytes + childBytes + stringsSize)
+
+  let pos = 0
+  for (const value of [VERSION, entries.length, bucketCount, children.length, blockOffsets.length, stringsSize, headerSize, 0]) {
+    out.writeUInt32LE(value, pos)
+    pos += 4
+  }
+  for (const value of blockOffsets) {
+    out.writeBigUInt64LE(BigInt(value), pos)
+    pos += 8
+  }
+  for (const entry of entries) {
+    out.writeBigUInt64LE(entry.offset, pos)
+    pos += 8
+    out.writeBigUInt64LE(entry.nonce, pos)
+    pos += 8
+    for (const field of ['pathOffset', 'pathSize', 'flags', 'size', 'len', 'encryptionVersion', 'blockSize',
+      'firstBlock', 'blockCount', 'firstChild', 'childCount', 'linkOffset', 'linkSize', 'compression']) {
+      out.writeUInt32LE(entry[field], pos)
+      pos += 4
+    }
+  }
+  Buffer.from(buckets.buffer).copy(out, pos)
+  pos += bucketBytes
+  for (const index of children) {
+    out.writeUInt32LE(index, pos)
+    pos += 4
+  }
+  Buffer.concat(strings, stringsSize).copy(out, pos)
+  return out
+}
+
+/**
+ * Returns the bytes to append to an archive whose length is |archiveSize| so
+ * that it carries the binary index of |header|: padding, index and footer.
+ */
+module.exports.buildTrailer = function (header, headerSize, archiveSize) {
+  const padding = (8 - archiveSize % 8) % 8
+  const index = buildIndex(header, headerSize)
+  const footer = Buffer.alloc(FOOTER_SIZE)
+  footer.writeBigUInt64LE(BigInt(archiveSize + padding), 0)
+  MAGIC.copy(footer, 8)
+  return Buffer.concat([Buffer.alloc(padding), index, footer])
+}
+
+module.exports.buildIndex = buildIndex
+module.exports.hashPath = hashPath
@@ -2,9 +2,10 @@
 
 const fs = require('./wrapped-fs')
 const path = require('path')
-const pickle = require('chromium-pickle-js')
 
 const Filesystem = require('./filesystem')
+const binaryHeader = require('./binary-header')
+const header = require('./header')
 let filesystemCache = {}
 
 async function copyFile (dest, src, filename) {
@@ -24,7 +25,7 @@ async function streamTransformedFile (originalFilename, outStream, transformed)
   })
 }
 
-const writeFileListToStream = async function (dest, filesystem, out, list, metadata) {
+const writeFileListToStream = async function (dest, filesystem, out, list, metadata, trailer) {
   for (const file of list) {
     if (file.unpack) { // the file should not be packed into archive
       const filename = path.relative(filesystem.src, file.filename)
@@ -33,22 +34,19 @@ const writeFileListToStream = async function (dest, filesystem, out, list, metad
       await streamTransformedFile(file.filename, out, metadata[file.filename].transformed)
     }
   }
-  return out.end()
+  return out.end(trailer)
 }
 
-module.exports.writeFilesystem = async function (dest, filesystem, files, metadata) {
-  const headerPickle = pickle.createEmpty()
-  headerPickle.writeString(JSON.stringify(filesystem.header))
-  const headerBuf = headerPickle.toBuffer()
-  const headerPickleOffset = 8;
-  for (let i = headerPickleOffset; i < headerBuf.length; i++) {
-    headerBuf[i] = headerBuf[i] ^ 579;
-  }
+module.exports.writeFilesystem = async function (dest, filesystem, files, metadata, options = {}) {
+  const passphrase = (options.encrypt && options.encrypt.key) || header.DEFAULT_KEY
+  const [magicHeaderBuf, sizeBuf, headerBuf] = header.encodeHeader(filesystem.header, passphrase)
 
-  const sizePickle = pickle.createEmpty()
-  sizePickle.writeUInt32(headerBuf.length)
-  const sizeBuf = sizePickle.toBuffer()
-  const magicHeaderBuf = Buffer.from([66, 65, 82, 2]);
+  // The binary index goes after the file contents, so it does not move them.
+  let trailer
+  if (options.binaryHeader) {
+    const headerSize = magicHeaderBuf.length + sizeBuf.length + headerBuf.length
+    trailer = binaryHeader.buildTrailer(filesystem.header, headerSize, headerSize + Number(filesystem.offset))
+  }
 
   const out = fs.createWriteStream(dest)
   await new Promise((resolve, reject) => {
@@ -57,40 +55,25 @@ module.exports.writeFilesystem = async function (dest, filesystem, files, metada
     out.write(sizeBuf)
     return out.write(headerBuf, () => resolve())
   })
-  return writeFileListToStream(dest, filesystem, out, files, metadata)
+  return writeFileListToStream(dest, filesystem, out, files, metadata, trailer)
 }
 
 module.exports.readArchiveHeaderSync = function (archive) {
   const fd = fs.openSync(archive, 'r')
-  let size
-  let headerBuf
   try {
-    const sizeBuf = Buffer.alloc(8)
-    if (fs.readSync(fd, sizeBuf, 0, 8, null) !== 8) {
-      throw new Error('Unable to read header size')
-    }
-
-    const sizePickle = pickle.createFromBuffer(sizeBuf)
-    size = sizePickle.createIterator().readUInt32()
-    headerBuf = Buffer.alloc(size)
-    if (fs.readSync(fd, headerBuf, 0, size, null) !== size) {
-      throw new Error('Unable to read header')
-    }
+    return header.readHeaderSync(fs, fd)
   } finally {
     fs.closeSync(fd)
   }
-
-  const headerPickle = pickle.createFromBuffer(headerBuf)
-  const header = headerPickle.createIterator().readString()
-  return { header: JSON.parse(header), headerSize: size }
 }
 
 module.exports.readFilesystemSync = function (archive) {
   if (!filesystemCache[archive]) {
-    const header = this.readArchiveHeaderSync(archive)
+    const archiveHeader = this.readArchiveHeaderSync(archive)
     const filesystem = new Filesystem(archive)
-    filesystem.header = header.header
-    filesystem.headerSize = header.headerSize
+    filesystem.header = archiveHeader.header
+    filesystem.headerSize = archiveHeader.headerSize
+    filesystem.dataOffset = archiveHeader.dataOffset
     filesystemCache[archive] = filesystem
   }
   return filesystemCache[archive]
@@ -119,7 +102,7 @@ module.exports.readFileSync = function (filesystem, filename, info) {
     // so we short-circuit the read in this case.
     const fd = fs.openSync(filesystem.src, 'r')
     try {
-      const offset = 8 + filesystem.headerSize + parseInt(info.offset)
+      const offset = filesystem.dataOffset + parseInt(info.offset)
       fs.readSync(fd, buffer, 0, info.size, offset)
     } finally {
       fs.closeSync(fd)
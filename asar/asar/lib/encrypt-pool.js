@@ -0,0 +1,111 @@
+'use strict'
+
+const os = require('os')
+
+let workerThreads
+try {
+  workerThreads = require('worker_threads')
+} catch (error) {
+  // Node before 11.7 without --experimental-worker, blocks are encrypted on
+  // the main thread.
+}
+
+// Compresses the block of a task if asked to, and encrypts it with the cipher
+// of encrypt.js, which is required lazily as it requires us.
+const runTask = function (task) {
+  const { encryptBlock, encryptGCMBlock, compressBlock } = require('./encrypt')
+  let block = Buffer.from(task.block)
+  if (task.compression) block = compressBlock(block, task.compression)
+  if (task.nonce) {
+    return encryptGCMBlock(Buffer.from(task.key), Buffer.from(task.nonce), task.index, block)
+  }
+  return encryptBlock(Buffer.from(task.key), block, task.iv && Buffer.from(task.iv))
+}
+
+// Returns an ArrayBuffer holding exactly |buffer|, which can be transferred to
+// a worker without copying when |buffer| owns its memory.
+const toArrayBuffer = function (buffer) {
+  if (buffer.byteOffset === 0 && buffer.byteLength === buffer.buffer.byteLength) {
+    return buffer.buffer
+  }
+  return buffer.buffer.slice(buffer.byteOffset, buffer.byteOffset + buffer.byteLength)
+}
+
+if (workerThreads && !workerThreads.isMainThread &&
+    workerThreads.workerData && workerThreads.workerData.asarEncryptPool) {
+  workerThreads.parentPort.on('message', ({ id, task }) => {
+    const data = toArrayBuffer(runTask(task))
+    workerThreads.parentPort.postMessage({ id, data }, [data])
+  })
+}
+
+/**
+ * Pool of worker threads encrypting blocks for encryptAll.
+ *
+ * `encrypt()` returns a promise of the stored bytes of a block, tasks being
+ * spread over the workers in the order they are queued. Without worker
+ * threads, blocks are encrypted synchronously on the calling thread.
+ *
+ * @param {number} size: number of workers, defaults to the number of CPUs.
+ */
+class EncryptPool {
+  constructor (size = os.cpus().length) {
+    this.size = Math.max(1, size)
+    this.workers = []
+    this.idle = []
+    this.queue = []
+    this.callbacks = new Map()
+    this.nextId = 0
+    if (!workerThreads) return
+
+    for (let i = 0; i < this.size; i++) {
+      const worker = new workerThreads.Worker(__filename, { workerData: { asarEncryptPool: true } })
+      worker.on('message', ({ id, data }) => {
+        const { resolve } = this.callbacks.get(id)
+        this.callbacks.delete(id)
+        resolve(Buffer.from(data))
+        this.idle.push(worker)
+        this.dispatch()
+      })
+      worker.on('error', (error) => {
+        for (const { reject } of this.callbacks.values()) reject(error)
+        this.callbacks.clear()
+      })
+      this.workers.push(worker)
+      this.idle.push(worker)
+    }
+  }
+
+  /**
+   * Encrypts |block|, a Buffer the pool takes ownership of.
+   *
+   * @param {object} task: `{ key, nonce, index, iv, compression }`, |nonce|
+   * and |index| for the GCM format only, |iv| for the CBC format in stable
+   * mode.
+   */
+  encrypt (block, { key, nonce, index, iv, compression }) {
+    const task = { key, nonce, index, iv, compression, block: toArrayBuffer(block) }
+    if (!this.workers.length) {
+      return Promise.resolve().then(() => runTask(task))
+    }
+    return new Promise((resolve, reject) => {
+      const id = this.nextId++
+      this.callbacks.set(id, { resolve, reject })
+      this.queue.push({ id, task })
+      this.dispatch()
+    })
+  }
+
+  dispatch () {
+    while (this.idle.length && this.queue.length) {
+      const { id, task } = this.queue.shift()
+      this.idle.pop().postMessage({ id, task }, [task.block])
+    }
+  }
+
+  destroy () {
+    return Promise.all(this.workers.map(worker => worker.terminate()))
+  }
+}
+
+module.exports = EncryptPool
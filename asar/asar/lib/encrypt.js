@@ -1,40 +1,476 @@
 const fs = require('fs');
-const pickle = require('chromium-pickle-js')
-const Filesystem = require('./filesystem')
+const crypto = require('crypto')
+const os = require('os')
+const path = require('path')
+const stream = require('stream')
+const zlib = require('zlib')
 const disk = require('./disk')
+const binaryHeader = require('./binary-header')
+const { DEFAULT_KEY, deriveKey, deriveEntryKey, encodeHeader } = require('./header')
+const { mimeTypeOf, SNIFF_SIZE } = require('./mime')
+const { parseOrdering, rankOrdering } = require('./ordering')
+const EncryptPool = require('./encrypt-pool')
 
-module.exports.encryptAll = async function (archive, dest) {
-  const filesystem = disk.readFilesystemSync(archive)
-  const filenames = filesystem.listFiles()
-
-  const headerPickle = pickle.createEmpty()
-  headerPickle.writeString(JSON.stringify(filesystem.header))
-  const headerBuf = headerPickle.toBuffer()
-
-  const sizePickle = pickle.createEmpty()
-  sizePickle.writeUInt32(headerBuf.length)
-  const sizeBuf = sizePickle.toBuffer()
-  var out = fs.createWriteStream(dest)
-  const fd = fs.openSync(archive, 'r');
-  out.write(sizeBuf)
-  out.write(headerBuf)
-  for (const info in filesystem.header.files) {
-    console.log(info,filesystem.header.files[info])
-    const {size, offset} = filesystem.header.files[info];
-    let filebuf = Buffer.alloc(size);
-    fs.readSync(fd, filebuf, 0, size, filesystem.headerSize+offset)
-    for (let i = 0; i < filebuf.length; i++) {
-      filebuf[i] = filebuf[i] ^ 193;
-    }
-    out.write(filebuf)
-  }
-  out.end()
-
-  // await new Promise((resolve, reject) => {
-  //   out.on('error', reject)
-  //   out.write(sizeBuf)
-  //   out.write(headerBuf)
-  //   return out.write(filebuf, () => resolve())
-  // })
+// Plaintext size of a block of the seekable encrypted formats.
+const BLOCK_SIZE = 64 * 1024
+// Values of "encryption.version" in the header for the block formats, entries
+// without it are a single base64 blob of AES-128-ECB ciphertext.
+const BLOCK_FORMAT_VERSION = 2
+const GCM_FORMAT_VERSION = 3
+const GCM_TAG_SIZE = 16
+
+// Values of "compression" in the header, the only one being brotli.
+const COMPRESSION_BROTLI = 'brotli'
+// Decompression speed does not depend on the quality, 9 compresses nearly as
+// well as 11 at a fraction of the time.
+const BROTLI_QUALITY = 9
+// Files that are compressed already, and only get larger when compressed
+// again.
+const COMPRESSED_EXTENSIONS = new Set([
+  '.7z', '.br', '.bz2', '.gif', '.gz', '.ico', '.jpeg', '.jpg', '.m4a', '.mp3',
+  '.mp4', '.node', '.ogg', '.png', '.webm', '.webp', '.woff', '.woff2', '.xz',
+  '.zip', '.zst'
+])
+
+// Every block is stored as its IV, random unless |iv| is given, followed by
+// the AES-128-CBC ciphertext of the block, so it can be decrypted without
+// touching its neighbours.
+const encryptBlock = function (key, block, iv = crypto.randomBytes(16)) {
+  const cipher = crypto.createCipheriv('aes-128-cbc', key, iv)
+  return Buffer.concat([iv, cipher.update(block), cipher.final()])
+}
+
+// In the GCM format, every block is stored as its AES-128-GCM ciphertext
+// followed by the tag. The nonce of a block is the 8 bytes nonce of the entry
+// followed by the index of the block, so it is never reused and blocks can not
+// be swapped.
+const encryptGCMBlock = function (key, nonce, index, block) {
+  const blockNonce = Buffer.alloc(12)
+  nonce.copy(blockNonce)
+  blockNonce.writeUInt32BE(index, 8)
+  const cipher = crypto.createCipheriv('aes-128-gcm', key, blockNonce)
+  return Buffer.concat([cipher.update(block), cipher.final(), cipher.getAuthTag()])
+}
+
+// In stable mode, the nonce of an entry is derived from its plaintext and from
+// how it is encrypted, instead of being random, so packing the same file again
+// gives the same bytes and an overlay can share the unchanged entries of two
+// archives. Files with the same content are then encrypted identically.
+const stableNonce = function (key, digest, { blockSize, version }, compression) {
+  return crypto.createHmac('sha256', key)
+    .update(`asar-nonce:${version}:${blockSize}:${compression || ''}:`)
+    .update(digest)
+    .digest()
+    .slice(0, 8)
+}
+
+// In stable mode, the IV of a CBC block is derived from the nonce of its entry
+// and its index.
+const stableIV = function (key, nonce, index) {
+  const data = Buffer.alloc(12)
+  nonce.copy(data)
+  data.writeUInt32BE(index, 8)
+  return crypto.createHmac('sha256', key).update('asar-iv:').update(data).digest().slice(0, 16)
+}
+
+// Returns the SHA-256 digest of the |size| bytes of |filename| at |start|.
+const digestFile = async function (filename, start = 0, size = undefined) {
+  const hash = crypto.createHash('sha256')
+  if (size !== 0) {
+    const end = size === undefined ? undefined : start + size - 1
+    for await (const chunk of fs.createReadStream(filename, { start, end })) {
+      hash.update(chunk)
+    }
+  }
+  return hash.digest()
+}
+
+// Returns the |size| bytes at |start| of |filename|.
+const readHead = function (filename, start, size) {
+  const head = Buffer.alloc(size)
+  const fd = fs.openSync(filename, 'r')
+  try {
+    return head.slice(0, fs.readSync(fd, head, 0, size, start))
+  } finally {
+    fs.closeSync(fd)
+  }
+}
+
+// Returns the stable nonce of |filename| when packing it with |options|.
+const stableNonceOfFile = async function (options, filename, compression) {
+  const blockSize = options.blockSize || BLOCK_SIZE
+  const version = options.version || GCM_FORMAT_VERSION
+  return stableNonce(deriveKey(options.key), await digestFile(filename), { blockSize, version }, compression)
+}
+
+const checkCompression = function (compression) {
+  if (compression !== COMPRESSION_BROTLI) {
+    throw new Error(`Unsupported compression ${compression}`)
+  }
+  if (!zlib.brotliCompressSync) {
+    throw new Error('Brotli compression requires Node.js 11.7 or later')
+  }
+}
+
+// Every block is compressed on its own, so the runtime can decompress any block
+// alone, in a window just large enough for it.
+const compressBlock = function (block, compression) {
+  checkCompression(compression)
+  const windowBits = Math.min(24, Math.max(10, Math.ceil(Math.log2(block.length + 1))))
+  return zlib.brotliCompressSync(block, {
+    params: {
+      [zlib.constants.BROTLI_PARAM_QUALITY]: BROTLI_QUALITY,
+      [zlib.constants.BROTLI_PARAM_LGWIN]: windowBits,
+      [zlib.constants.BROTLI_PARAM_SIZE_HINT]: block.length
+    }
+  })
+}
+
+// Returns the compression of |filename| when packing with |options|, files
+// that are compressed already are not.
+const compressionFor = function (options, filename) {
+  if (!options.compression || COMPRESSED_EXTENSIONS.has(path.extname(filename).toLowerCase())) {
+    return undefined
+  }
+  checkCompression(options.compression)
+  return options.compression
+}
+
+// Returns the header node of a new entry, and a function encrypting its blocks
+// in order. Compressed entries list the stored size of their blocks in every
+// format, as it can not be known from the plaintext size. |options.nonce| is
+// the stable nonce of the entry, if any.
+const createEntryEncryption = function (options) {
+  const key = deriveKey(options.key)
+  const blockSize = options.blockSize || BLOCK_SIZE
+  const { compression } = options
+  if (compression) checkCompression(compression)
+
+  let encryption, encryptStored
+  let index = 0
+  if ((options.version || GCM_FORMAT_VERSION) === BLOCK_FORMAT_VERSION) {
+    encryption = { version: BLOCK_FORMAT_VERSION, blockSize, blocks: [] }
+    encryptStored = options.nonce
+      ? (block) => encryptBlock(key, block, stableIV(key, options.nonce, index++))
+      : (block) => encryptBlock(key, block)
+  } else {
+    const nonce = options.nonce || crypto.randomBytes(8)
+    encryption = { version: GCM_FORMAT_VERSION, blockSize, nonce: nonce.toString('hex') }
+    if (options.entryKeys) encryption.entryKey = true
+    if (compression) encryption.blocks = []
+    const entryKey = options.entryKeys ? deriveEntryKey(key, nonce) : key
+    encryptStored = (block) => encryptGCMBlock(entryKey, nonce, index++, block)
+  }
+
+  return {
+    encryption,
+    compression,
+    encrypt: (block) => {
+      const encrypted = encryptStored(compression ? compressBlock(block, compression) : block)
+      if (encryption.blocks) encryption.blocks.push(encrypted.length)
+      return encrypted
+    }
+  }
+}
+
+/**
+ * Transform stream encrypting its input into one of the block formats.
+ *
+ * After the stream has finished, `encryption` holds the header node of the
+ * entry: `{ version, blockSize, nonce }` in the GCM format, or
+ * `{ version, blockSize, blocks }` in the CBC format, where `blocks` lists the
+ * stored size of every block. Compressed GCM entries also have `blocks`, and
+ * `compression` is the value of "compression" of the entry.
+ *
+ * @param {object} options: `{ key, blockSize, version, compression, nonce }`,
+ * the version defaults to the GCM format, blocks are not compressed unless
+ * |compression| is 'brotli', and |nonce| is a stable nonce from stableNonce.
+ */
+class BlockEncryptor extends stream.Transform {
+  constructor (options) {
+    super()
+    const { encryption, compression, encrypt } = createEntryEncryption(options)
+    this.blockSize = encryption.blockSize
+    this.pending = []
+    this.pendingSize = 0
+    this.encryption = encryption
+    this.compression = compression
+    this.encrypt = encrypt
+  }
+
+  pushBlock (block) {
+    this.push(this.encrypt(block))
+  }
+
+  _transform (chunk, encoding, callback) {
+    this.pending.push(chunk)
+    this.pendingSize += chunk.length
+    if (this.pendingSize >= this.blockSize) {
+      let buffer = Buffer.concat(this.pending, this.pendingSize)
+      while (buffer.length >= this.blockSize) {
+        this.pushBlock(buffer.slice(0, this.blockSize))
+        buffer = buffer.slice(this.blockSize)
+      }
+      this.pending = [buffer]
+      this.pendingSize = buffer.length
+    }
+    callback()
+  }
+
+  _flush (callback) {
+    if (this.pendingSize > 0) {
+      this.pushBlock(Buffer.concat(this.pending, this.pendingSize))
+    }
+    callback()
+  }
 }
 
+// Returns the header node and the stored size of a new entry of |size| bytes,
+// which encryptAll needs before encrypting it: GCM blocks grow by their tag,
+// CBC blocks by their IV and padding. The blocks of compressed entries are
+// only known once they are encrypted, they get an empty table. |seed| is the
+// stable nonce of the entry, if any, which seeds the IVs of CBC entries.
+const planEntryEncryption = function (size, { blockSize, version, entryKeys }, compression, seed) {
+  const blockCount = Math.ceil(size / blockSize)
+  const entryKey = entryKeys ? { entryKey: true } : {}
+  if (compression) {
+    const nonce = version === BLOCK_FORMAT_VERSION ? undefined : seed || crypto.randomBytes(8)
+    const encryption = nonce
+      ? { version: GCM_FORMAT_VERSION, blockSize, nonce: nonce.toString('hex'), ...entryKey, blocks: [] }
+      : { version, blockSize, blocks: [] }
+    return { encryption, storedSize: undefined, nonce }
+  }
+  if (version === BLOCK_FORMAT_VERSION) {
+    const blocks = []
+    for (let i = 0; i < blockCount; i++) {
+      const plainSize = Math.min(blockSize, size - i * blockSize)
+      blocks.push(16 + (Math.floor(plainSize / 16) + 1) * 16)
+    }
+    const storedSize = blocks.reduce((total, blockSize) => total + blockSize, 0)
+    return { encryption: { version, blockSize, blocks }, storedSize }
+  }
+
+  const nonce = seed || crypto.randomBytes(8)
+  return {
+    encryption: { version: GCM_FORMAT_VERSION, blockSize, nonce: nonce.toString('hex'), ...entryKey },
+    storedSize: size + blockCount * GCM_TAG_SIZE,
+    nonce
+  }
+}
+
+const encryptBuffer = function (buffer, options) {
+  const { encryption, encrypt } = createEntryEncryption(options)
+  const blocks = []
+  for (let i = 0; i < buffer.length; i += encryption.blockSize) {
+    blocks.push(encrypt(buffer.slice(i, i + encryption.blockSize)))
+  }
+  return { data: Buffer.concat(blocks), encryption }
+}
+
+module.exports.BLOCK_SIZE = BLOCK_SIZE
+module.exports.BLOCK_FORMAT_VERSION = BLOCK_FORMAT_VERSION
+module.exports.GCM_FORMAT_VERSION = GCM_FORMAT_VERSION
+module.exports.GCM_TAG_SIZE = GCM_TAG_SIZE
+module.exports.deriveKey = deriveKey
+module.exports.stableNonceOfFile = stableNonceOfFile
+module.exports.encryptBlock = encryptBlock
+module.exports.encryptGCMBlock = encryptGCMBlock
+module.exports.compressBlock = compressBlock
+module.exports.compressionFor = compressionFor
+module.exports.BlockEncryptor = BlockEncryptor
+module.exports.encryptBuffer = encryptBuffer
+
+// Writes |chunk| to |out|, resolving once |out| can take more.
+const writeChunk = function (out, chunk) {
+  return new Promise((resolve, reject) => {
+    if (out.write(chunk)) return resolve()
+    const onError = (error) => {
+      out.removeListener('drain', onDrain)
+      reject(error)
+    }
+    const onDrain = () => {
+      out.removeListener('error', onError)
+      resolve()
+    }
+    out.once('drain', onDrain)
+    out.once('error', onError)
+  })
+}
+
+// Awaits the end of the writable stream |out|.
+const endStream = function (out) {
+  return new Promise((resolve, reject) => {
+    out.once('error', reject)
+    out.end(resolve)
+  })
+}
+
+/**
+ * Encrypts every packed file of |archive| into |dest|, which gets an encrypted
+ * header. Entries already encrypted are copied as they are.
+ *
+ * Files are streamed block by block through a pool of worker threads, with a
+ * bounded number of blocks in flight, so memory does not grow with the size of
+ * the archive.
+ *
+ * @param {object} options: `{ key, blockSize, version, compression, ordering,
+ * binaryHeader, concurrency, stable, mime, entryKeys }`, where |ordering| is
+ * an ordering file for the layout of the bodies, |concurrency| the number of
+ * workers, the number of CPUs by default, |stable| derives the nonces from the
+ * content of the files, see stableNonce, |mime| records the MIME type of the
+ * files which do not have one yet, see mime.js, and |entryKeys| encrypts the
+ * GCM entries with keys of their own, see deriveEntryKey.
+ */
+module.exports.encryptAll = async function (archive, dest, options) {
+  const filesystem = disk.readFilesystemSync(archive)
+  options = Object.assign({ key: DEFAULT_KEY, blockSize: BLOCK_SIZE, version: GCM_FORMAT_VERSION }, options)
+  const key = deriveKey(options.key)
+  // The cached filesystem of |archive| is left untouched.
+  const header = JSON.parse(JSON.stringify(filesystem.header))
+
+  const entries = []
+  const collect = function (files, dir) {
+    for (const [basename, node] of Object.entries(files)) {
+      const name = dir ? `${dir}/${basename}` : basename
+      if (node.files) {
+        collect(node.files, name)
+      } else if (!node.link && !node.unpacked) {
+        entries.push({ name, node, source: filesystem.dataOffset + parseInt(node.offset) })
+      }
+    }
+  }
+  collect(header.files, '')
+
+  // Bodies are written in first-access order when there is an ordering file,
+  // such as a prefetch manifest, and keep their order in the source archive
+  // otherwise.
+  const ranks = options.ordering
+    ? rankOrdering(parseOrdering(fs.readFileSync(options.ordering).toString()))
+    : new Map()
+  const rank = (entry) => ranks.has(entry.name) ? ranks.get(entry.name) : Infinity
+  entries.sort((a, b) => (rank(a) - rank(b)) || (a.source - b.source))
+
+  let spooled = false
+  for (const entry of entries) {
+    const { node } = entry
+    entry.sourceSize = node.size
+    entry.copy = Boolean(node.encrypted)
+    if (options.mime && node.mime === undefined) {
+      // Encrypted bodies are copied as they are, without being sniffed.
+      const head = entry.copy ? undefined : readHead(archive, entry.source, Math.min(node.size, SNIFF_SIZE))
+      const type = mimeTypeOf(entry.name, head)
+      if (type) node.mime = type
+    }
+    if (!entry.copy) {
+      entry.compression = compressionFor(options, entry.name)
+      const seed = options.stable
+        ? stableNonce(key, await digestFile(archive, entry.source, node.size), options, entry.compression)
+        : undefined
+      const { encryption, storedSize, nonce } = planEntryEncryption(node.size, options, entry.compression, seed)
+      entry.nonce = nonce
+      if (!nonce) entry.ivSeed = seed
+      if (nonce && options.entryKeys) entry.key = deriveEntryKey(key, nonce)
+      node.len = node.size
+      node.size = storedSize
+      node.encrypted = true
+      if (entry.compression) {
+        node.compression = entry.compression
+        spooled = true
+      }
+      node.encryption = encryption
+    }
+  }
+
+  // Offsets follow the order the bodies are written in.
+  const layout = function () {
+    let offset = 0
+    for (const { node } of entries) {
+      node.offset = offset.toString()
+      offset += node.size
+    }
+    return offset
+  }
+
+  const out = fs.createWriteStream(dest)
+  const writeHeader = async function () {
+    const dataSize = layout()
+    const [magicHeaderBuf, sizeBuf, headerBuf] = encodeHeader(header, options.key)
+    await writeChunk(out, magicHeaderBuf)
+    await writeChunk(out, sizeBuf)
+    await writeChunk(out, headerBuf)
+    return { headerSize: magicHeaderBuf.length + sizeBuf.length + headerBuf.length, dataSize }
+  }
+
+  // Without compression, sizes do not depend on the ciphertext, so the header
+  // is complete before anything is encrypted. Otherwise the bodies go to a
+  // temporary file, which is copied after the header once the sizes of the
+  // compressed blocks are known.
+  const spoolDir = spooled ? await fs.promises.mkdtemp(path.join(os.tmpdir(), 'asar-')) : undefined
+  const spoolFile = spooled ? path.join(spoolDir, 'bodies') : undefined
+  const bodies = spooled ? fs.createWriteStream(spoolFile) : out
+
+  const source = await fs.promises.open(archive, 'r')
+  const pool = new EncryptPool(options.concurrency)
+  const maxInFlight = pool.size * 4
+  const inFlight = []
+  const queue = (entry, promise) => {
+    // Rejections are handled when the block is written.
+    promise.catch(() => {})
+    inFlight.push({ entry, promise })
+  }
+  const writeNext = async function () {
+    const { entry, promise } = inFlight.shift()
+    const data = await promise
+    if (entry.compression) entry.node.encryption.blocks.push(data.length)
+    await writeChunk(bodies, data)
+  }
+
+  try {
+    let layoutSizes = spooled ? undefined : await writeHeader()
+
+    for (const entry of entries) {
+      const { name, source: position, sourceSize, copy, nonce, ivSeed, compression } = entry
+      const entryKey = entry.key || key
+      for (let index = 0; index * options.blockSize < sourceSize; index++) {
+        const start = index * options.blockSize
+        const block = Buffer.alloc(Math.min(options.blockSize, sourceSize - start))
+        const { bytesRead } = await source.read(block, 0, block.length, position + start)
+        if (bytesRead !== block.length) {
+          throw new Error(`${name}: unexpected end of archive`)
+        }
+        const iv = ivSeed && stableIV(key, ivSeed, index)
+        queue(entry, copy ? Promise.resolve(block) : pool.encrypt(block, { key: entryKey, nonce, index, iv, compression }))
+        if (inFlight.length >= maxInFlight) await writeNext()
+      }
+    }
+    while (inFlight.length) await writeNext()
+
+    if (spooled) {
+      await endStream(bodies)
+      for (const { node, compression } of entries) {
+        if (compression) node.size = node.encryption.blocks.reduce((total, size) => total + size, 0)
+      }
+      layoutSizes = await writeHeader()
+      for await (const chunk of fs.createReadStream(spoolFile)) {
+        await writeChunk(out, chunk)
+      }
+    }
+
+    if (options.binaryHeader) {
+      const { headerSize, dataSize } = layoutSizes
+      await writeChunk(out, binaryHeader.buildTrailer(header, headerSize, headerSize + dataSize))
+    }
+    await endStream(out)
+  } catch (error) {
+    bodies.destroy()
+    out.destroy()
+    throw error
+  } finally {
+    await pool.destroy()
+    await source.close()
+    if (spooled) {
+      await fs.promises.unlink(spoolFile).catch(() => {})
+      await fs.promises.rmdir(spoolDir)
+    }
+  }
+}
@@ -1,6 +1,7 @@
 'use strict'
 
 const fs = require('./wrapped-fs')
+const { mimeTypeOfFile } = require('./mime')
 const os = require('os')
 const path = require('path')
 const { promisify } = require('util')
@@ -54,6 +55,9 @@ class Filesystem {
   async insertFile (p, shouldUnpack, file, options) {
     const dirNode = this.searchNodeFromPath(path.dirname(p))
     const node = this.searchNodeFromPath(p)
+    if (options.mime) {
+      node.mime = await mimeTypeOfFile(fs, p)
+    }
     if (shouldUnpack || dirNode.unpacked) {
       node.size = file.stat.size
       node.unpacked = true
@@ -62,7 +66,17 @@ class Filesystem {
 
     let size
 
-    const transformed = options.transform && options.transform(p)
+    // Required here as encrypt.js depends on disk.js, which depends on us.
+    const encrypt = options.encrypt && require('./encrypt')
+    const compression = encrypt && encrypt.compressionFor(options.encrypt, p)
+    const nonce = encrypt && options.encrypt.stable
+      ? await encrypt.stableNonceOfFile(options.encrypt, p, compression)
+      : undefined
+    const encryptor = encrypt && new encrypt.BlockEncryptor(Object.assign({}, options.encrypt, {
+      compression,
+      nonce
+    }))
+    const transformed = encryptor || (options.transform && options.transform(p))
     if (transformed) {
       node.len = file.stat.size
       node.encrypted = true
@@ -72,6 +86,10 @@ class Filesystem {
       const readStream = fs.createReadStream(p)
 
       await pipeline(readStream, transformed, out)
+      if (encryptor) {
+        if (encryptor.compression) node.compression = encryptor.compression
+        node.encryption = encryptor.encryption
+      }
       file.transformed = {
         path: tmpfile,
         stat: await fs.lstat(tmpfile)
@@ -0,0 +1,130 @@
+'use strict'
+
+const crypto = require('crypto')
+const pickle = require('chromium-pickle-js')
+
+// Layout of the start of an archive:
+//
+//   magic:  "BAR" and the header format, absent from plain archives
+//   size:   pickled uint32, the size of the header pickle
+//   header: pickled string, the JSON header
+//
+// Format 2 XORs the bytes of the header string with 0x43, format 3 stores them
+// as a random IV followed by their AES-128-CTR ciphertext under the key of the
+// entries. Has to match Archive::Init in archive.cc.
+
+const MAGIC = Buffer.from('BAR')
+const FORMAT_XOR = 2
+const FORMAT_CTR = 3
+// The runtime has always truncated the 579 the legacy format was written with
+// to its low byte.
+const LEGACY_MASK = 579 & 0xff
+const IV_SIZE = 16
+
+const DEFAULT_KEY = 'testtesttesttest'
+
+// Same derivation as crypto.createCipher() and the runtime: the AES key is the
+// MD5 digest of the passphrase.
+const deriveKey = function (passphrase) {
+  return crypto.createHash('md5').update(passphrase).digest()
+}
+
+// Entries packed with `entryKeys` are encrypted with a key of their own, the
+// HKDF-SHA256 of the AES key without salt, whose info is this label followed
+// by the nonce of the entry. Has to match Decryptor::DeriveEntryDecryptor.
+const ENTRY_KEY_LABEL = 'asar-entry-key:'
+
+const deriveEntryKey = function (key, nonce) {
+  const prk = crypto.createHmac('sha256', Buffer.alloc(32)).update(key).digest()
+  return crypto.createHmac('sha256', prk)
+    .update(ENTRY_KEY_LABEL)
+    .update(nonce)
+    .update(Buffer.from([1]))
+    .digest()
+    .slice(0, 16)
+}
+
+// Pickles |bytes| the way Pickle::WriteString does: payload size, length, then
+// the bytes padded to 4.
+const pickleBytes = function (bytes) {
+  const padded = (bytes.length + 3) & ~3
+  const buf = Buffer.alloc(8 + padded)
+  buf.writeUInt32LE(4 + padded, 0)
+  buf.writeInt32LE(bytes.length, 4)
+  bytes.copy(buf, 8)
+  return buf
+}
+
+/**
+ * Encodes the JSON header |header| in format 3.
+ *
+ * @param {object} header: the JSON header of the archive.
+ * @param {string} passphrase: the key of the entries.
+ * @returns {Buffer[]} magic, size pickle and header pickle, which make up the
+ * first bytes of the archive.
+ */
+module.exports.encodeHeader = function (header, passphrase = DEFAULT_KEY) {
+  const iv = crypto.randomBytes(IV_SIZE)
+  const cipher = crypto.createCipheriv('aes-128-ctr', deriveKey(passphrase), iv)
+  const json = Buffer.from(JSON.stringify(header))
+  const headerBuf = pickleBytes(Buffer.concat([iv, cipher.update(json), cipher.final()]))
+
+  const sizePickle = pickle.createEmpty()
+  sizePickle.writeUInt32(headerBuf.length)
+  const sizeBuf = sizePickle.toBuffer()
+  const magicBuf = Buffer.concat([MAGIC, Buffer.from([FORMAT_CTR])])
+  return [magicBuf, sizeBuf, headerBuf]
+}
+
+/**
+ * Reads the JSON header of the archive open as |fd|, in any format.
+ *
+ * @returns {object} `{ header, headerSize, dataOffset }`, where `headerSize` is
+ * the size of the header pickle and `dataOffset` the offset of the file
+ * contents in the archive.
+ */
+module.exports.readHeaderSync = function (fs, fd, passphrase = DEFAULT_KEY) {
+  const prefix = Buffer.alloc(12)
+  const prefixSize = fs.readSync(fd, prefix, 0, 12, 0)
+  let format = 0
+  if (prefixSize >= 4 && prefix.slice(0, 3).equals(MAGIC)) {
+    format = prefix[3]
+    if (format !== FORMAT_XOR && format !== FORMAT_CTR) {
+      throw new Error(`Unsupported header format ${format}`)
+    }
+  }
+
+  const sizeOffset = format ? 4 : 0
+  if (prefixSize < sizeOffset + 8) {
+    throw new Error('Unable to read header size')
+  }
+  const size = pickle.createFromBuffer(prefix.slice(sizeOffset, sizeOffset + 8)).createIterator().readUInt32()
+  const headerBuf = Buffer.alloc(size)
+  if (fs.readSync(fd, headerBuf, 0, size, sizeOffset + 8) !== size) {
+    throw new Error('Unable to read header')
+  }
+
+  if (size < 8 || headerBuf.readInt32LE(4) < 0 || headerBuf.readInt32LE(4) > size - 8) {
+    throw new Error('Unable to read header')
+  }
+  let bytes = headerBuf.slice(8, 8 + headerBuf.readInt32LE(4))
+  if (format === FORMAT_XOR) {
+    bytes = Buffer.from(bytes.map(c => c ^ LEGACY_MASK))
+  } else if (format === FORMAT_CTR) {
+    if (bytes.length < IV_SIZE) {
+      throw new Error('Unable to read header')
+    }
+    const decipher = crypto.createDecipheriv('aes-128-ctr', deriveKey(passphrase), bytes.slice(0, IV_SIZE))
+    bytes = Buffer.concat([decipher.update(bytes.slice(IV_SIZE)), decipher.final()])
+  }
+
+  return {
+    header: JSON.parse(bytes.toString()),
+    headerSize: size,
+    dataOffset: sizeOffset + 8 + size
+  }
+}
+
+module.exports.DEFAULT_KEY = DEFAULT_KEY
+module.exports.deriveKey = deriveKey
+module.exports.deriveEntryKey = deriveEntryKey
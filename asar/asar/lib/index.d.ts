@@ -1,9 +1,41 @@
 import { IOptions as GlobOptions } from 'glob';
 import { Stats } from 'fs';
 
+export type EncryptOptions = {
+  key: string;
+  blockSize?: number;
+  // 3 (AES-128-GCM, the default) or 2 (AES-128-CBC).
+  version?: 2 | 3;
+  // Compresses every block before encrypting it, except in files which are
+  // compressed already.
+  compression?: 'brotli';
+  // Derives the nonces from the content of the files, so unchanged files are
+  // encrypted identically from one build to the next, see createOverlay.
+  stable?: boolean;
+  // Encrypts every GCM entry with a key of its own, derived from the key and
+  // the nonce of the entry.
+  entryKeys?: boolean;
+};
+
+export type OverlayOptions = {
+  // Key of both archives.
+  key?: string;
+  binaryHeader?: boolean;
+};
+
+export type OverlayResult = {
+  reused: number;
+  added: number;
+  size: number;
+};
+
 export type CreateOptions = {
+  binaryHeader?: boolean;
   dot?: boolean;
+  encrypt?: EncryptOptions;
   globOptions?: GlobOptions;
+  // Records the MIME type of every file in the header, see lib/mime.js.
+  mime?: boolean;
   ordering?: string;
   pattern?: string;
   transform?: (filePath: string) => NodeJS.ReadWriteStream | void;
@@ -23,10 +55,28 @@ export type DirectoryMetadata = EntryMetadata & {
   files: { [property: string]: EntryMetadata };
 };
 
+export type EncryptionMetadata = {
+  version: number;
+  blockSize: number;
+  // Stored size of every block, in version 2 and in compressed entries.
+  blocks?: number[];
+  // Hex of the 8 bytes nonce of the entry, in version 3.
+  nonce?: string;
+  // The entry is encrypted with a key of its own, in version 3.
+  entryKey?: true;
+};
+
 export type FileMetadata = EntryMetadata & {
   executable?: true;
   offset?: number;
   size?: number;
+  encrypted?: true;
+  len?: number;
+  compression?: 'brotli';
+  encryption?: EncryptionMetadata;
+  // In an overlay, the offset is relative to the overlay.
+  overlay?: true;
+  mime?: string;
 };
 
 export type LinkMetadata = {
@@ -62,5 +112,11 @@ export function statFile(archive: string, filename: string, followLinks?: boolea
 export function listPackage(archive: string, options?: ListOptions): string[];
 export function extractFile(archive: string, filename: string): Buffer;
 export function extractAll(archive: string, dest: string): void;
+export function createOverlay(
+  base: string,
+  target: string,
+  dest: string,
+  options?: OverlayOptions
+): OverlayResult;
 export function uncache(archive: string): boolean;
 export function uncacheAll(): void;
@@ -0,0 +1,128 @@
+'use strict'
+
+const path = require('path')
+
+// MIME types recorded in the header as "mime" with the `mime` option, which
+// the runtime sends for the file instead of looking at its extension or
+// sniffing its first bytes. Extensions follow the mappings of net/base/mime_util.cc
+// for the types a page loads, and the sniffing rules follow net::SniffMimeType
+// for files without a usable extension.
+
+const EXTENSIONS = {
+  css: 'text/css',
+  flac: 'audio/flac',
+  gif: 'image/gif',
+  htm: 'text/html',
+  html: 'text/html',
+  ico: 'image/x-icon',
+  jpeg: 'image/jpeg',
+  jpg: 'image/jpeg',
+  js: 'text/javascript',
+  json: 'application/json',
+  m4a: 'audio/x-m4a',
+  mjs: 'text/javascript',
+  mp3: 'audio/mpeg',
+  mp4: 'video/mp4',
+  oga: 'audio/ogg',
+  ogg: 'audio/ogg',
+  ogv: 'video/ogg',
+  otf: 'font/otf',
+  pdf: 'application/pdf',
+  png: 'image/png',
+  shtml: 'text/html',
+  svg: 'image/svg+xml',
+  ttf: 'font/ttf',
+  txt: 'text/plain',
+  wasm: 'application/wasm',
+  wav: 'audio/wav',
+  webm: 'video/webm',
+  webp: 'image/webp',
+  woff: 'font/woff',
+  woff2: 'font/woff2',
+  xhtml: 'application/xhtml+xml',
+  xml: 'text/xml'
+}
+
+// Bytes sniffed at most, kMaxBytesToSniff.
+const SNIFF_SIZE = 1024
+
+const MAGIC_NUMBERS = [
+  ['%PDF-', 'application/pdf'],
+  ['%!PS-Adobe-', 'application/postscript'],
+  ['GIF87a', 'image/gif'],
+  ['GIF89a', 'image/gif'],
+  ['\x89PNG\x0d\x0a\x1a\x0a', 'image/png'],
+  ['\xff\xd8\xff', 'image/jpeg'],
+  ['BM', 'image/bmp'],
+  ['\x00\x00\x01\x00', 'image/x-icon'],
+  ['OggS\x00', 'application/ogg'],
+  ['\x1a\x45\xdf\xa3', 'video/webm'],
+  ['ID3', 'audio/mpeg'],
+  ['wOFF', 'font/woff'],
+  ['wOF2', 'font/woff2'],
+  ['\x00asm', 'application/wasm']
+]
+
+const HTML_TAGS = [
+  '<!doctype html', '<script', '<html', '<!--', '<head', '<iframe', '<h1',
+  '<div', '<font', '<table', '<a', '<style', '<title', '<b', '<body', '<br',
+  '<p', '<?xml'
+]
+
+const startsWith = (head, magic) => head.slice(0, magic.length).equals(Buffer.from(magic, 'latin1'))
+
+// Returns the sniffed type of a file starting with |head|.
+const sniff = function (head) {
+  head = head.slice(0, SNIFF_SIZE)
+  for (const [magic, type] of MAGIC_NUMBERS) {
+    if (startsWith(head, magic)) return type
+  }
+  if (startsWith(head, 'RIFF') && head.slice(8, 12).toString('latin1') === 'WEBP') return 'image/webp'
+  if (startsWith(head, 'RIFF') && head.slice(8, 12).toString('latin1') === 'WAVE') return 'audio/wav'
+
+  const text = head.toString('latin1').replace(/^[\t\n\f\r ]+/, '').toLowerCase()
+  for (const tag of HTML_TAGS) {
+    if (!text.startsWith(tag)) continue
+    // The tag has to end, as in "<b>" but not "<br0".
+    const next = text[tag.length]
+    if (next === '>' || next === ' ') return tag === '<?xml' ? 'text/xml' : 'text/html'
+  }
+
+  // Control characters other than whitespace and ESC mark a binary file.
+  for (const c of head) {
+    if (c <= 0x08 || c === 0x0b || (c >= 0x0e && c <= 0x1a) || (c >= 0x1c && c <= 0x1f)) {
+      return 'application/octet-stream'
+    }
+  }
+  return 'text/plain'
+}
+
+/**
+ * Returns the MIME type of the file |name|, from its extension, or else
+ * sniffed from |head|, its first bytes. Undefined when it can be told from
+ * neither, |head| not being given.
+ */
+module.exports.mimeTypeOf = function (name, head) {
+  const type = EXTENSIONS[path.extname(name).slice(1).toLowerCase()]
+  if (type) return type
+  return head ? sniff(head) : undefined
+}
+
+/**
+ * Returns the MIME type of the file at |p|, reading its first bytes when its
+ * extension is not enough.
+ */
+module.exports.mimeTypeOfFile = async function (fs, p) {
+  const type = module.exports.mimeTypeOf(p)
+  if (type) return type
+  const handle = await fs.promises.open(p, 'r')
+  try {
+    const head = Buffer.alloc(SNIFF_SIZE)
+    const { bytesRead } = await handle.read(head, 0, head.length, 0)
+    return sniff(head.slice(0, bytesRead))
+  } finally {
+    await handle.close()
+  }
+}
+
+module.exports.SNIFF_SIZE = SNIFF_SIZE
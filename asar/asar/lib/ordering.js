@@ -0,0 +1,73 @@
+'use strict'
+
+const path = require('path')
+
+/**
+ * Parses an ordering file: one path per line, optionally after a "prefix:"
+ * such as the offset of the prefetch manifests the runtime records.
+ *
+ * @param {string} text: content of the ordering file.
+ * @returns {string[]} the paths relative to the root of the package, with
+ * '/' separators, in order.
+ */
+const parseOrdering = function (text) {
+  return text.split('\n').map(line => {
+    if (line.includes(':')) { line = line.split(':').pop() }
+    line = line.trim().replace(/\\/g, '/')
+    if (line.startsWith('/')) { line = line.slice(1) }
+    return line
+  }).filter(line => line)
+}
+
+/**
+ * Sorts |filenames|, absolute paths under |src|, so that the files of
+ * |ordering| come first and in order, each right after its parent
+ * directories. The other files keep their order.
+ *
+ * @returns {object} `{ sorted, missing }`, where `missing` counts the files
+ * not in the ordering.
+ */
+const sortByOrdering = function (src, filenames, ordering) {
+  const known = new Set(filenames)
+  const added = new Set()
+  const sorted = []
+  const add = (file) => {
+    if (known.has(file) && !added.has(file)) {
+      added.add(file)
+      sorted.push(file)
+    }
+  }
+
+  for (const file of ordering) {
+    let str = src
+    for (const pathComponent of file.split('/')) {
+      str = path.join(str, pathComponent)
+      add(str)
+    }
+  }
+
+  const missing = filenames.length - added.size
+  for (const file of filenames) {
+    add(file)
+  }
+  return { sorted, missing }
+}
+
+/**
+ * Returns the rank of every path of |ordering|, for sorting the entries of an
+ * existing archive.
+ *
+ * @returns {Map<string, number>} from paths relative to the root, with '/'
+ * separators.
+ */
+const rankOrdering = function (ordering) {
+  const ranks = new Map()
+  ordering.forEach((file, rank) => {
+    if (!ranks.has(file)) ranks.set(file, rank)
+  })
+  return ranks
+}
+
+module.exports.parseOrdering = parseOrdering
+module.exports.sortByOrdering = sortByOrdering
+module.exports.rankOrdering = rankOrdering
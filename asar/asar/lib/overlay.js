@@ -0,0 +1,107 @@
+'use strict'
+
+const fs = require('fs')
+const crypto = require('crypto')
+const binaryHeader = require('./binary-header')
+const { DEFAULT_KEY, encodeHeader, readHeaderSync } = require('./header')
+
+// An overlay updates an archive without rewriting it: it is written next to
+// the archive as "<archive>.overlay", in the layout of an archive, and its
+// header, the complete header of the new version, replaces the one of the
+// archive at runtime.
+//
+// Entries whose stored bytes did not change keep their offset in the archive.
+// The others are appended to the overlay and marked with "overlay": true, their
+// offsets being relative to the end of the overlay header. The root of the
+// header names the archive it applies to by "base", the hex SHA-256 of the
+// archive bytes before its file contents, so an overlay left from another
+// archive is ignored. Has to match Archive::LoadOverlay in archive.cc.
+//
+// Encrypted entries only match when both archives were packed in stable mode,
+// as their nonces are random otherwise.
+
+// Calls |callback| with every packed file of |files|.
+const forEachFile = function (files, callback) {
+  for (const node of Object.values(files)) {
+    if (node.files) {
+      forEachFile(node.files, callback)
+    } else if (!node.link && !node.unpacked) {
+      callback(node)
+    }
+  }
+}
+
+const readBody = function (fd, dataOffset, node) {
+  const body = Buffer.alloc(node.size)
+  if (fs.readSync(fd, body, 0, node.size, dataOffset + parseInt(node.offset)) !== node.size) {
+    throw new Error('Unexpected end of archive')
+  }
+  return body
+}
+
+// Returns what identifies the body of |node|: the digest of its stored bytes,
+// and how they are read.
+const bodyKey = function (node, body) {
+  const { len, encrypted, compression, encryption } = node
+  return crypto.createHash('sha256').update(body).digest('hex') +
+    JSON.stringify({ len, encrypted, compression, encryption })
+}
+
+/**
+ * Writes to |dest| the overlay updating the archive |base| to the archive
+ * |target|, with the bodies of |target| which are not in |base|.
+ *
+ * @param {object} options: `{ key, binaryHeader }`, where |key| is the key of
+ * both archives, and |binaryHeader| also writes a binary index for the header
+ * of the overlay.
+ * @returns {object} `{ reused, added, size }`, the number of bodies reused
+ * from |base| and added to the overlay, and the size of the added bodies.
+ */
+module.exports.createOverlay = function (base, target, dest, options = {}) {
+  const passphrase = options.key || DEFAULT_KEY
+  const baseFd = fs.openSync(base, 'r')
+  const targetFd = fs.openSync(target, 'r')
+  try {
+    const baseArchive = readHeaderSync(fs, baseFd, passphrase)
+    const prefix = Buffer.alloc(baseArchive.dataOffset)
+    fs.readSync(baseFd, prefix, 0, prefix.length, 0)
+
+    const baseOffsets = new Map()
+    forEachFile(baseArchive.header.files, (node) => {
+      const key = bodyKey(node, readBody(baseFd, baseArchive.dataOffset, node))
+      if (!baseOffsets.has(key)) baseOffsets.set(key, node.offset)
+    })
+
+    const targetArchive = readHeaderSync(fs, targetFd, passphrase)
+    const header = targetArchive.header
+    const bodies = []
+    let size = 0
+    let reused = 0
+    forEachFile(header.files, (node) => {
+      const body = readBody(targetFd, targetArchive.dataOffset, node)
+      const offset = baseOffsets.get(bodyKey(node, body))
+      if (offset !== undefined) {
+        node.offset = offset
+        reused++
+        return
+      }
+      node.offset = size.toString()
+      node.overlay = true
+      bodies.push(body)
+      size += body.length
+    })
+    header.base = crypto.createHash('sha256').update(prefix).digest('hex')
+
+    const headerBufs = encodeHeader(header, passphrase)
+    const headerSize = headerBufs.reduce((total, buf) => total + buf.length, 0)
+    const chunks = headerBufs.concat(bodies)
+    if (options.binaryHeader) {
+      chunks.push(binaryHeader.buildTrailer(header, headerSize, headerSize + size))
+    }
+    fs.writeFileSync(dest, Buffer.concat(chunks))
+    return { reused, added: bodies.length, size }
+  } finally {
+    fs.closeSync(baseFd)
+    fs.closeSync(targetFd)
+  }
+}
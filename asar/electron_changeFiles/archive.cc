@@ -4,24 +4,57 @@
 
 #include "shell/common/asar/archive.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
 #include <string>
 #include <utility>
 #include <vector>
 #include <iostream> 
 
+#include <openssl/aead.h>
+#include <openssl/cipher.h>
+#include <openssl/evp.h>
+#include <openssl/hkdf.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "base/bind.h"
+#include "base/containers/span.h"
+#include "base/environment.h"
 #include "base/files/file.h"
 #include "base/files/file_util.h"
 #include "base/json/json_reader.h"
 #include "base/logging.h"
+#include "base/memory/ptr_util.h"
+#include "base/metrics/histogram_macros.h"
+#include "base/no_destructor.h"
+#include "base/numerics/safe_conversions.h"
+#include "base/numerics/safe_math.h"
 #include "base/pickle.h"
+#include "base/rand_util.h"
 #include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "base/strings/string_util.h"
+#include "base/task/post_job.h"
 #include "base/task/post_task.h"
+#include "base/task/thread_pool.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread_local.h"
 #include "base/threading/thread_restrictions.h"
+#include "base/timer/elapsed_timer.h"
+#include "base/trace_event/trace_event.h"
 #include "base/values.h"
+#include "build/build_config.h"
 #include "shell/common/asar/scoped_temporary_file.h"
+#include "third_party/brotli/include/brotli/decode.h"
 
 #if defined(OS_WIN)
 #include <io.h>
+#elif defined(OS_POSIX)
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 namespace asar {
@@ -34,63 +67,368 @@ const char kSeparators[] = "\\/";
 const char kSeparators[] = "/";
 #endif
 
-bool GetNodeFromPath(std::string path,
-                     const base::DictionaryValue* root,
-                     const base::DictionaryValue** out);
+// Key of the encrypted entries unless the KeyProvider has one, the AES key is
+// its MD5 digest.
+const char kEncryptionKey[] = "testtesttesttest";
 
-// Gets the "files" from "dir".
-bool GetFilesNode(const base::DictionaryValue* root,
-                  const base::DictionaryValue* dir,
-                  const base::DictionaryValue** out) {
-  // Test for symbol linked directory.
-  std::string link;
-  if (dir->GetStringWithoutPathExpansion("link", &link)) {
-    const base::DictionaryValue* linked_node = nullptr;
-    if (!GetNodeFromPath(link, root, &linked_node))
+// Prefix of the HKDF info of the keys of entries, which is followed by their
+// nonce. Has to match deriveEntryKey in lib/header.js.
+const char kEntryKeyLabel[] = "asar-entry-key:";
+
+constexpr size_t kAESBlockSize = 16;
+
+// In kEncryptionBase64 entries every 64 characters of base64 decode to exactly
+// 48 bytes, which are three whole AES blocks, so each such unit can be
+// decrypted independently of the rest of the entry.
+constexpr uint64_t kEncodedUnitSize = 64;
+constexpr uint64_t kDecodedUnitSize = 48;
+
+// Number of units handled by a single EVP call, which keeps lengths in int.
+constexpr uint64_t kMaxUnitsPerPass = 1 << 14;
+
+// Every block of kEncryptionBlocks entries starts with its IV.
+constexpr size_t kBlockIVSize = 16;
+
+// The GCM nonce of a block of kEncryptionGCM entries is the 64-bit nonce of
+// the entry followed by the 32-bit index of the block, both big-endian. Every
+// block is stored as its ciphertext followed by the tag.
+constexpr size_t kGCMNonceSize = 12;
+constexpr size_t kGCMTagSize = 16;
+
+// Archives starting with "BAR" and a format byte have their header string
+// scrambled. Legacy archives XOR it with a single byte, the low byte of the
+// 579 they were written with, newer ones encrypt it with AES-128-CTR under the
+// key of the entries and a random IV stored in front of it.
+const char kScrambledHeaderMagic[] = "BAR";
+constexpr uint8_t kHeaderFormatXor = 2;
+constexpr uint8_t kHeaderFormatCTR = 3;
+constexpr uint8_t kLegacyHeaderMask = 579 & 0xff;
+constexpr size_t kHeaderIVSize = 16;
+
+// Bytes handled by a single EVP call, which keeps lengths in int.
+constexpr size_t kMaxBytesPerPass = 1 << 30;
+
+// Plaintext decrypted by a single worker of DecryptRangeInParallel, rounded
+// to whole blocks. Large enough to amortize scheduling, small enough to
+// spread a few MB across all cores.
+constexpr uint64_t kParallelDecryptChunkSize = 256 * 1024;
+
+// Environment variable turning on the PrefetchRecorder.
+const char kRecordPrefetchVar[] = "ELECTRON_ASAR_RECORD_PREFETCH";
+
+// Environment variable naming the directory of the extraction cache of
+// CopyFileOut.
+const char kExtractCacheVar[] = "ELECTRON_ASAR_EXTRACT_CACHE";
+
+// Environment variable naming the directory V8 code caches of the entries
+// are kept in.
+const char kCodeCacheVar[] = "ELECTRON_ASAR_CODE_CACHE";
+
+// A code cache is stored as a random nonce, big endian, followed by the
+// AES-128-GCM ciphertext and tag of the cache under that nonce and this block
+// index, which no entry reaches.
+constexpr uint32_t kCodeCacheBlockIndex = 0xffffffff;
+
+// Bytes CopyFileOut decrypts, writes or hashes at a time.
+constexpr uint64_t kCopyChunkSize = 1024 * 1024;
+
+// Extension of the file next to an extracted file that holds the SHA-256 of
+// the plaintext written to it, in hex.
+const base::FilePath::CharType kFileOutDigestExtension[] =
+    FILE_PATH_LITERAL("sha256");
+
+// How long an archive only the ArchiveRegistry references stays registered
+// without being looked up, and how often a shard of the registry looks for
+// such archives.
+constexpr base::TimeDelta kRegistryIdleTime = base::TimeDelta::FromMinutes(2);
+constexpr base::TimeDelta kRegistrySweepInterval =
+    base::TimeDelta::FromSeconds(30);
+
+// Plaintext the DecryptedContentCache holds unless told otherwise.
+constexpr size_t kDefaultDecryptedCacheLimit = 16 * 1024 * 1024;
+
+std::atomic<uint64_t> g_next_decryptor_id{1};
+
+std::atomic<uint64_t> g_next_archive_generation{1};
+
+std::atomic<KeyProvider*> g_key_provider{nullptr};
+
+// Returns the key of the archive at |path|.
+std::string GetPassphrase(const base::FilePath& path) {
+  std::string passphrase;
+  KeyProvider* provider = KeyProvider::Get();
+  if (provider && provider->GetPassphrase(path, &passphrase))
+    return passphrase;
+  return kEncryptionKey;
+}
+
+// Undoes the XOR of legacy headers, 32 bytes at a time so that compilers turn
+// it into vector loads and XORs.
+void UnmaskLegacyHeader(const uint8_t* in, size_t size, uint8_t* out) {
+  constexpr uint64_t kLaneMask = 0x0101010101010101ull * kLegacyHeaderMask;
+  size_t i = 0;
+  for (; i + 4 * sizeof(uint64_t) <= size; i += 4 * sizeof(uint64_t)) {
+    uint64_t lanes[4];
+    memcpy(lanes, in + i, sizeof(lanes));
+    for (uint64_t& lane : lanes)
+      lane ^= kLaneMask;
+    memcpy(out + i, lanes, sizeof(lanes));
+  }
+  for (; i < size; ++i)
+    out[i] = in[i] ^ kLegacyHeaderMask;
+}
+
+}  // namespace
+
+struct Decryptor::Contexts {
+  uint64_t decryptor_id = 0;
+  // The Cipher values of the contexts which are set up, as a bit each.
+  uint32_t initialized = 0;
+  bssl::ScopedEVP_CIPHER_CTX ecb;
+  bssl::ScopedEVP_CIPHER_CTX cbc;
+  bssl::ScopedEVP_CIPHER_CTX ctr;
+  bssl::ScopedEVP_AEAD_CTX gcm;
+};
+
+namespace {
+
+// Number of decryptors whose cipher contexts are kept by each thread, for each
+// kind of key. There is usually only one archive key in use, and a few entries
+// with their own key being read.
+constexpr size_t kMaxCachedContexts = 8;
+
+// Cipher contexts of a single thread, keyed by the id of their decryptor with
+// the most recently used first.
+using ContextList =
+    std::array<std::unique_ptr<Decryptor::Contexts>, kMaxCachedContexts>;
+
+// The contexts of the keys of entries are kept apart, so that reading many
+// entries with their own key never evicts the contexts of the archive keys.
+struct ContextCache {
+  ContextList archive_keys;
+  ContextList entry_keys;
+};
+
+base::ThreadLocalOwnedPointer<ContextCache>& GetContextCache() {
+  static base::NoDestructor<base::ThreadLocalOwnedPointer<ContextCache>>
+      context_cache;
+  return *context_cache;
+}
+
+// The nonce of the block |block_index| of an entry whose nonce is |nonce|.
+void GetGCMBlockNonce(uint64_t nonce,
+                      uint32_t block_index,
+                      uint8_t out[kGCMNonceSize]) {
+  for (size_t i = 0; i < sizeof(nonce); ++i)
+    out[i] = static_cast<uint8_t>(nonce >> (56 - 8 * i));
+  for (size_t i = 0; i < sizeof(block_index); ++i)
+    out[sizeof(nonce) + i] = static_cast<uint8_t>(block_index >> (24 - 8 * i));
+}
+
+bool IsSeparator(char c) {
+  return strchr(kSeparators, c) != nullptr;
+}
+
+// FNV-1a of a path, with all separators hashed alike.
+uint32_t HashPath(base::StringPiece path) {
+  uint32_t hash = 2166136261u;
+  for (char c : path) {
+    hash ^= static_cast<uint8_t>(IsSeparator(c) ? '/' : c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+bool PathEquals(base::StringPiece a, base::StringPiece b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i] != b[i] && !(IsSeparator(a[i]) && IsSeparator(b[i])))
       return false;
-    dir = linked_node;
   }
+  return true;
+}
+
+// Links are followed at most this many times while resolving a path, which
+// also stops link cycles.
+constexpr int kMaxLinkDepth = 32;
 
-  return dir->GetDictionaryWithoutPathExpansion("files", out);
+bool IsJSONWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-// Gets sub-file "name" from "dir".
-bool GetChildNode(const base::DictionaryValue* root,
-                  const std::string& name,
-                  const base::DictionaryValue* dir,
-                  const base::DictionaryValue** out) {
-  if (name == "") {
-    *out = root;
-    return true;
+void SkipJSONWhitespace(base::StringPiece text, size_t* position) {
+  while (*position < text.size() && IsJSONWhitespace(text[*position]))
+    ++*position;
+}
+
+// Moves |position| past the JSON string starting at it.
+bool SkipJSONString(base::StringPiece text, size_t* position) {
+  for (size_t i = *position + 1; i < text.size(); ++i) {
+    if (text[i] == '\\') {
+      ++i;
+    } else if (text[i] == '"') {
+      *position = i + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Moves |position| past the JSON value starting at it. Containers are only
+// matched up, their content is checked once they are parsed.
+bool SkipJSONValue(base::StringPiece text, size_t* position) {
+  size_t i = *position;
+  if (i >= text.size())
+    return false;
+
+  if (text[i] == '"')
+    return SkipJSONString(text, position);
+
+  if (text[i] == '{' || text[i] == '[') {
+    size_t depth = 0;
+    while (i < text.size()) {
+      char c = text[i];
+      if (c == '"') {
+        if (!SkipJSONString(text, &i))
+          return false;
+        continue;
+      }
+      if (c == '{' || c == '[') {
+        ++depth;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        *position = i + 1;
+        return true;
+      }
+      ++i;
+    }
+    return false;
   }
 
-  const base::DictionaryValue* files = nullptr;
-  return GetFilesNode(root, dir, &files) &&
-         files->GetDictionaryWithoutPathExpansion(name, out);
+  while (i < text.size() && !IsJSONWhitespace(text[i]) && text[i] != ',' &&
+         text[i] != '}' && text[i] != ']')
+    ++i;
+  if (i == *position)
+    return false;
+  *position = i;
+  return true;
 }
 
-// Gets the node of "path" from "root".
-bool GetNodeFromPath(std::string path,
-                     const base::DictionaryValue* root,
-                     const base::DictionaryValue** out) {
-  if (path == "") {
-    *out = root;
+// Splits the JSON object |text| into its keys and the text of their values,
+// without parsing the values.
+bool ScanJSONObject(
+    base::StringPiece text,
+    std::vector<std::pair<std::string, base::StringPiece>>* members) {
+  size_t position = 0;
+  SkipJSONWhitespace(text, &position);
+  if (position >= text.size() || text[position] != '{')
+    return false;
+  ++position;
+  SkipJSONWhitespace(text, &position);
+  if (position < text.size() && text[position] == '}')
     return true;
-  }
 
-  const base::DictionaryValue* dir = root;
-  for (size_t delimiter_position = path.find_first_of(kSeparators);
-       delimiter_position != std::string::npos;
-       delimiter_position = path.find_first_of(kSeparators)) {
-    const base::DictionaryValue* child = nullptr;
-    if (!GetChildNode(root, path.substr(0, delimiter_position), dir, &child))
+  while (position < text.size()) {
+    size_t key_begin = position;
+    if (text[position] != '"' || !SkipJSONString(text, &position))
       return false;
+    base::StringPiece key_token =
+        text.substr(key_begin, position - key_begin);
+    std::string key;
+    if (key_token.find('\\') == base::StringPiece::npos) {
+      key = key_token.substr(1, key_token.size() - 2).as_string();
+    } else {
+      base::Optional<base::Value> value = base::JSONReader::Read(key_token);
+      if (!value || !value->GetAsString(&key))
+        return false;
+    }
+
+    SkipJSONWhitespace(text, &position);
+    if (position >= text.size() || text[position] != ':')
+      return false;
+    ++position;
+    SkipJSONWhitespace(text, &position);
+    size_t value_begin = position;
+    if (!SkipJSONValue(text, &position))
+      return false;
+    members->emplace_back(std::move(key),
+                          text.substr(value_begin, position - value_begin));
+
+    SkipJSONWhitespace(text, &position);
+    if (position >= text.size())
+      return false;
+    if (text[position] == '}')
+      return true;
+    if (text[position] != ',')
+      return false;
+    ++position;
+    SkipJSONWhitespace(text, &position);
+  }
+  return false;
+}
+
+// The binary index ends with its offset in the archive and this magic.
+const char kIndexMagic[] = "ASARIDX1";
+constexpr size_t kIndexFooterSize = sizeof(uint64_t) + sizeof(kIndexMagic) - 1;
+constexpr uint32_t kIndexVersion = 2;
+
+// Reads the block table of a seekable encrypted entry.
+bool FillBlocksWithNode(Archive::FileInfo* info,
+                        const base::DictionaryValue* encryption) {
+  int block_size;
+  if (!encryption->GetInteger("blockSize", &block_size) || block_size <= 0)
+    return false;
+  info->block_size = static_cast<uint32_t>(block_size);
 
-    dir = child;
-    path.erase(0, delimiter_position + 1);
+  const base::ListValue* blocks = nullptr;
+  if (!encryption->GetList("blocks", &blocks))
+    return false;
+
+  base::CheckedNumeric<uint64_t> block_offset = 0;
+  info->block_offsets.reserve(blocks->GetSize() + 1);
+  info->block_offsets.push_back(0);
+  for (size_t i = 0; i < blocks->GetSize(); ++i) {
+    int stored_size;
+    if (!blocks->GetInteger(i, &stored_size) || stored_size <= 0)
+      return false;
+    block_offset += stored_size;
+    info->block_offsets.push_back(block_offset.ValueOrDefault(0));
   }
 
-  return GetChildNode(root, path, dir, out);
+  // The table has to describe exactly the stored and the plaintext sizes.
+  uint64_t block_count = blocks->GetSize();
+  return block_offset.IsValid() && block_offset.ValueOrDie() == info->size &&
+         block_count ==
+             (uint64_t{info->len} + info->block_size - 1) / info->block_size;
+}
+
+// Whether |size| is the stored size of a kEncryptionGCM entry of |len| bytes
+// of plaintext in blocks of |block_size|.
+bool IsGCMEntrySize(uint64_t size, uint64_t len, uint64_t block_size) {
+  uint64_t block_count = (len + block_size - 1) / block_size;
+  return size == len + block_count * kGCMTagSize;
+}
+
+// Reads the block size and nonce of a kEncryptionGCM entry. Its blocks are
+// all stored at the same size so there is no table, unless they are
+// compressed.
+bool FillGCMWithNode(Archive::FileInfo* info,
+                     const base::DictionaryValue* encryption) {
+  int block_size;
+  if (!encryption->GetInteger("blockSize", &block_size) || block_size <= 0)
+    return false;
+  info->block_size = static_cast<uint32_t>(block_size);
+
+  std::string nonce;
+  if (!encryption->GetString("nonce", &nonce) || nonce.size() != 16 ||
+      !std::all_of(nonce.begin(), nonce.end(), base::IsHexDigit<char>) ||
+      !base::HexStringToUInt64(nonce, &info->nonce))
+    return false;
+  encryption->GetBoolean("entryKey", &info->entry_key);
+
+  if (info->compression != Archive::kCompressionNone)
+    return FillBlocksWithNode(info, encryption);
+  return IsGCMEntrySize(info->size, info->len, info->block_size);
 }
 
 bool FillFileInfoWithNode(Archive::FileInfo* info,
@@ -100,6 +438,7 @@ bool FillFileInfoWithNode(Archive::FileInfo* info,
   if (!node->GetInteger("size", &size))
     return false;
   info->size = static_cast<uint32_t>(size);
+  node->GetString("mime", &info->mime_type);
 
   if (node->GetBoolean("unpacked", &info->unpacked) && info->unpacked)
     return true;
@@ -118,201 +457,2181 @@ bool FillFileInfoWithNode(Archive::FileInfo* info,
   if (node->GetInteger("len", &len))
     info->len = static_cast<uint32_t>(len);
 
-  return true;
+  if (!info->encrypted)
+    return true;
+
+  std::string compression;
+  if (node->GetString("compression", &compression)) {
+    if (compression != "brotli")
+      return false;
+    info->compression = Archive::kCompressionBrotli;
+  }
+
+  const base::DictionaryValue* encryption = nullptr;
+  if (!node->GetDictionary("encryption", &encryption)) {
+    info->encryption_version = Archive::kEncryptionBase64;
+    // Base64 entries are a single stream, there are no blocks to compress.
+    return info->compression == Archive::kCompressionNone;
+  }
+
+  int version;
+  if (!encryption->GetInteger("version", &version))
+    return false;
+  info->encryption_version = static_cast<uint32_t>(version);
+  switch (version) {
+    case Archive::kEncryptionBlocks:
+      return FillBlocksWithNode(info, encryption);
+    case Archive::kEncryptionGCM:
+      return FillGCMWithNode(info, encryption);
+    default:
+      return false;
+  }
 }
 
 }  // namespace
 
-Archive::Archive(const base::FilePath& path) : path_(path) {
-  base::ThreadRestrictions::ScopedAllowIO allow_io;
-  if (base::PathExists(path_) && !file_.Initialize(path_)) {
-    LOG(ERROR) << "Failed to open ASAR archive at '" << path_.value() << "'";
+// The header flattened into fixed-size records, one per node, which are found
+// by their full path through an open addressing hash table. It is either used
+// in place from the binary form `asar pack --binary-header` appends to the
+// archive, or built from the JSON header one directory at a time, when the
+// directory is first accessed. It is not thread-safe.
+class HeaderIndex {
+ public:
+  enum Flags : uint32_t {
+    kDirectory = 1 << 0,
+    kLink = 1 << 1,
+    kUnpacked = 1 << 2,
+    kExecutable = 1 << 3,
+    kEncrypted = 1 << 4,
+    // The node is not a valid file entry.
+    kInvalid = 1 << 5,
+    // The content of the file is in the overlay.
+    kOverlay = 1 << 6,
+    // The kEncryptionGCM file is encrypted with a key of its own.
+    kEntryKey = 1 << 7,
+  };
+
+  // The layout is shared with lib/binary-header.js.
+  struct Entry {
+    // Relative to the end of the header.
+    uint64_t offset;
+    // Nonce of a kEncryptionGCM entry.
+    uint64_t nonce;
+    uint32_t path_offset;
+    uint32_t path_size;
+    uint32_t flags;
+    uint32_t size;
+    uint32_t len;
+    uint32_t encryption_version;
+    uint32_t block_size;
+    // The |block_count| + 1 block offsets of the entry in |block_offsets_|.
+    uint32_t first_block;
+    uint32_t block_count;
+    // Indices of the entries of a directory in |children_|.
+    uint32_t first_child;
+    uint32_t child_count;
+    // Target of a link, or MIME type of a file, in |strings_|.
+    uint32_t link_offset;
+    uint32_t link_size;
+    uint32_t compression;
+  };
+  static_assert(sizeof(Entry) == 72, "Entry is part of the binary index");
+
+  HeaderIndex() = default;
+
+  // Takes the |size| bytes of the JSON header in |json|, only the root
+  // directory is looked at here.
+  bool Load(std::unique_ptr<char[]> json, size_t size);
+
+  // Uses the binary index at the end of the mapped archive |data|, if there is
+  // one which belongs to a header of |header_size|.
+  bool Map(const uint8_t* data, size_t size, uint32_t header_size);
+
+  // Returns the entry of |path|, following links of its parent directories.
+  // The result is valid until the next call to Find or FindDirectory.
+  const Entry* Find(const base::FilePath& path);
+  const Entry* Find(base::StringPiece path);
+
+  // Returns the directory |path| resolves to, with its children loaded.
+  const Entry* FindDirectory(const base::FilePath& path);
+
+  base::StringPiece Path(const Entry& entry) const {
+    return strings_.substr(entry.path_offset, entry.path_size);
+  }
+  base::StringPiece Name(const Entry& entry) const;
+  base::StringPiece Link(const Entry& entry) const {
+    return strings_.substr(entry.link_offset, entry.link_size);
   }
-}
 
-Archive::~Archive() {}
+  const Entry& Child(const Entry& dir, uint32_t i) const {
+    return entries_[children_[dir.first_child + i]];
+  }
 
-bool Archive::Init() {
-  if (!file_.IsValid()) {
-    return false;
+  // The position of |entry| in the index, which does not change as more
+  // directories are loaded.
+  uint32_t IndexOf(const Entry& entry) const {
+    return static_cast<uint32_t>(&entry - entries_.data());
   }
 
-  if (file_.length() < 8) {
-    LOG(ERROR) << "Malformed ASAR file at '" << path_.value()
-               << "' (too short)";
+  // The Archive::EntryType of |entry|.
+  static int32_t TypeOf(const Entry* entry);
+
+  // The offset of |info| is |header_size| after the start of the archive,
+  // or |overlay_data_offset| for entries in the overlay.
+  void FillFileInfo(const Entry& entry,
+                    uint32_t header_size,
+                    uint64_t overlay_data_offset,
+                    Archive::FileInfo* info) const;
+
+ private:
+  // Leading fields of the binary index.
+  struct BinaryHeader {
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t bucket_count;
+    uint32_t child_count;
+    uint32_t block_offset_count;
+    uint32_t strings_size;
+    uint32_t header_size;
+    uint32_t reserved;
+  };
+
+  bool AddString(base::StringPiece string, uint32_t* offset, uint32_t* size);
+  bool AddNode(base::StringPiece path, const base::DictionaryValue& node);
+  // Adds the node whose JSON text is |node|. Directories are not parsed, the
+  // text of their "files" is kept for LoadChildren.
+  bool AddNode(base::StringPiece path, base::StringPiece node);
+
+  // Adds the entries of the directory |dir| if they have not been yet.
+  bool LoadChildren(uint32_t dir);
+  bool LoadChildren(uint32_t dir, base::StringPiece files);
+
+  // Points the tables to the storage and indexes the new entries.
+  void UpdateTables();
+
+  // Checks that every reference between the tables is in bounds.
+  bool Validate() const;
+
+  // Looks up exactly |path|.
+  const Entry* Lookup(base::StringPiece path) const;
+
+  // The tables, pointing either into the storage below or into the archive.
+  base::span<const Entry> entries_;
+  base::span<const uint32_t> children_;
+  base::span<const uint64_t> block_offsets_;
+  base::StringPiece strings_;
+  // Indices of |entries_| plus one, zero marks an empty slot. The size is a
+  // power of two.
+  base::span<const uint32_t> buckets_;
+
+  // Tables built from the JSON header.
+  std::vector<Entry> entry_storage_;
+  std::vector<uint32_t> child_storage_;
+  std::vector<uint64_t> block_offset_storage_;
+  std::string string_storage_;
+  std::vector<uint32_t> bucket_storage_;
+  // Number of the entries in |bucket_storage_|.
+  size_t indexed_count_ = 0;
+
+  // The JSON header, and the text of the "files" of the directories whose
+  // entries have not been loaded yet.
+  std::unique_ptr<char[]> json_;
+  std::unordered_map<uint32_t, base::StringPiece> pending_directories_;
+
+  DISALLOW_COPY_AND_ASSIGN(HeaderIndex);
+};
+
+bool HeaderIndex::Load(std::unique_ptr<char[]> json, size_t size) {
+  json_ = std::move(json);
+
+  std::vector<std::pair<std::string, base::StringPiece>> members;
+  if (!ScanJSONObject(base::StringPiece(json_.get(), size), &members))
     return false;
+  base::StringPiece files;
+  for (const auto& member : members) {
+    if (member.first == "files")
+      files = member.second;
   }
+  if (files.empty() || files[0] != '{')
+    return false;
+
+  Entry root = {};
+  root.flags = kDirectory;
+  entry_storage_.push_back(root);
+  pending_directories_[0] = files;
+  UpdateTables();
+  return true;
+}
+
+void HeaderIndex::UpdateTables() {
+  entries_ = entry_storage_;
+  children_ = child_storage_;
+  block_offsets_ = block_offset_storage_;
+  strings_ = string_storage_;
 
-  bool encrypted = false;
-  if (strncmp("BAR",reinterpret_cast<char *>(file_.data()),3) == 0) {
-    encrypted = true;
+  size_t bucket_count = std::max<size_t>(bucket_storage_.size(), 16);
+  while (bucket_count < entry_storage_.size() * 2)
+    bucket_count *= 2;
+  if (bucket_count != bucket_storage_.size()) {
+    bucket_storage_.assign(bucket_count, 0);
+    indexed_count_ = 0;
   }
-  
-  int offset = encrypted ? 4 : 0;
+  for (; indexed_count_ < entry_storage_.size(); ++indexed_count_) {
+    size_t slot =
+        HashPath(Path(entry_storage_[indexed_count_])) & (bucket_count - 1);
+    while (bucket_storage_[slot])
+      slot = (slot + 1) & (bucket_count - 1);
+    bucket_storage_[slot] = static_cast<uint32_t>(indexed_count_ + 1);
+  }
+  buckets_ = bucket_storage_;
+}
 
-  uint32_t size;
-  base::PickleIterator size_pickle(base::Pickle(reinterpret_cast<const char*>(file_.data() + offset), 8));
-  if (!size_pickle.ReadUInt32(&size)) {
-    LOG(ERROR) << "Failed to read header size at '" << path_.value() << "'";
+bool HeaderIndex::Map(const uint8_t* data,
+                      size_t size,
+                      uint32_t header_size) {
+#if defined(ARCH_CPU_LITTLE_ENDIAN)
+  if (size < kIndexFooterSize ||
+      memcmp(data + size - sizeof(kIndexMagic) + 1, kIndexMagic,
+             sizeof(kIndexMagic) - 1) != 0)
     return false;
-  }
 
-  if (file_.length() - 8 < size) {
-    LOG(ERROR) << "Malformed ASAR file at '" << path_.value()
-               << "' (incorrect header)";
+  uint64_t index_offset;
+  memcpy(&index_offset, data + size - kIndexFooterSize, sizeof(index_offset));
+  uint64_t index_end = size - kIndexFooterSize;
+  BinaryHeader header;
+  if (index_offset % alignof(Entry) != 0 || index_offset < header_size ||
+      index_offset > index_end || index_end - index_offset < sizeof(header))
+    return false;
+  memcpy(&header, data + index_offset, sizeof(header));
+  if (header.version != kIndexVersion || header.header_size != header_size)
     return false;
-  }
 
-  base::PickleIterator header_pickle(base::Pickle(reinterpret_cast<const char*>(file_.data() + offset + 8), size));
-  std::string header;
-  // const char** data;
-  if (!header_pickle.ReadString(&header)) {
-    LOG(ERROR) << "Failed to read header string at '" << path_.value() << "'";
-    if (!header_pickle.ReadBytes(data, size)) {
-      LOG(ERROR) << "Failed to read header string at '" << path_.value() << "'";
-      // return false;
-    }
+  base::CheckedNumeric<uint64_t> index_size = sizeof(header);
+  index_size += uint64_t{header.block_offset_count} * sizeof(uint64_t);
+  index_size += uint64_t{header.entry_count} * sizeof(Entry);
+  index_size += uint64_t{header.bucket_count} * sizeof(uint32_t);
+  index_size += uint64_t{header.child_count} * sizeof(uint32_t);
+  index_size += header.strings_size;
+  if (!index_size.IsValid() ||
+      index_size.ValueOrDie() != index_end - index_offset)
+    return false;
+
+  // Sections are in order of decreasing alignment, so they all stay aligned.
+  const uint8_t* section = data + index_offset + sizeof(header);
+  block_offsets_ = base::make_span(
+      reinterpret_cast<const uint64_t*>(section), header.block_offset_count);
+  section += block_offsets_.size() * sizeof(uint64_t);
+  entries_ = base::make_span(reinterpret_cast<const Entry*>(section),
+                             header.entry_count);
+  section += entries_.size() * sizeof(Entry);
+  buckets_ = base::make_span(reinterpret_cast<const uint32_t*>(section),
+                             header.bucket_count);
+  section += buckets_.size() * sizeof(uint32_t);
+  children_ = base::make_span(reinterpret_cast<const uint32_t*>(section),
+                              header.child_count);
+  section += children_.size() * sizeof(uint32_t);
+  strings_ = base::StringPiece(reinterpret_cast<const char*>(section),
+                               header.strings_size);
+
+  if (Validate())
+    return true;
+  entries_ = base::span<const Entry>();
+  return false;
+#else
+  return false;
+#endif
+}
+
+bool HeaderIndex::Validate() const {
+  // Lookups stop at an empty slot, so there has to be one.
+  if (entries_.empty() || buckets_.size() <= entries_.size() ||
+      (buckets_.size() & (buckets_.size() - 1)) != 0)
+    return false;
+  for (uint32_t bucket : buckets_) {
+    if (bucket > entries_.size())
+      return false;
   }
-  
-  if (encrypted) {
-    for(uint32_t i = 0; i < header.length(); i++) {
-      header[i] = header[i] ^ 579;
-    }
+  for (uint32_t child : children_) {
+    if (child >= entries_.size())
+      return false;
   }
 
-  base::Optional<base::Value> value = base::JSONReader::Read(header);
-  if (!value || !value->is_dict()) {
-    LOG(ERROR) << "Header was not valid JSON at '" << path_.value() << "'";
+  const Entry& root = entries_.front();
+  if (root.path_size != 0 || !(root.flags & kDirectory))
     return false;
+
+  for (const Entry& entry : entries_) {
+    if (uint64_t{entry.path_offset} + entry.path_size > strings_.size() ||
+        uint64_t{entry.link_offset} + entry.link_size > strings_.size() ||
+        uint64_t{entry.first_child} + entry.child_count > children_.size())
+      return false;
+    if (!(entry.flags & kEncrypted) || (entry.flags & (kUnpacked | kInvalid)))
+      continue;
+
+    // The same checks as FillFileInfoWithNode does on the JSON header.
+    if (entry.compression > Archive::kCompressionBrotli ||
+        ((entry.flags & kEntryKey) &&
+         entry.encryption_version != Archive::kEncryptionGCM))
+      return false;
+    if (entry.encryption_version == Archive::kEncryptionBase64) {
+      if (entry.compression != Archive::kCompressionNone)
+        return false;
+      continue;
+    }
+    if (entry.block_size == 0)
+      return false;
+    if (entry.encryption_version == Archive::kEncryptionGCM &&
+        entry.compression == Archive::kCompressionNone) {
+      if (!IsGCMEntrySize(entry.size, entry.len, entry.block_size))
+        return false;
+      continue;
+    }
+    if ((entry.encryption_version != Archive::kEncryptionBlocks &&
+         entry.encryption_version != Archive::kEncryptionGCM) ||
+        entry.block_count !=
+            (uint64_t{entry.len} + entry.block_size - 1) / entry.block_size)
+      return false;
+    if (entry.block_count == 0) {
+      if (entry.size != 0)
+        return false;
+      continue;
+    }
+    if (uint64_t{entry.first_block} + entry.block_count >=
+        block_offsets_.size())
+      return false;
+    auto blocks =
+        block_offsets_.subspan(entry.first_block, entry.block_count + 1);
+    if (blocks[0] != 0 || blocks[entry.block_count] != entry.size)
+      return false;
+    for (size_t i = 1; i < blocks.size(); ++i) {
+      if (blocks[i] <= blocks[i - 1])
+        return false;
+    }
   }
+  return true;
+}
 
-  header_size_ = 8 + offset + size;
-  header_ = base::DictionaryValue::From(
-      base::Value::ToUniquePtrValue(std::move(*value)));
+bool HeaderIndex::AddString(base::StringPiece string,
+                            uint32_t* offset,
+                            uint32_t* size) {
+  if (string_storage_.size() + string.size() >
+      std::numeric_limits<uint32_t>::max())
+    return false;
+  *offset = static_cast<uint32_t>(string_storage_.size());
+  *size = static_cast<uint32_t>(string.size());
+  string.AppendToString(&string_storage_);
   return true;
 }
 
-bool Archive::GetFileInfo(const base::FilePath& path, FileInfo* info) {
-  if (!header_)
+bool HeaderIndex::AddNode(base::StringPiece path,
+                          const base::DictionaryValue& node) {
+  if (entry_storage_.size() >= std::numeric_limits<uint32_t>::max() - 1)
     return false;
 
-  const base::DictionaryValue* node;
-  if (!GetNodeFromPath(path.AsUTF8Unsafe(), header_.get(), &node))
+  Entry entry = {};
+  if (!AddString(path, &entry.path_offset, &entry.path_size))
     return false;
 
   std::string link;
-  if (node->GetString("link", &link))
-    return GetFileInfo(base::FilePath::FromUTF8Unsafe(link), info);
-
-  return FillFileInfoWithNode(info, header_size_, node);
+  if (node.GetStringWithoutPathExpansion("link", &link)) {
+    entry.flags = kLink;
+    if (!AddString(link, &entry.link_offset, &entry.link_size))
+      return false;
+  } else if (node.FindKey("files")) {
+    entry.flags = kDirectory;
+  } else {
+    Archive::FileInfo info;
+    if (FillFileInfoWithNode(&info, 0, &node)) {
+      entry.offset = info.offset;
+      entry.size = info.size;
+      entry.len = info.len;
+      bool in_overlay = false;
+      node.GetBoolean("overlay", &in_overlay);
+      entry.flags = (info.unpacked ? kUnpacked : 0) |
+                    (info.executable ? kExecutable : 0) |
+                    (info.encrypted ? kEncrypted : 0) |
+                    (in_overlay ? kOverlay : 0) |
+                    (info.entry_key ? kEntryKey : 0);
+      entry.encryption_version = info.encryption_version;
+      entry.block_size = info.block_size;
+      entry.nonce = info.nonce;
+      entry.compression = info.compression;
+      if (!AddString(info.mime_type, &entry.link_offset, &entry.link_size))
+        return false;
+      if (!info.block_offsets.empty()) {
+        entry.first_block = static_cast<uint32_t>(block_offset_storage_.size());
+        entry.block_count =
+            static_cast<uint32_t>(info.block_offsets.size() - 1);
+        block_offset_storage_.insert(block_offset_storage_.end(),
+                                     info.block_offsets.begin(),
+                                     info.block_offsets.end());
+      }
+    } else {
+      entry.flags = kInvalid;
+    }
+  }
+  entry_storage_.push_back(entry);
+  return true;
 }
 
-bool Archive::Stat(const base::FilePath& path, Stats* stats) {
-  if (!header_)
+bool HeaderIndex::AddNode(base::StringPiece path, base::StringPiece node) {
+  std::vector<std::pair<std::string, base::StringPiece>> members;
+  if (!ScanJSONObject(node, &members))
     return false;
 
-  const base::DictionaryValue* node;
-  if (!GetNodeFromPath(path.AsUTF8Unsafe(), header_.get(), &node))
+  base::StringPiece files;
+  bool is_link = false;
+  for (const auto& member : members) {
+    if (member.first == "link" && member.second[0] == '"')
+      is_link = true;
+    else if (member.first == "files")
+      files = member.second;
+  }
+
+  if (is_link || files.empty()) {
+    // Files and links are small enough to just be parsed.
+    base::Optional<base::Value> value = base::JSONReader::Read(node);
+    const base::DictionaryValue* dict = nullptr;
+    return value && value->GetAsDictionary(&dict) && AddNode(path, *dict);
+  }
+
+  if (files[0] != '{' ||
+      entry_storage_.size() >= std::numeric_limits<uint32_t>::max() - 1)
+    return false;
+  Entry entry = {};
+  entry.flags = kDirectory;
+  if (!AddString(path, &entry.path_offset, &entry.path_size))
     return false;
+  pending_directories_[static_cast<uint32_t>(entry_storage_.size())] = files;
+  entry_storage_.push_back(entry);
+  return true;
+}
 
-  if (node->FindKey("link")) {
-    stats->is_file = false;
-    stats->is_link = true;
+bool HeaderIndex::LoadChildren(uint32_t dir) {
+  auto it = pending_directories_.find(dir);
+  if (it == pending_directories_.end())
     return true;
-  }
+  base::StringPiece files = it->second;
+  pending_directories_.erase(it);
 
-  if (node->FindKey("files")) {
-    stats->is_file = false;
-    stats->is_directory = true;
+  size_t entry_count = entry_storage_.size();
+  size_t child_count = child_storage_.size();
+  size_t block_offset_count = block_offset_storage_.size();
+  size_t strings_size = string_storage_.size();
+  if (LoadChildren(dir, files)) {
+    UpdateTables();
     return true;
   }
 
-  return FillFileInfoWithNode(stats, header_size_, node);
+  // A malformed directory is left empty.
+  for (auto pending = pending_directories_.begin();
+       pending != pending_directories_.end();) {
+    if (pending->first >= entry_count)
+      pending = pending_directories_.erase(pending);
+    else
+      ++pending;
+  }
+  entry_storage_.resize(entry_count);
+  child_storage_.resize(child_count);
+  block_offset_storage_.resize(block_offset_count);
+  string_storage_.resize(strings_size);
+  entry_storage_[dir].first_child = 0;
+  entry_storage_[dir].child_count = 0;
+  UpdateTables();
+  return false;
 }
 
-bool Archive::Readdir(const base::FilePath& path,
-                      std::vector<base::FilePath>* list) {
-  if (!header_)
-    return false;
-
-  const base::DictionaryValue* node;
-  if (!GetNodeFromPath(path.AsUTF8Unsafe(), header_.get(), &node))
+bool HeaderIndex::LoadChildren(uint32_t dir, base::StringPiece files) {
+  std::vector<std::pair<std::string, base::StringPiece>> members;
+  if (!ScanJSONObject(files, &members))
     return false;
 
-  const base::DictionaryValue* files;
-  if (!GetFilesNode(header_.get(), node, &files))
-    return false;
+  // Keep the order, and for repeated names the last member, of the keys of a
+  // parsed DictionaryValue.
+  std::stable_sort(
+      members.begin(), members.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
 
-  base::DictionaryValue::Iterator iter(*files);
-  while (!iter.IsAtEnd()) {
-    list->push_back(base::FilePath::FromUTF8Unsafe(iter.key()));
-    iter.Advance();
+  std::string parent = Path(entry_storage_[dir]).as_string();
+  if (!parent.empty())
+    parent.push_back('/');
+  entry_storage_[dir].first_child =
+      static_cast<uint32_t>(child_storage_.size());
+  for (size_t i = 0; i < members.size(); ++i) {
+    if (i + 1 < members.size() && members[i].first == members[i + 1].first)
+      continue;
+    // Members which are not objects are ignored.
+    if (members[i].second[0] != '{')
+      continue;
+    uint32_t index = static_cast<uint32_t>(entry_storage_.size());
+    if (!AddNode(parent + members[i].first, members[i].second))
+      return false;
+    child_storage_.push_back(index);
   }
+  entry_storage_[dir].child_count =
+      static_cast<uint32_t>(child_storage_.size()) -
+      entry_storage_[dir].first_child;
   return true;
 }
 
-bool Archive::Realpath(const base::FilePath& path, base::FilePath* realpath) {
-  if (!header_)
-    return false;
+const HeaderIndex::Entry* HeaderIndex::Lookup(base::StringPiece path) const {
+  size_t mask = buckets_.size() - 1;
+  for (size_t slot = HashPath(path) & mask; buckets_[slot];
+       slot = (slot + 1) & mask) {
+    const Entry& entry = entries_[buckets_[slot] - 1];
+    if (PathEquals(Path(entry), path))
+      return &entry;
+  }
+  return nullptr;
+}
 
-  const base::DictionaryValue* node;
-  if (!GetNodeFromPath(path.AsUTF8Unsafe(), header_.get(), &node))
-    return false;
+const HeaderIndex::Entry* HeaderIndex::Find(const base::FilePath& path) {
+#if defined(OS_WIN)
+  return Find(base::StringPiece(path.AsUTF8Unsafe()));
+#else
+  return Find(base::StringPiece(path.value()));
+#endif
+}
 
-  std::string link;
-  if (node->GetString("link", &link)) {
-    *realpath = base::FilePath::FromUTF8Unsafe(link);
-    return true;
+const HeaderIndex::Entry* HeaderIndex::Find(base::StringPiece path) {
+  const Entry* entry = Lookup(path);
+  if (entry)
+    return entry;
+
+  // The path is walked from the root, loading the directories on the way, and
+  // a linked directory is replaced by its target. Loading may move the
+  // strings |path| can point into, so it is copied first.
+  std::string resolved = path.as_string();
+  path = resolved;
+  for (int depth = 0; depth <= kMaxLinkDepth; ++depth) {
+    uint32_t dir = 0;
+    bool relinked = false;
+    for (size_t position = 0; position <= path.size(); ++position) {
+      if (position < path.size() && !IsSeparator(path[position]))
+        continue;
+      if (!LoadChildren(dir))
+        return nullptr;
+      entry = Lookup(path.substr(0, position));
+      if (!entry || position == path.size())
+        return entry;
+
+      if (entry->flags & kLink) {
+        std::string next = Link(*entry).as_string();
+        next.push_back('/');
+        path.substr(position + 1).AppendToString(&next);
+        resolved.swap(next);
+        path = resolved;
+        relinked = true;
+        break;
+      }
+      if (!(entry->flags & kDirectory))
+        return nullptr;
+      dir = static_cast<uint32_t>(entry - entries_.data());
+    }
+    if (!relinked)
+      return nullptr;
   }
+  return nullptr;
+}
 
-  *realpath = path;
-  return true;
+// static
+int32_t HeaderIndex::TypeOf(const Entry* entry) {
+  if (!entry || (entry->flags & kInvalid))
+    return Archive::kEntryNone;
+  if (entry->flags & kLink)
+    return Archive::kEntryLink;
+  if (entry->flags & kDirectory)
+    return Archive::kEntryDirectory;
+  return Archive::kEntryFile;
 }
 
-bool Archive::CopyFileOut(const base::FilePath& path, base::FilePath* out) {
-  auto it = external_files_.find(path.value());
-  if (it != external_files_.end()) {
-    *out = it->second->path();
-    return true;
+const HeaderIndex::Entry* HeaderIndex::FindDirectory(
+    const base::FilePath& path) {
+  const Entry* entry = Find(path);
+  if (entry && (entry->flags & kLink))
+    entry = Find(Link(*entry));
+  if (!entry || !(entry->flags & kDirectory))
+    return nullptr;
+
+  uint32_t dir = static_cast<uint32_t>(entry - entries_.data());
+  if (!LoadChildren(dir))
+    return nullptr;
+  return &entries_[dir];
+}
+
+base::StringPiece HeaderIndex::Name(const Entry& entry) const {
+  base::StringPiece path = Path(entry);
+  for (size_t i = path.size(); i > 0; --i) {
+    if (IsSeparator(path[i - 1]))
+      return path.substr(i);
   }
+  return path;
+}
 
-  FileInfo info;
-  if (!GetFileInfo(path, &info))
-    return false;
+void HeaderIndex::FillFileInfo(const Entry& entry,
+                               uint32_t header_size,
+                               uint64_t overlay_data_offset,
+                               Archive::FileInfo* info) const {
+  info->unpacked = entry.flags & kUnpacked;
+  info->executable = entry.flags & kExecutable;
+  info->encrypted = entry.flags & kEncrypted;
+  info->size = entry.size;
+  info->len = entry.len;
+  if (info->unpacked)
+    info->offset = 0;
+  else if (entry.flags & kOverlay)
+    info->offset = entry.offset + overlay_data_offset;
+  else
+    info->offset = entry.offset + header_size;
+  info->encryption_version = entry.encryption_version;
+  info->block_size = entry.block_size;
+  info->nonce = entry.nonce;
+  info->entry_key = entry.flags & kEntryKey;
+  info->compression = entry.compression;
+  info->mime_type = Link(entry).as_string();
+  if (entry.block_count) {
+    auto first = block_offsets_.begin() + entry.first_block;
+    info->block_offsets.assign(first, first + entry.block_count + 1);
+  }
+}
 
-  if (info.unpacked) {
-    *out = path_.AddExtension(FILE_PATH_LITERAL("unpacked")).Append(path);
-    return true;
+Decryptor::Decryptor(base::StringPiece passphrase)
+    : id_(g_next_decryptor_id.fetch_add(1, std::memory_order_relaxed)),
+      entry_key_(false) {
+  MD5(reinterpret_cast<const uint8_t*>(passphrase.data()), passphrase.size(),
+      key_);
+}
+
+Decryptor::Decryptor(const uint8_t* key)
+    : id_(g_next_decryptor_id.fetch_add(1, std::memory_order_relaxed)),
+      entry_key_(true) {
+  memcpy(key_, key, sizeof(key_));
+}
+
+Decryptor::~Decryptor() = default;
+
+// static
+const Decryptor& Decryptor::GetDefault() {
+  static base::NoDestructor<Decryptor> decryptor(
+      GetPassphrase(base::FilePath()));
+  return *decryptor;
+}
+
+std::unique_ptr<Decryptor> Decryptor::DeriveEntryDecryptor(
+    uint64_t nonce) const {
+  // No salt, the info is the label followed by the big-endian nonce.
+  uint8_t info[sizeof(kEntryKeyLabel) - 1 + sizeof(nonce)];
+  memcpy(info, kEntryKeyLabel, sizeof(kEntryKeyLabel) - 1);
+  for (size_t i = 0; i < sizeof(nonce); ++i) {
+    info[sizeof(kEntryKeyLabel) - 1 + i] =
+        static_cast<uint8_t>(nonce >> (56 - 8 * i));
   }
+  uint8_t key[sizeof(key_)];
+  if (!HKDF(key, sizeof(key), EVP_sha256(), key_, sizeof(key_), nullptr, 0,
+            info, sizeof(info)))
+    return nullptr;
+  return base::WrapUnique(new Decryptor(key));
+}
 
-  base::CheckedNumeric<uint64_t> safe_offset(info.offset);
-  auto safe_end = safe_offset + info.size;
-  if (!safe_end.IsValid() || safe_end.ValueOrDie() > file_.length())
-    return false;
+// static
+void KeyProvider::Register(std::unique_ptr<KeyProvider> provider) {
+  DCHECK(!Get());
+  // Archives may ask for keys until the process exits.
+  g_key_provider.store(provider.release(), std::memory_order_release);
+}
 
-  auto temp_file = std::make_unique<ScopedTemporaryFile>();
-  base::FilePath::StringType ext = path.Extension();
-  if (!temp_file->Init(ext))
-    return false;
+// static
+KeyProvider* KeyProvider::Get() {
+  return g_key_provider.load(std::memory_order_acquire);
+}
 
-  base::File dest(temp_file->path(),
-                  base::File::FLAG_OPEN | base::File::FLAG_WRITE);
-  if (!dest.IsValid())
-    return false;
+Decryptor::Contexts* Decryptor::GetContexts(Cipher cipher) const {
+  ContextCache* cache = GetContextCache().Get();
+  if (!cache) {
+    auto new_cache = std::make_unique<ContextCache>();
+    cache = new_cache.get();
+    GetContextCache().Set(std::move(new_cache));
+  }
+  ContextList& list = entry_key_ ? cache->entry_keys : cache->archive_keys;
 
-  dest.WriteAtCurrentPos(
-      reinterpret_cast<const char*>(file_.data() + info.offset), info.size);
+  size_t index = 0;
+  while (index < list.size() && list[index] &&
+         list[index]->decryptor_id != id_)
+    ++index;
 
-#if defined(OS_POSIX)
-  if (info.executable) {
-    // chmod a+x temp_file;
-    base::SetPosixFilePermissions(temp_file->path(), 0755);
+  if (index == list.size() || !list[index]) {
+    index = std::min(index, list.size() - 1);
+    list[index] = std::make_unique<Contexts>();
+    list[index]->decryptor_id = id_;
   }
-#endif
+  std::rotate(list.begin(), list.begin() + index, list.begin() + index + 1);
+  Contexts* contexts = list.front().get();
 
-  *out = temp_file->path();
-  external_files_[path.value()] = std::move(temp_file);
-  return true;
+  // Expanding the key is done once per cipher here, only for the ciphers the
+  // entries being read use, and later callers only set the IV.
+  uint32_t bit = 1u << cipher;
+  if (contexts->initialized & bit)
+    return contexts;
+  bool initialized = false;
+  switch (cipher) {
+    case kCipherECB:
+      initialized = EVP_DecryptInit_ex(contexts->ecb.get(), EVP_aes_128_ecb(),
+                                       nullptr, key_, nullptr) &&
+                    EVP_CIPHER_CTX_set_padding(contexts->ecb.get(), 0);
+      break;
+    case kCipherCBC:
+      initialized = EVP_DecryptInit_ex(contexts->cbc.get(), EVP_aes_128_cbc(),
+                                       nullptr, key_, nullptr);
+      break;
+    case kCipherCTR:
+      initialized = EVP_DecryptInit_ex(contexts->ctr.get(), EVP_aes_128_ctr(),
+                                       nullptr, key_, nullptr);
+      break;
+    case kCipherGCM:
+      initialized =
+          EVP_AEAD_CTX_init(contexts->gcm.get(), EVP_aead_aes_128_gcm(), key_,
+                            sizeof(key_), kGCMTagSize, nullptr);
+      break;
+  }
+  if (!initialized)
+    return nullptr;
+  contexts->initialized |= bit;
+  return contexts;
+}
+
+bool Decryptor::DecryptBase64Range(const uint8_t* encoded,
+                                   uint64_t encoded_size,
+                                   uint64_t position,
+                                   uint64_t end,
+                                   uint8_t* out) const {
+  Contexts* contexts = GetContexts(kCipherECB);
+  if (!contexts)
+    return false;
+
+  // The plaintext size is known, so the padding is simply cut off and the
+  // context carries no state from one call to the next.
+  EVP_CIPHER_CTX* ctx = contexts->ecb.get();
+  while (position < end) {
+    uint64_t unit = position / kDecodedUnitSize;
+    uint64_t skip = position - unit * kDecodedUnitSize;
+    uint64_t encoded_begin = unit * kEncodedUnitSize;
+    if (encoded_begin >= encoded_size)
+      return false;
+
+    uint64_t whole_units =
+        skip == 0 ? std::min((end - position) / kDecodedUnitSize,
+                             kMaxUnitsPerPass)
+                  : 0;
+    if (whole_units > 0) {
+      // Units holding plaintext are never the short one at the end of the
+      // entry, so they decode to exactly |kDecodedUnitSize| bytes.
+      uint64_t encoded_length = whole_units * kEncodedUnitSize;
+      int decoded_length = static_cast<int>(whole_units * kDecodedUnitSize);
+      int out_length = 0;
+      if (encoded_begin + encoded_length > encoded_size ||
+          EVP_DecodeBlock(out, encoded + encoded_begin, encoded_length) !=
+              decoded_length ||
+          !EVP_CipherUpdate(ctx, out, &out_length, out, decoded_length))
+        return false;
+      out += decoded_length;
+      position += decoded_length;
+      continue;
+    }
+
+    uint8_t unit_buffer[kDecodedUnitSize];
+    uint64_t encoded_length =
+        std::min(kEncodedUnitSize, encoded_size - encoded_begin);
+    int decoded_length =
+        EVP_DecodeBlock(unit_buffer, encoded + encoded_begin, encoded_length);
+    if (decoded_length < 0)
+      return false;
+    // Trailing "=" are decoded as zero bytes, which only makes the final
+    // partial AES block longer and is cut off here.
+    int cipher_length = decoded_length - decoded_length % kAESBlockSize;
+    uint64_t count = std::min(end - position, kDecodedUnitSize - skip);
+    int out_length = 0;
+    if (skip + count > static_cast<uint64_t>(cipher_length) ||
+        !EVP_CipherUpdate(ctx, unit_buffer, &out_length, unit_buffer,
+                          cipher_length))
+      return false;
+    memcpy(out, unit_buffer + skip, count);
+    out += count;
+    position += count;
+  }
+  return true;
+}
+
+bool Decryptor::DecryptBlock(const uint8_t* block,
+                             size_t stored_size,
+                             uint8_t* out,
+                             size_t plain_size) const {
+  // PKCS#7 always pads, by a whole AES block if needed, so the last AES block
+  // holds the |plain_size| % 16 trailing bytes and the padding.
+  size_t full_size = plain_size - plain_size % kAESBlockSize;
+  if (stored_size != kBlockIVSize + full_size + kAESBlockSize ||
+      stored_size > kMaxBytesPerPass)
+    return false;
+
+  Contexts* contexts = GetContexts(kCipherCBC);
+  if (!contexts)
+    return false;
+
+  // Without padding, the context writes exactly as many bytes as it is given,
+  // so the whole AES blocks go straight to |out| and the last one, which
+  // |out| has no room for, to |last_block|.
+  EVP_CIPHER_CTX* ctx = contexts->cbc.get();
+  uint8_t last_block[kAESBlockSize];
+  int out_length = 0;
+  int last_length = 0;
+  if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, block) ||
+      !EVP_CIPHER_CTX_set_padding(ctx, 0) ||
+      !EVP_DecryptUpdate(ctx, out, &out_length, block + kBlockIVSize,
+                         full_size) ||
+      !EVP_DecryptUpdate(ctx, last_block, &last_length,
+                         block + kBlockIVSize + full_size, kAESBlockSize) ||
+      static_cast<size_t>(out_length) != full_size ||
+      static_cast<size_t>(last_length) != kAESBlockSize)
+    return false;
+
+  size_t padding = kAESBlockSize - plain_size % kAESBlockSize;
+  for (size_t i = kAESBlockSize - padding; i < kAESBlockSize; ++i) {
+    if (last_block[i] != padding)
+      return false;
+  }
+  memcpy(out + full_size, last_block, kAESBlockSize - padding);
+  return true;
+}
+
+bool Decryptor::DecryptPaddedBlock(const uint8_t* block,
+                                   size_t stored_size,
+                                   uint8_t* out,
+                                   size_t* plain_size) const {
+  if (stored_size < kBlockIVSize + kAESBlockSize ||
+      (stored_size - kBlockIVSize) % kAESBlockSize != 0 ||
+      stored_size > kMaxBytesPerPass)
+    return false;
+
+  Contexts* contexts = GetContexts(kCipherCBC);
+  if (!contexts)
+    return false;
+
+  // Only the IV is set, the key schedule of the context is kept. DecryptBlock
+  // turns padding off in the same context.
+  EVP_CIPHER_CTX* ctx = contexts->cbc.get();
+  int out_length = 0;
+  int final_length = 0;
+  if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, block) ||
+      !EVP_CIPHER_CTX_set_padding(ctx, 1) ||
+      !EVP_DecryptUpdate(ctx, out, &out_length, block + kBlockIVSize,
+                         stored_size - kBlockIVSize) ||
+      !EVP_DecryptFinal_ex(ctx, out + out_length, &final_length))
+    return false;
+  *plain_size = out_length + final_length;
+  return true;
+}
+
+bool Decryptor::DecryptGCMBlock(uint64_t nonce,
+                                uint32_t block_index,
+                                const uint8_t* block,
+                                size_t stored_size,
+                                uint8_t* out,
+                                size_t plain_size) const {
+  if (stored_size != plain_size + kGCMTagSize)
+    return false;
+
+  Contexts* contexts = GetContexts(kCipherGCM);
+  if (!contexts)
+    return false;
+
+  uint8_t block_nonce[kGCMNonceSize];
+  GetGCMBlockNonce(nonce, block_index, block_nonce);
+
+  // Decrypts and authenticates in a single pass over the block.
+  size_t out_length = 0;
+  return EVP_AEAD_CTX_open(contexts->gcm.get(), out, &out_length, plain_size,
+                           block_nonce, sizeof(block_nonce), block,
+                           stored_size, nullptr, 0) &&
+         out_length == plain_size;
+}
+
+bool Decryptor::EncryptGCMBlock(uint64_t nonce,
+                                uint32_t block_index,
+                                const uint8_t* in,
+                                size_t size,
+                                uint8_t* out) const {
+  Contexts* contexts = GetContexts(kCipherGCM);
+  if (!contexts)
+    return false;
+
+  uint8_t block_nonce[kGCMNonceSize];
+  GetGCMBlockNonce(nonce, block_index, block_nonce);
+  size_t out_length = 0;
+  return EVP_AEAD_CTX_seal(contexts->gcm.get(), out, &out_length,
+                           size + kGCMTagSize, block_nonce,
+                           sizeof(block_nonce), in, size, nullptr, 0) &&
+         out_length == size + kGCMTagSize;
+}
+
+bool Decryptor::DecryptHeader(const uint8_t* in,
+                              size_t size,
+                              uint8_t* out) const {
+  if (size < kHeaderIVSize)
+    return false;
+
+  Contexts* contexts = GetContexts(kCipherCTR);
+  if (!contexts)
+    return false;
+
+  // CTR is a keystream XOR which BoringSSL computes many AES blocks at a time,
+  // so this runs at memory speed.
+  EVP_CIPHER_CTX* ctx = contexts->ctr.get();
+  if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, in))
+    return false;
+  in += kHeaderIVSize;
+  size -= kHeaderIVSize;
+  while (size > 0) {
+    int length = static_cast<int>(std::min(size, kMaxBytesPerPass));
+    int out_length = 0;
+    if (!EVP_DecryptUpdate(ctx, out, &out_length, in, length) ||
+        out_length != length)
+      return false;
+    in += length;
+    out += length;
+    size -= length;
+  }
+  return true;
+}
+
+DecryptedContentCache::DecryptedContentCache()
+    : entries_(decltype(entries_)::NO_AUTO_EVICT) {
+  stats_.limit = kDefaultDecryptedCacheLimit;
+}
+
+DecryptedContentCache::~DecryptedContentCache() = default;
+
+// static
+DecryptedContentCache* DecryptedContentCache::GetInstance() {
+  static base::NoDestructor<DecryptedContentCache> instance;
+  return instance.get();
+}
+
+void DecryptedContentCache::SetLimit(size_t limit) {
+  base::AutoLock auto_lock(lock_);
+  stats_.limit = limit;
+  EvictToLimit();
+}
+
+bool DecryptedContentCache::ShouldCache(size_t size) {
+  base::AutoLock auto_lock(lock_);
+  return size > 0 && size <= stats_.limit / 4;
+}
+
+scoped_refptr<base::RefCountedBytes> DecryptedContentCache::Get(
+    uint64_t generation,
+    uint64_t offset) {
+  base::AutoLock auto_lock(lock_);
+  auto it = entries_.Get(Key(generation, offset));
+  if (it == entries_.end()) {
+    ++stats_.misses;
+    return nullptr;
+  }
+  ++stats_.hits;
+  return it->second;
+}
+
+void DecryptedContentCache::Put(
+    uint64_t generation,
+    uint64_t offset,
+    scoped_refptr<base::RefCountedBytes> plaintext) {
+  base::AutoLock auto_lock(lock_);
+  Key key(generation, offset);
+  // Another thread may have decrypted the same entry meanwhile.
+  auto it = entries_.Peek(key);
+  if (it != entries_.end())
+    stats_.size -= it->second->size();
+  stats_.size += plaintext->size();
+  entries_.Put(std::move(key), std::move(plaintext));
+  EvictToLimit();
+}
+
+DecryptedContentCache::Stats DecryptedContentCache::GetStats() {
+  base::AutoLock auto_lock(lock_);
+  Stats stats = stats_;
+  stats.entry_count = entries_.size();
+  return stats;
+}
+
+void DecryptedContentCache::Clear() {
+  base::AutoLock auto_lock(lock_);
+  entries_.Clear();
+  stats_.size = 0;
+}
+
+void DecryptedContentCache::EvictToLimit() {
+  lock_.AssertAcquired();
+  while (stats_.size > stats_.limit) {
+    auto oldest = entries_.rbegin();
+    stats_.size -= oldest->second->size();
+    entries_.Erase(oldest);
+    ++stats_.evictions;
+  }
+}
+
+PrefetchRecorder::PrefetchRecorder()
+    : recording_(base::Environment::Create()->HasVar(kRecordPrefetchVar)) {}
+
+PrefetchRecorder::~PrefetchRecorder() = default;
+
+// static
+PrefetchRecorder* PrefetchRecorder::GetInstance() {
+  static base::NoDestructor<PrefetchRecorder> instance;
+  return instance.get();
+}
+
+void PrefetchRecorder::Record(const base::FilePath& archive,
+                              const base::FilePath& path,
+                              uint64_t offset) {
+  base::AutoLock auto_lock(lock_);
+  if (!is_recording())
+    return;
+  Manifest& manifest = manifests_[archive];
+  if (!manifest.paths.insert(path.value()).second)
+    return;
+  manifest.lines += base::NumberToString(offset);
+  manifest.lines += ": ";
+  manifest.lines += path.NormalizePathSeparatorsTo('/').AsUTF8Unsafe();
+  manifest.lines += '\n';
+}
+
+bool PrefetchRecorder::WriteManifests() {
+  base::AutoLock auto_lock(lock_);
+  recording_.store(false, std::memory_order_relaxed);
+
+  base::ThreadRestrictions::ScopedAllowIO allow_io;
+  bool success = true;
+  for (const auto& manifest : manifests_) {
+    const std::string& lines = manifest.second.lines;
+    base::FilePath path = Archive::GetPrefetchManifestPath(manifest.first);
+    if (base::WriteFile(path, lines.data(), lines.size()) !=
+        static_cast<int>(lines.size())) {
+      LOG(ERROR) << "Failed to write prefetch manifest at '" << path.value()
+                 << "'";
+      success = false;
+    }
+  }
+  manifests_.clear();
+  return success;
+}
+
+ArchiveRegistry::ArchiveRegistry() = default;
+
+ArchiveRegistry::~ArchiveRegistry() = default;
+
+// static
+ArchiveRegistry* ArchiveRegistry::GetInstance() {
+  static base::NoDestructor<ArchiveRegistry> instance;
+  return instance.get();
+}
+
+std::shared_ptr<Archive> ArchiveRegistry::GetOrCreate(
+    const base::FilePath& path) {
+  Shard& shard = GetShard(path);
+  base::TimeTicks now = base::TimeTicks::Now();
+  std::vector<std::shared_ptr<Archive>> evicted;
+  {
+    base::AutoLock auto_lock(shard.lock);
+    // Archives are evicted along the lookups of their shard, so there is no
+    // timer to run.
+    if (now - shard.last_sweep >= kRegistrySweepInterval) {
+      shard.last_sweep = now;
+      EvictLocked(&shard, now - kRegistryIdleTime, &evicted);
+    }
+    auto it = shard.archives.find(path.value());
+    if (it != shard.archives.end()) {
+      it->second.last_used = now;
+      return it->second.archive;
+    }
+  }
+  // Released without the lock, unmapping may block.
+  evicted.clear();
+
+  // Opening is done without the lock, so a slow disk does not hold up the
+  // other archives of the shard. Should another thread register the same
+  // archive meanwhile, its instance is kept and this one dropped.
+  auto archive = std::make_shared<Archive>(path);
+  if (!archive->Init())
+    return nullptr;
+  std::shared_ptr<Archive> registered;
+  {
+    base::AutoLock auto_lock(shard.lock);
+    Entry& entry = shard.archives[path.value()];
+    if (!entry.archive)
+      entry.archive = archive;
+    entry.last_used = base::TimeTicks::Now();
+    registered = entry.archive;
+  }
+  // Only the instance which got registered is warmed up, once.
+  if (registered == archive)
+    Archive::Prefetch(archive);
+  return registered;
+}
+
+size_t ArchiveRegistry::EvictIdle(base::TimeDelta idle_time) {
+  base::TimeTicks idle_since = base::TimeTicks::Now() - idle_time;
+  std::vector<std::shared_ptr<Archive>> evicted;
+  for (Shard& shard : shards_) {
+    base::AutoLock auto_lock(shard.lock);
+    EvictLocked(&shard, idle_since, &evicted);
+  }
+  return evicted.size();
+}
+
+ArchiveRegistry::Shard& ArchiveRegistry::GetShard(const base::FilePath& path) {
+  return shards_[std::hash<base::FilePath::StringType>()(path.value()) %
+                 kShardCount];
+}
+
+// static
+void ArchiveRegistry::EvictLocked(
+    Shard* shard,
+    base::TimeTicks idle_since,
+    std::vector<std::shared_ptr<Archive>>* evicted) {
+  for (auto it = shard->archives.begin(); it != shard->archives.end();) {
+    // Another reference can only be made under the lock, from this one.
+    if (it->second.archive.use_count() == 1 &&
+        it->second.last_used < idle_since) {
+      evicted->push_back(std::move(it->second.archive));
+      it = shard->archives.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+Archive::Archive(const base::FilePath& path)
+    : path_(path),
+      generation_(
+          g_next_archive_generation.fetch_add(1, std::memory_order_relaxed)) {
+  base::ThreadRestrictions::ScopedAllowIO allow_io;
+  if (base::PathExists(path_) && !file_.Initialize(path_)) {
+    LOG(ERROR) << "Failed to open ASAR archive at '" << path_.value() << "'";
+  }
+}
+
+Archive::~Archive() {}
+
+bool Archive::Init() {
+  TRACE_EVENT1("electron", "Archive::Init", "path", path_.AsUTF8Unsafe());
+  base::ElapsedTimer timer;
+  if (!file_.IsValid()) {
+    return false;
+  }
+
+  decryptor_ = std::make_unique<Decryptor>(GetPassphrase(path_));
+
+  uint32_t header_size;
+  if (!ReadHeader(file_, path_, &header_size, nullptr, nullptr))
+    return false;
+  header_size_ = header_size;
+
+  if (!LoadOverlay()) {
+    // With a binary index the JSON header is neither decoded nor parsed.
+    auto index = std::make_unique<HeaderIndex>();
+    if (!index->Map(file_.data(), file_.length(), header_size)) {
+      std::unique_ptr<char[]> json;
+      size_t json_size = 0;
+      if (!ReadHeader(file_, path_, &header_size, &json, &json_size))
+        return false;
+
+      // Directories are only parsed once they are accessed.
+      if (!index->Load(std::move(json), json_size)) {
+        LOG(ERROR) << "Header was not valid JSON at '" << path_.value()
+                   << "'";
+        return false;
+      }
+    }
+    index_ = std::move(index);
+  }
+
+  init_time_ = timer.Elapsed();
+  UMA_HISTOGRAM_TIMES("Electron.Asar.InitTime", init_time_);
+  UMA_HISTOGRAM_COUNTS_10M("Electron.Asar.HeaderSize", header_size_);
+  return true;
+}
+
+bool Archive::ReadHeader(const base::MemoryMappedFile& file,
+                         const base::FilePath& path,
+                         uint32_t* header_size,
+                         std::unique_ptr<char[]>* json,
+                         size_t* json_size) {
+  if (file.length() < 8) {
+    LOG(ERROR) << "Malformed ASAR file at '" << path.value()
+               << "' (too short)";
+    return false;
+  }
+
+  uint8_t header_format = 0;
+  if (memcmp(file.data(), kScrambledHeaderMagic,
+             sizeof(kScrambledHeaderMagic) - 1) == 0) {
+    header_format = file.data()[sizeof(kScrambledHeaderMagic) - 1];
+    if (header_format != kHeaderFormatXor &&
+        header_format != kHeaderFormatCTR) {
+      LOG(ERROR) << "Unsupported header format at '" << path.value() << "'";
+      return false;
+    }
+  }
+
+  int offset = header_format ? 4 : 0;
+  if (file.length() < 8u + offset) {
+    LOG(ERROR) << "Malformed ASAR file at '" << path.value()
+               << "' (too short)";
+    return false;
+  }
+
+  uint32_t size;
+  base::PickleIterator size_pickle(base::Pickle(reinterpret_cast<const char*>(file.data() + offset), 8));
+  if (!size_pickle.ReadUInt32(&size)) {
+    LOG(ERROR) << "Failed to read header size at '" << path.value() << "'";
+    return false;
+  }
+
+  if (file.length() - 8 - offset < size) {
+    LOG(ERROR) << "Malformed ASAR file at '" << path.value()
+               << "' (incorrect header)";
+    return false;
+  }
+
+  *header_size = 8 + offset + size;
+  if (!json)
+    return true;
+
+  // The header string is read where it is mapped, and decoded in the same
+  // pass that copies it out.
+  base::PickleIterator header_pickle(base::Pickle(reinterpret_cast<const char*>(file.data() + offset + 8), size));
+  base::StringPiece header;
+  if (!header_pickle.ReadStringPiece(&header)) {
+    LOG(ERROR) << "Failed to read header string at '" << path.value() << "'";
+    return false;
+  }
+
+  const uint8_t* scrambled = reinterpret_cast<const uint8_t*>(header.data());
+  *json_size = header.size();
+  switch (header_format) {
+    case kHeaderFormatXor:
+      json->reset(new char[*json_size]);
+      UnmaskLegacyHeader(scrambled, *json_size,
+                         reinterpret_cast<uint8_t*>(json->get()));
+      break;
+    case kHeaderFormatCTR:
+      if (*json_size < kHeaderIVSize) {
+        LOG(ERROR) << "Failed to read header string at '" << path.value()
+                   << "'";
+        return false;
+      }
+      *json_size -= kHeaderIVSize;
+      json->reset(new char[*json_size]);
+      if (!decryptor_->DecryptHeader(scrambled, header.size(),
+                                     reinterpret_cast<uint8_t*>(json->get()))) {
+        LOG(ERROR) << "Failed to decrypt header at '" << path.value() << "'";
+        return false;
+      }
+      break;
+    default:
+      json->reset(new char[*json_size]);
+      memcpy(json->get(), header.data(), *json_size);
+      break;
+  }
+  return true;
+}
+
+bool Archive::LoadOverlay() {
+  base::ThreadRestrictions::ScopedAllowIO allow_io;
+  base::FilePath overlay_path = GetOverlayPath(path_);
+  if (!base::PathExists(overlay_path))
+    return false;
+
+  auto overlay_file = std::make_unique<base::MemoryMappedFile>();
+  uint32_t header_size;
+  std::unique_ptr<char[]> json;
+  size_t json_size = 0;
+  if (!overlay_file->Initialize(overlay_path) ||
+      !ReadHeader(*overlay_file, overlay_path, &header_size, &json,
+                  &json_size))
+    return false;
+
+  // The overlay names the archive it was made for by the SHA-256 of its
+  // header, which differs from build to build as the header is encrypted
+  // under a random IV. An overlay left from an older archive is ignored.
+  std::vector<std::pair<std::string, base::StringPiece>> members;
+  base::StringPiece base_digest;
+  if (ScanJSONObject(base::StringPiece(json.get(), json_size), &members)) {
+    for (const auto& member : members) {
+      if (member.first == "base")
+        base_digest = member.second;
+    }
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(file_.data(), header_size_, digest);
+  std::string expected_digest =
+      "\"" + base::ToLowerASCII(base::HexEncode(digest, sizeof(digest))) +
+      "\"";
+  if (base_digest != expected_digest) {
+    LOG(WARNING) << "Ignoring the overlay at '" << overlay_path.value()
+                 << "', which belongs to another archive";
+    return false;
+  }
+
+  auto index = std::make_unique<HeaderIndex>();
+  if (!index->Map(overlay_file->data(), overlay_file->length(), header_size) &&
+      !index->Load(std::move(json), json_size)) {
+    LOG(ERROR) << "Header was not valid JSON at '" << overlay_path.value()
+               << "'";
+    return false;
+  }
+
+  overlay_data_offset_ = file_.length() + header_size;
+  overlay_file_ = std::move(overlay_file);
+  index_ = std::move(index);
+  return true;
+}
+
+bool Archive::GetFileInfo(const base::FilePath& path, FileInfo* info) {
+  // Lookups are too frequent for a histogram, they are only counted.
+  TRACE_EVENT0("electron", "Archive::GetFileInfo");
+  metrics_.lookups.fetch_add(1, std::memory_order_relaxed);
+  if (!LookupFileInfo(path, info))
+    return false;
+  if (!info->unpacked) {
+    PrefetchRecorder::GetInstance()->Record(path_, path,
+                                            GetEntryOffset(*info));
+  }
+  return true;
+}
+
+bool Archive::LookupFileInfo(const base::FilePath& path, FileInfo* info) {
+  if (!index_)
+    return false;
+
+  base::AutoLock auto_lock(index_lock_);
+
+  const HeaderIndex::Entry* entry = index_->Find(path);
+  for (int depth = 0; entry && (entry->flags & HeaderIndex::kLink); ++depth) {
+    if (depth == kMaxLinkDepth)
+      return false;
+    entry = index_->Find(index_->Link(*entry));
+  }
+  if (!entry || (entry->flags & (HeaderIndex::kDirectory |
+                                 HeaderIndex::kInvalid)))
+    return false;
+
+  index_->FillFileInfo(*entry, header_size_, overlay_data_offset_, info);
+  if (info->entry_key) {
+    info->decryptor = GetEntryDecryptor(info->nonce);
+    if (!info->decryptor)
+      return false;
+  }
+  return true;
+}
+
+uint64_t Archive::GetEntryOffset(const FileInfo& info) const {
+  if (overlay_file_ && info.offset >= overlay_data_offset_)
+    return info.offset - overlay_data_offset_;
+  return info.offset - header_size_;
+}
+
+bool Archive::Stat(const base::FilePath& path, Stats* stats) {
+  if (!index_)
+    return false;
+
+  base::AutoLock auto_lock(index_lock_);
+
+  const HeaderIndex::Entry* entry = index_->Find(path);
+  if (!entry)
+    return false;
+
+  if (entry->flags & HeaderIndex::kLink) {
+    stats->is_file = false;
+    stats->is_link = true;
+    return true;
+  }
+
+  if (entry->flags & HeaderIndex::kDirectory) {
+    stats->is_file = false;
+    stats->is_directory = true;
+    return true;
+  }
+
+  if (entry->flags & HeaderIndex::kInvalid)
+    return false;
+
+  index_->FillFileInfo(*entry, header_size_, overlay_data_offset_, stats);
+  return true;
+}
+
+void Archive::GetEntryTypes(const std::vector<base::FilePath>& paths,
+                            int32_t* types) {
+  if (!index_) {
+    std::fill(types, types + paths.size(), kEntryNone);
+    return;
+  }
+
+  base::AutoLock auto_lock(index_lock_);
+  for (size_t i = 0; i < paths.size(); ++i)
+    types[i] = HeaderIndex::TypeOf(index_->Find(paths[i]));
+}
+
+bool Archive::Readdir(const base::FilePath& path,
+                      std::vector<base::FilePath>* list) {
+  const DirectoryListing* listing = GetDirectoryListing(path);
+  if (!listing)
+    return false;
+  list->insert(list->end(), listing->names.begin(), listing->names.end());
+  return true;
+}
+
+const Archive::DirectoryListing* Archive::GetDirectoryListing(
+    const base::FilePath& path) {
+  if (!index_)
+    return nullptr;
+
+  base::AutoLock auto_lock(index_lock_);
+
+  const HeaderIndex::Entry* entry = index_->FindDirectory(path);
+  if (!entry)
+    return nullptr;
+
+  std::unique_ptr<DirectoryListing>& listing =
+      directory_listings_[index_->IndexOf(*entry)];
+  if (listing)
+    return listing.get();
+
+  listing = std::make_unique<DirectoryListing>();
+  listing->names.reserve(entry->child_count);
+  listing->types.reserve(entry->child_count);
+  for (uint32_t i = 0; i < entry->child_count; ++i) {
+    const HeaderIndex::Entry& child = index_->Child(*entry, i);
+    listing->names.push_back(
+        base::FilePath::FromUTF8Unsafe(index_->Name(child)));
+    listing->types.push_back(HeaderIndex::TypeOf(&child));
+  }
+  return listing.get();
+}
+
+bool Archive::Realpath(const base::FilePath& path, base::FilePath* realpath) {
+  if (!index_)
+    return false;
+
+  base::AutoLock auto_lock(index_lock_);
+
+  const HeaderIndex::Entry* entry = index_->Find(path);
+  if (!entry)
+    return false;
+
+  if (entry->flags & HeaderIndex::kLink) {
+    *realpath = base::FilePath::FromUTF8Unsafe(index_->Link(*entry));
+    return true;
+  }
+
+  *realpath = path;
+  return true;
+}
+
+bool Archive::CopyFileOut(const base::FilePath& path, base::FilePath* out) {
+  TRACE_EVENT1("electron", "Archive::CopyFileOut", "path", path.AsUTF8Unsafe());
+  {
+    base::AutoLock auto_lock(files_lock_);
+    auto it = external_files_.find(path.value());
+    if (it != external_files_.end()) {
+      *out = it->second->path();
+      return true;
+    }
+    auto extracted = extracted_files_.find(path.value());
+    if (extracted != extracted_files_.end()) {
+      *out = extracted->second;
+      return true;
+    }
+  }
+
+  FileInfo info;
+  if (!GetFileInfo(path, &info))
+    return false;
+
+  if (info.unpacked) {
+    *out = path_.AddExtension(FILE_PATH_LITERAL("unpacked")).Append(path);
+    return true;
+  }
+
+  if (!GetData(info.offset, info.size))
+    return false;
+
+  base::ElapsedTimer timer;
+  base::FilePath::StringType ext = path.Extension();
+  std::string cache_dir;
+  if (base::Environment::Create()->GetVar(kExtractCacheVar, &cache_dir) &&
+      !cache_dir.empty() &&
+      CopyFileOutToCache(info, base::FilePath::FromUTF8Unsafe(cache_dir), ext,
+                         out)) {
+    base::AutoLock auto_lock(files_lock_);
+    extracted_files_[path.value()] = *out;
+    RecordCopyFileOut(timer.Elapsed());
+    return true;
+  }
+
+  auto temp_file = std::make_unique<ScopedTemporaryFile>();
+  if (!temp_file->Init(ext))
+    return false;
+
+  base::File dest(temp_file->path(),
+                  base::File::FLAG_OPEN | base::File::FLAG_WRITE);
+  if (!dest.IsValid() || !WriteFileOut(info, &dest, nullptr))
+    return false;
+
+#if defined(OS_POSIX)
+  if (info.executable) {
+    // chmod a+x temp_file;
+    base::SetPosixFilePermissions(temp_file->path(), 0755);
+  }
+#endif
+
+  // Another thread may have copied the file out meanwhile, its copy is kept
+  // as its caller may be using it already, and this one is deleted.
+  base::AutoLock auto_lock(files_lock_);
+  auto inserted = external_files_.emplace(path.value(), std::move(temp_file));
+  *out = inserted.first->second->path();
+  RecordCopyFileOut(timer.Elapsed());
+  return true;
+}
+
+void Archive::RecordCopyFileOut(base::TimeDelta time) {
+  UMA_HISTOGRAM_TIMES("Electron.Asar.CopyFileOutTime", time);
+  metrics_.copied_out_files.fetch_add(1, std::memory_order_relaxed);
+  metrics_.copy_out_time.fetch_add(time.InMicroseconds(),
+                                   std::memory_order_relaxed);
+}
+
+bool Archive::WriteFileOut(const FileInfo& info,
+                           base::File* dest,
+                           uint8_t* digest) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  if (!info.encrypted) {
+    const uint8_t* data = GetData(info.offset, info.size);
+    if (dest->WriteAtCurrentPos(reinterpret_cast<const char*>(data),
+                                info.size) != static_cast<int>(info.size))
+      return false;
+    if (digest) {
+      SHA256_Update(&ctx, data, info.size);
+      SHA256_Final(digest, &ctx);
+    }
+    return true;
+  }
+
+  // Only a chunk of plaintext is in memory at a time, and chunks end on block
+  // boundaries so no block is decrypted twice.
+  uint64_t chunk_size = kCopyChunkSize;
+  if (info.block_size)
+    chunk_size = std::max<uint64_t>(chunk_size / info.block_size, 1) *
+                 info.block_size;
+  std::vector<char> chunk(std::min<uint64_t>(chunk_size, info.len));
+  for (uint64_t position = 0; position < info.len;) {
+    uint64_t length = std::min<uint64_t>(chunk.size(), info.len - position);
+    if (!ReadDecrypted(info, position, length, chunk.data()) ||
+        dest->WriteAtCurrentPos(chunk.data(), length) !=
+            static_cast<int>(length))
+      return false;
+    if (digest)
+      SHA256_Update(&ctx, chunk.data(), length);
+    position += length;
+  }
+  if (digest)
+    SHA256_Final(digest, &ctx);
+  return true;
+}
+
+bool Archive::IsFileOutCurrent(const FileInfo& info,
+                               const base::FilePath& path) {
+  // The name only tells which entry the file was extracted from, not what it
+  // holds now, so the file is hashed again and compared with the digest
+  // written next to it when it was extracted. Anything truncated, replaced
+  // or left without its digest is extracted again.
+  int64_t size = 0;
+  uint64_t plain_size = info.encrypted ? info.len : info.size;
+  std::string expected;
+  if (!base::GetFileSize(path, &size) ||
+      size != static_cast<int64_t>(plain_size) ||
+      !base::ReadFileToString(path.AddExtension(kFileOutDigestExtension),
+                              &expected) ||
+      expected.size() != 2 * SHA256_DIGEST_LENGTH)
+    return false;
+
+  base::File file(path, base::File::FLAG_OPEN | base::File::FLAG_READ);
+  if (!file.IsValid())
+    return false;
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  std::vector<char> chunk(std::min<uint64_t>(kCopyChunkSize, plain_size));
+  for (uint64_t position = 0; position < plain_size;) {
+    uint64_t length = std::min<uint64_t>(chunk.size(), plain_size - position);
+    if (file.Read(position, chunk.data(), length) != static_cast<int>(length))
+      return false;
+    SHA256_Update(&ctx, chunk.data(), length);
+    position += length;
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  return expected ==
+         base::ToLowerASCII(base::HexEncode(digest, sizeof(digest)));
+}
+
+std::string Archive::GetCacheName(const FileInfo& info) {
+  {
+    base::AutoLock auto_lock(header_digest_lock_);
+    if (!header_digest_computed_) {
+      // The headers are encrypted under a random IV, or at least list the
+      // offset and size of every entry, so they differ from build to build.
+      SHA256_CTX ctx;
+      SHA256_Init(&ctx);
+      SHA256_Update(&ctx, file_.data(), header_size_);
+      if (overlay_file_) {
+        SHA256_Update(&ctx, overlay_file_->data(),
+                      overlay_data_offset_ - file_.length());
+      }
+      SHA256_Final(header_digest_, &ctx);
+      header_digest_computed_ = true;
+    }
+  }
+
+  uint8_t place[2 * sizeof(uint64_t)];
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    place[i] = static_cast<uint8_t>(info.offset >> (56 - 8 * i));
+    place[sizeof(uint64_t) + i] =
+        static_cast<uint8_t>(uint64_t{info.size} >> (56 - 8 * i));
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, header_digest_, sizeof(header_digest_));
+  SHA256_Update(&ctx, place, sizeof(place));
+  SHA256_Final(digest, &ctx);
+  return base::ToLowerASCII(base::HexEncode(digest, 16));
+}
+
+bool Archive::CopyFileOutToCache(const FileInfo& info,
+                                 const base::FilePath& cache_dir,
+                                 const base::FilePath::StringType& extension,
+                                 base::FilePath* out) {
+  // The extension is kept for loaders that look at it.
+  base::FilePath cached =
+      cache_dir.AppendASCII(GetCacheName(info)).AddExtension(extension);
+
+  if (!IsFileOutCurrent(info, cached)) {
+    base::FilePath temp;
+    if (!base::CreateDirectory(cache_dir) ||
+        !base::CreateTemporaryFileInDir(cache_dir, &temp))
+      return false;
+    base::File dest(temp, base::File::FLAG_OPEN | base::File::FLAG_WRITE);
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    bool written = dest.IsValid() && WriteFileOut(info, &dest, digest);
+    dest.Close();
+    // Moved into place whole, so no process sees a partial file. The digest
+    // follows the file, a file left with the digest of an older one is
+    // extracted again.
+    if (!written || !base::ReplaceFile(temp, cached, nullptr)) {
+      base::DeleteFile(temp);
+      return false;
+    }
+    base::FilePath digest_temp;
+    std::string hex =
+        base::ToLowerASCII(base::HexEncode(digest, sizeof(digest)));
+    if (!base::CreateTemporaryFileInDir(cache_dir, &digest_temp))
+      return false;
+    if (base::WriteFile(digest_temp, hex.data(), hex.size()) !=
+            static_cast<int>(hex.size()) ||
+        !base::ReplaceFile(digest_temp,
+                           cached.AddExtension(kFileOutDigestExtension),
+                           nullptr)) {
+      base::DeleteFile(digest_temp);
+      return false;
+    }
+  }
+
+#if defined(OS_POSIX)
+  if (info.executable)
+    base::SetPosixFilePermissions(cached, 0755);
+#endif
+
+  *out = cached;
+  return true;
+}
+
+bool Archive::GetCodeCachePath(const base::FilePath& path,
+                               base::FilePath* cache_path) {
+  std::string cache_dir;
+  FileInfo info;
+  if (!base::Environment::Create()->GetVar(kCodeCacheVar, &cache_dir) ||
+      cache_dir.empty() || !LookupFileInfo(path, &info) || info.unpacked ||
+      !GetData(info.offset, info.size))
+    return false;
+
+  // Named like the extraction cache, as V8 only checks that a cache was made
+  // from a source of the same length.
+  *cache_path = base::FilePath::FromUTF8Unsafe(cache_dir)
+                    .AppendASCII(GetCacheName(info))
+                    .AddExtension(FILE_PATH_LITERAL("codecache"));
+  return true;
+}
+
+bool Archive::ReadCodeCache(const base::FilePath& path,
+                            std::vector<uint8_t>* data) {
+  TRACE_EVENT0("electron", "Archive::ReadCodeCache");
+  base::ThreadRestrictions::ScopedAllowIO allow_io;
+  base::FilePath cache_path;
+  std::string stored;
+  bool found = decryptor_ && GetCodeCachePath(path, &cache_path) &&
+               base::ReadFileToString(cache_path, &stored) &&
+               stored.size() >= sizeof(uint64_t) + kGCMTagSize;
+  if (found) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(stored.data());
+    uint64_t nonce = 0;
+    for (size_t i = 0; i < sizeof(nonce); ++i)
+      nonce = (nonce << 8) | bytes[i];
+    data->resize(stored.size() - sizeof(nonce) - kGCMTagSize);
+    found = decryptor_->DecryptGCMBlock(
+        nonce, kCodeCacheBlockIndex, bytes + sizeof(nonce),
+        stored.size() - sizeof(nonce), data->data(), data->size());
+  }
+  if (found) {
+    metrics_.code_cache_hits.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    data->clear();
+    metrics_.code_cache_misses.fetch_add(1, std::memory_order_relaxed);
+  }
+  return found;
+}
+
+bool Archive::WriteCodeCache(const base::FilePath& path,
+                             const std::vector<uint8_t>& data) {
+  TRACE_EVENT0("electron", "Archive::WriteCodeCache");
+  base::FilePath cache_path;
+  if (!decryptor_ || !GetCodeCachePath(path, &cache_path))
+    return false;
+
+  uint64_t nonce = base::RandUint64();
+  std::vector<uint8_t> stored(sizeof(nonce) + data.size() + kGCMTagSize);
+  for (size_t i = 0; i < sizeof(nonce); ++i)
+    stored[i] = static_cast<uint8_t>(nonce >> (56 - 8 * i));
+  if (!decryptor_->EncryptGCMBlock(nonce, kCodeCacheBlockIndex, data.data(),
+                                   data.size(), &stored[sizeof(nonce)]))
+    return false;
+
+  // Moved into place whole, so no process reads a partial cache.
+  base::FilePath temp;
+  if (!base::CreateDirectory(cache_path.DirName()) ||
+      !base::CreateTemporaryFileInDir(cache_path.DirName(), &temp))
+    return false;
+  if (!base::WriteFile(temp, stored) ||
+      !base::ReplaceFile(temp, cache_path, nullptr)) {
+    base::DeleteFile(temp);
+    return false;
+  }
+  return true;
+}
+
+struct Archive::ParallelDecryption {
+  const FileInfo* info;
+  uint64_t position;
+  uint64_t end;
+  uint8_t* out;
+  // The range is split at multiples of |chunk_size|, chunk 0 holds
+  // |position|.
+  uint64_t chunk_size;
+  uint64_t chunk_count;
+  std::atomic<uint64_t> next_chunk{0};
+  std::atomic<bool> failed{false};
+
+  size_t GetMaxConcurrency() const {
+    uint64_t claimed = next_chunk.load(std::memory_order_relaxed);
+    if (failed.load(std::memory_order_relaxed) || claimed >= chunk_count)
+      return 0;
+    return base::saturated_cast<size_t>(chunk_count - claimed);
+  }
+};
+
+bool Archive::ReadDecrypted(const FileInfo& info,
+                            uint64_t position,
+                            uint64_t length,
+                            char* out) {
+  return ReadDecrypted(info, position, length, reinterpret_cast<uint8_t*>(out),
+                       false);
+}
+
+bool Archive::ReadDecryptedInParallel(const FileInfo& info,
+                                      uint64_t position,
+                                      uint64_t length,
+                                      char* out) {
+  return ReadDecrypted(info, position, length, reinterpret_cast<uint8_t*>(out),
+                       true);
+}
+
+bool Archive::ReadDecrypted(const FileInfo& info,
+                            uint64_t position,
+                            uint64_t length,
+                            uint8_t* out,
+                            bool in_parallel) {
+  if (!decryptor_ || !info.encrypted || info.unpacked)
+    return false;
+
+  base::CheckedNumeric<uint64_t> safe_end =
+      base::CheckedNumeric<uint64_t>(position) + length;
+  if (!safe_end.IsValid() || safe_end.ValueOrDie() > info.len ||
+      !GetData(info.offset, info.size))
+    return false;
+
+  uint64_t end = safe_end.ValueOrDie();
+  if (position == end)
+    return true;
+
+  // Reading the whole entry decrypts it into the cache, reading a part of it
+  // only takes it from there, so that a range never costs more than its own
+  // blocks.
+  DecryptedContentCache* cache = DecryptedContentCache::GetInstance();
+  if (cache->ShouldCache(info.len)) {
+    scoped_refptr<base::RefCountedBytes> plaintext;
+    if (position == 0 && end == info.len) {
+      plaintext = GetCachedPlaintext(info, in_parallel);
+      if (!plaintext)
+        return false;
+    } else {
+      plaintext = cache->Get(generation_, info.offset);
+      if (plaintext)
+        metrics_.cache_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (plaintext) {
+      memcpy(out, plaintext->front() + position, end - position);
+      return true;
+    }
+  }
+
+  TRACE_EVENT1("electron", "Archive::ReadDecrypted", "length", end - position);
+  base::ElapsedTimer timer;
+  bool success = in_parallel ? DecryptRangeInParallel(info, position, end, out)
+                             : DecryptRange(info, position, end, out);
+  if (success)
+    RecordDecryption(end - position, timer.Elapsed());
+  return success;
+}
+
+scoped_refptr<base::RefCountedBytes> Archive::GetCachedPlaintext(
+    const FileInfo& info,
+    bool in_parallel) {
+  DecryptedContentCache* cache = DecryptedContentCache::GetInstance();
+  scoped_refptr<base::RefCountedBytes> plaintext =
+      cache->Get(generation_, info.offset);
+  if (plaintext) {
+    metrics_.cache_hits.fetch_add(1, std::memory_order_relaxed);
+    return plaintext;
+  }
+  metrics_.cache_misses.fetch_add(1, std::memory_order_relaxed);
+
+  TRACE_EVENT1("electron", "Archive::ReadDecrypted", "length", info.len);
+  base::ElapsedTimer timer;
+  plaintext = base::MakeRefCounted<base::RefCountedBytes>(info.len);
+  bool success = in_parallel ? DecryptRangeInParallel(info, 0, info.len,
+                                                      plaintext->front())
+                             : DecryptRange(info, 0, info.len,
+                                            plaintext->front());
+  if (!success)
+    return nullptr;
+  RecordDecryption(info.len, timer.Elapsed());
+  cache->Put(generation_, info.offset, plaintext);
+  return plaintext;
+}
+
+void Archive::RecordDecryption(uint64_t bytes, base::TimeDelta time) {
+  UMA_HISTOGRAM_COUNTS_100M("Electron.Asar.DecryptSize",
+                            base::saturated_cast<int>(bytes));
+  UMA_HISTOGRAM_CUSTOM_MICROSECONDS_TIMES(
+      "Electron.Asar.DecryptTime", time, base::TimeDelta::FromMicroseconds(1),
+      base::TimeDelta::FromSeconds(10), 50);
+  metrics_.decrypted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  metrics_.decrypt_time.fetch_add(time.InMicroseconds(),
+                                  std::memory_order_relaxed);
+}
+
+Archive::Metrics Archive::GetMetrics() const {
+  Metrics metrics;
+  metrics.header_size = header_size_;
+  metrics.init_time = init_time_;
+  metrics.lookups = metrics_.lookups.load(std::memory_order_relaxed);
+  metrics.decrypted_bytes =
+      metrics_.decrypted_bytes.load(std::memory_order_relaxed);
+  metrics.decrypt_time = base::TimeDelta::FromMicroseconds(
+      metrics_.decrypt_time.load(std::memory_order_relaxed));
+  metrics.cache_hits = metrics_.cache_hits.load(std::memory_order_relaxed);
+  metrics.cache_misses = metrics_.cache_misses.load(std::memory_order_relaxed);
+  metrics.copied_out_files =
+      metrics_.copied_out_files.load(std::memory_order_relaxed);
+  metrics.copy_out_time = base::TimeDelta::FromMicroseconds(
+      metrics_.copy_out_time.load(std::memory_order_relaxed));
+  metrics.code_cache_hits =
+      metrics_.code_cache_hits.load(std::memory_order_relaxed);
+  metrics.code_cache_misses =
+      metrics_.code_cache_misses.load(std::memory_order_relaxed);
+  return metrics;
+}
+
+// static
+base::FilePath Archive::GetPrefetchManifestPath(const base::FilePath& path) {
+  return path.AddExtension(FILE_PATH_LITERAL("prefetch"));
+}
+
+// static
+base::FilePath Archive::GetOverlayPath(const base::FilePath& path) {
+  return path.AddExtension(FILE_PATH_LITERAL("overlay"));
+}
+
+const uint8_t* Archive::GetData(uint64_t offset, uint64_t length) const {
+  base::CheckedNumeric<uint64_t> safe_end =
+      base::CheckedNumeric<uint64_t>(offset) + length;
+  if (!safe_end.IsValid())
+    return nullptr;
+  uint64_t end = safe_end.ValueOrDie();
+  if (end <= file_.length())
+    return file_.data() + offset;
+  if (overlay_file_ && offset >= file_.length() &&
+      end - file_.length() <= overlay_file_->length())
+    return overlay_file_->data() + (offset - file_.length());
+  return nullptr;
+}
+
+bool Archive::ResolveOffset(uint64_t offset,
+                            base::FilePath* file_path,
+                            uint64_t* file_offset) const {
+  if (offset < file_.length()) {
+    *file_path = path_;
+    *file_offset = offset;
+    return true;
+  }
+  if (!overlay_file_ || offset - file_.length() >= overlay_file_->length())
+    return false;
+  *file_path = GetOverlayPath(path_);
+  *file_offset = offset - file_.length();
+  return true;
+}
+
+// static
+void Archive::Prefetch(std::shared_ptr<Archive> archive) {
+  // The lookups of the prefetch itself would end up in the recording.
+  if (!archive || PrefetchRecorder::GetInstance()->is_recording())
+    return;
+  base::ThreadPool::PostTask(
+      FROM_HERE, {base::MayBlock(), base::TaskPriority::USER_VISIBLE},
+      base::BindOnce(
+          [](std::shared_ptr<Archive> archive) { archive->RunPrefetch(); },
+          std::move(archive)));
+}
+
+void Archive::RunPrefetch() {
+  std::string manifest;
+  if (!base::ReadFileToString(GetPrefetchManifestPath(path_), &manifest))
+    return;
+
+  for (base::StringPiece line : base::SplitStringPiece(
+           manifest, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    size_t colon = line.find(": ");
+    uint64_t offset;
+    if (colon == base::StringPiece::npos ||
+        !base::StringToUint64(line.substr(0, colon), &offset))
+      continue;
+
+    // Entries that moved belong to an older build of the archive.
+    FileInfo info;
+    if (!GetFileInfo(base::FilePath::FromUTF8Unsafe(line.substr(colon + 2)),
+                     &info) ||
+        info.unpacked || GetEntryOffset(info) != offset ||
+        !GetData(info.offset, info.size))
+      continue;
+
+#if defined(OS_POSIX)
+    // Starts reading the pages of the entry in, without waiting for them.
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t begin =
+        reinterpret_cast<uintptr_t>(GetData(info.offset, info.size));
+    uintptr_t aligned_begin = begin & ~(page_size - 1);
+    madvise(reinterpret_cast<void*>(aligned_begin),
+            begin + info.size - aligned_begin, MADV_WILLNEED);
+#endif
+
+    if (info.encrypted &&
+        DecryptedContentCache::GetInstance()->ShouldCache(info.len))
+      GetCachedPlaintext(info, false);
+  }
+}
+
+bool Archive::DecryptRangeInParallel(const FileInfo& info,
+                                     uint64_t position,
+                                     uint64_t end,
+                                     uint8_t* out) {
+  // Base64 entries are a single stream, they can not be split.
+  if (info.encryption_version != kEncryptionBlocks &&
+      info.encryption_version != kEncryptionGCM)
+    return DecryptRange(info, position, end, out);
+
+  ParallelDecryption decryption;
+  decryption.info = &info;
+  decryption.position = position;
+  decryption.end = end;
+  decryption.out = out;
+  decryption.chunk_size =
+      std::max<uint64_t>(kParallelDecryptChunkSize / info.block_size, 1) *
+      info.block_size;
+  decryption.chunk_count = (end - 1) / decryption.chunk_size -
+                           position / decryption.chunk_size + 1;
+  if (decryption.chunk_count < 2)
+    return DecryptRange(info, position, end, out);
+
+  // Join() runs chunks on this thread too and returns once every chunk is
+  // done, so |decryption| outlives all the workers.
+  base::PostJob(
+      FROM_HERE, {base::MayBlock(), base::TaskPriority::USER_VISIBLE},
+      base::BindRepeating(&Archive::RunParallelDecryption,
+                          base::Unretained(this),
+                          base::Unretained(&decryption)),
+      base::BindRepeating(&ParallelDecryption::GetMaxConcurrency,
+                          base::Unretained(&decryption)))
+      .Join();
+  return !decryption.failed.load(std::memory_order_relaxed);
+}
+
+void Archive::RunParallelDecryption(ParallelDecryption* decryption,
+                                    base::JobDelegate* delegate) {
+  const uint64_t first_chunk_begin =
+      decryption->position / decryption->chunk_size * decryption->chunk_size;
+  while (!delegate->ShouldYield()) {
+    uint64_t chunk =
+        decryption->next_chunk.fetch_add(1, std::memory_order_relaxed);
+    if (chunk >= decryption->chunk_count ||
+        decryption->failed.load(std::memory_order_relaxed))
+      return;
+
+    uint64_t chunk_begin = first_chunk_begin + chunk * decryption->chunk_size;
+    uint64_t begin = std::max(decryption->position, chunk_begin);
+    uint64_t end =
+        std::min(decryption->end, chunk_begin + decryption->chunk_size);
+    if (!DecryptRange(*decryption->info, begin, end,
+                      decryption->out + (begin - decryption->position)))
+      decryption->failed.store(true, std::memory_order_relaxed);
+  }
+}
+
+const Decryptor* Archive::GetDecryptor(const FileInfo& info) {
+  if (!info.entry_key)
+    return decryptor_.get();
+  return info.decryptor ? info.decryptor : GetEntryDecryptor(info.nonce);
+}
+
+const Decryptor* Archive::GetEntryDecryptor(uint64_t nonce) {
+  base::AutoLock lock(entry_decryptors_lock_);
+  std::unique_ptr<Decryptor>& decryptor = entry_decryptors_[nonce];
+  if (!decryptor)
+    decryptor = decryptor_->DeriveEntryDecryptor(nonce);
+  return decryptor.get();
+}
+
+bool Archive::DecryptRange(const FileInfo& info,
+                           uint64_t position,
+                           uint64_t end,
+                           uint8_t* out) {
+  const Decryptor* decryptor = GetDecryptor(info);
+  if (!decryptor)
+    return false;
+  const uint8_t* entry = GetData(info.offset, info.size);
+  uint8_t* dest = out;
+
+  switch (info.encryption_version) {
+    case kEncryptionBase64:
+      return decryptor->DecryptBase64Range(entry, info.size, position, end,
+                                           dest);
+
+    case kEncryptionBlocks:
+    case kEncryptionGCM: {
+      // Blocks that are read whole are decrypted straight into |out|.
+      std::vector<uint8_t> partial_block;
+      // The block being decompressed, which is about the size of a block so
+      // it stays in cache between decryption and decompression.
+      std::vector<uint8_t> compressed_block;
+      for (uint64_t block = position / info.block_size; position < end;
+           ++block) {
+        uint64_t block_begin = block * info.block_size;
+        uint64_t block_length =
+            std::min<uint64_t>(info.block_size, info.len - block_begin);
+        uint64_t skip = position - block_begin;
+        uint64_t count = std::min(end - position, block_length - skip);
+
+        uint8_t* block_out = dest;
+        if (count != block_length) {
+          partial_block.resize(block_length);
+          block_out = partial_block.data();
+        }
+
+        // Only uncompressed GCM entries have no table, all their blocks are
+        // stored at the same size.
+        const uint8_t* stored;
+        size_t stored_size;
+        if (info.block_offsets.empty()) {
+          stored = entry + block * (info.block_size + kGCMTagSize);
+          stored_size = block_length + kGCMTagSize;
+        } else {
+          stored = entry + info.block_offsets[block];
+          stored_size =
+              info.block_offsets[block + 1] - info.block_offsets[block];
+        }
+        bool is_gcm = info.encryption_version == kEncryptionGCM;
+        uint32_t block_index = static_cast<uint32_t>(block);
+
+        if (info.compression == kCompressionNone) {
+          if (is_gcm ? !decryptor->DecryptGCMBlock(info.nonce, block_index,
+                                                   stored, stored_size,
+                                                   block_out, block_length)
+                     : !decryptor->DecryptBlock(stored, stored_size, block_out,
+                                                block_length))
+            return false;
+        } else {
+          compressed_block.resize(stored_size);
+          size_t compressed_size = 0;
+          if (is_gcm) {
+            if (stored_size < kGCMTagSize)
+              return false;
+            compressed_size = stored_size - kGCMTagSize;
+            if (!decryptor->DecryptGCMBlock(info.nonce, block_index, stored,
+                                            stored_size,
+                                            compressed_block.data(),
+                                            compressed_size))
+              return false;
+          } else if (!decryptor->DecryptPaddedBlock(stored, stored_size,
+                                                    compressed_block.data(),
+                                                    &compressed_size)) {
+            return false;
+          }
+          // Fails if the block would decompress to more than |block_length|.
+          size_t decoded_size = block_length;
+          if (BrotliDecoderDecompress(compressed_size, compressed_block.data(),
+                                      &decoded_size, block_out) !=
+                  BROTLI_DECODER_RESULT_SUCCESS ||
+              decoded_size != block_length)
+            return false;
+        }
+        if (block_out != dest)
+          memcpy(dest, block_out + skip, count);
+        dest += count;
+        position += count;
+      }
+      return true;
+    }
+
+    default:
+      return false;
+  }
 }
 
 }  // namespace asar
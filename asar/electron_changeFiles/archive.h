@@ -0,0 +1,646 @@
+// Copyright (c) 2014 GitHub, Inc.
+// Use of this source code is governed by the MIT license that can be
+// found in the LICENSE file.
+
+#ifndef SHELL_COMMON_ASAR_ARCHIVE_H_
+#define SHELL_COMMON_ASAR_ARCHIVE_H_
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "base/containers/mru_cache.h"
+#include "base/files/file.h"
+#include "base/files/file_path.h"
+#include "base/files/memory_mapped_file.h"
+#include "base/memory/ref_counted_memory.h"
+#include "base/no_destructor.h"
+#include "base/strings/string_piece.h"
+#include "base/synchronization/lock.h"
+#include "base/time/time.h"
+
+namespace base {
+class JobDelegate;
+}
+
+namespace asar {
+
+class Archive;
+class HeaderIndex;
+class ScopedTemporaryFile;
+
+// Supplies the keys of archives in place of the built-in key, from the OS
+// keychain or a secret fused into the binary for example. It is registered
+// once at startup, before any archive is opened. Each archive asks for its key
+// once, when it is initialized, so reads never reach the provider. It may be
+// called from any thread.
+class KeyProvider {
+ public:
+  virtual ~KeyProvider() = default;
+
+  // Sets |passphrase| to the key of the archive at |path|, which is empty for
+  // the key of buffers decoded without an archive. Returns false for the
+  // built-in key.
+  virtual bool GetPassphrase(const base::FilePath& path,
+                             std::string* passphrase) = 0;
+
+  // Registers |provider| for the rest of the process. Not thread-safe.
+  static void Register(std::unique_ptr<KeyProvider> provider);
+
+  // Returns the registered provider, or null.
+  static KeyProvider* Get();
+};
+
+// Decrypts the content of encrypted entries. The AES key is derived once when
+// the decryptor is created, and every thread sets up a cipher context with it
+// the first time it uses each cipher, so reads only pay for the decryption
+// itself. It is thread-safe.
+class Decryptor {
+ public:
+  // Cipher contexts of the calling thread for this decryptor.
+  struct Contexts;
+
+  explicit Decryptor(base::StringPiece passphrase);
+  ~Decryptor();
+
+  // Returns the decryptor for the default key, the one the KeyProvider gives
+  // for the empty path or the built-in one, for callers that do not have an
+  // archive at hand.
+  static const Decryptor& GetDefault();
+
+  // Returns the decryptor of an entry encrypted with a key of its own, which
+  // is derived from this key and the |nonce| of the entry by HKDF-SHA256.
+  std::unique_ptr<Decryptor> DeriveEntryDecryptor(uint64_t nonce) const;
+
+  // Decrypts the plaintext bytes [position, end) of a kEncryptionBase64 entry
+  // whose base64 text is |encoded| into |out|.
+  bool DecryptBase64Range(const uint8_t* encoded,
+                          uint64_t encoded_size,
+                          uint64_t position,
+                          uint64_t end,
+                          uint8_t* out) const;
+
+  // Decrypts a block of a kEncryptionBlocks entry into |out|, which has room
+  // for exactly the |plain_size| bytes of the block. Nothing is written past
+  // them, the padding of the block is checked and dropped on the side.
+  bool DecryptBlock(const uint8_t* block,
+                    size_t stored_size,
+                    uint8_t* out,
+                    size_t plain_size) const;
+
+  // Decrypts the block |block_index| of a kEncryptionGCM entry whose nonce is
+  // |nonce| into |out|, which has room for exactly the |plain_size| bytes of
+  // the block. Fails if the block does not authenticate.
+  bool DecryptGCMBlock(uint64_t nonce,
+                       uint32_t block_index,
+                       const uint8_t* block,
+                       size_t stored_size,
+                       uint8_t* out,
+                       size_t plain_size) const;
+
+  // Encrypts |size| bytes of |in| into |out|, which has room for them and the
+  // tag, as DecryptGCMBlock expects them.
+  bool EncryptGCMBlock(uint64_t nonce,
+                       uint32_t block_index,
+                       const uint8_t* in,
+                       size_t size,
+                       uint8_t* out) const;
+
+  // Same with DecryptBlock, for blocks whose plaintext size is not known in
+  // advance. |out| has room for the |stored_size| bytes less the IV, and
+  // |plain_size| is set to the bytes decrypted into it.
+  bool DecryptPaddedBlock(const uint8_t* block,
+                          size_t stored_size,
+                          uint8_t* out,
+                          size_t* plain_size) const;
+
+  // Decrypts an archive header stored as its IV followed by the AES-128-CTR
+  // ciphertext into |out|, which has room for |size| minus the IV bytes.
+  bool DecryptHeader(const uint8_t* in, size_t size, uint8_t* out) const;
+
+ private:
+  // The ciphers a thread keeps a context of.
+  enum Cipher : uint32_t {
+    kCipherECB,
+    kCipherCBC,
+    kCipherCTR,
+    kCipherGCM,
+  };
+
+  // For DeriveEntryDecryptor.
+  explicit Decryptor(const uint8_t* key);
+
+  // Returns the contexts of the calling thread, with the one of |cipher| set
+  // up.
+  Contexts* GetContexts(Cipher cipher) const;
+
+  // Identifies the contexts of this decryptor in the per-thread caches.
+  const uint64_t id_;
+  // Whether this is the key of an entry, whose contexts are cached apart from
+  // those of archive keys.
+  const bool entry_key_;
+  uint8_t key_[16];
+
+  DISALLOW_COPY_AND_ASSIGN(Decryptor);
+};
+
+// Least recently used cache of the plaintext of encrypted entries, so entries
+// that are read again, through fs or the URL loader, are not decrypted again.
+// It is shared by all the archives of the process, and bounded by the bytes of
+// plaintext it holds. It is thread-safe.
+class DecryptedContentCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entry_count = 0;
+    size_t size = 0;
+    size_t limit = 0;
+  };
+
+  static DecryptedContentCache* GetInstance();
+
+  // Sets the bytes of plaintext the cache may hold, evicting entries as
+  // needed. A limit of 0 disables the cache.
+  void SetLimit(size_t limit);
+
+  // Whether the plaintext of an entry of |size| bytes would be cached. Entries
+  // larger than a quarter of the limit are not, so that a single large file
+  // does not flush everything else.
+  bool ShouldCache(size_t size);
+
+  // Returns the plaintext of the entry at |offset| in the archive of
+  // |generation|, see Archive::generation, or null.
+  scoped_refptr<base::RefCountedBytes> Get(uint64_t generation,
+                                           uint64_t offset);
+
+  void Put(uint64_t generation,
+           uint64_t offset,
+           scoped_refptr<base::RefCountedBytes> plaintext);
+
+  Stats GetStats();
+  void Clear();
+
+ private:
+  using Key = std::pair<uint64_t, uint64_t>;
+
+  friend class base::NoDestructor<DecryptedContentCache>;
+
+  DecryptedContentCache();
+  ~DecryptedContentCache();
+
+  void EvictToLimit();
+
+  base::Lock lock_;
+  base::MRUCache<Key, scoped_refptr<base::RefCountedBytes>> entries_;
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(DecryptedContentCache);
+};
+
+// Records the entries of every archive in the order they are first read, so
+// that later runs can warm them up with Archive::Prefetch. Recording is on
+// when the process is started with ELECTRON_ASAR_RECORD_PREFETCH set, and
+// ends when WriteManifests saves a manifest next to each archive. Manifests
+// list "offset: path" lines, which `asar pack --ordering` also accepts. It is
+// thread-safe.
+class PrefetchRecorder {
+ public:
+  static PrefetchRecorder* GetInstance();
+
+  bool is_recording() const {
+    return recording_.load(std::memory_order_relaxed);
+  }
+
+  // Notes that the file |path| of |archive|, whose content starts at |offset|
+  // after the header of the archive or of the overlay it is in, has been
+  // looked up.
+  void Record(const base::FilePath& archive,
+              const base::FilePath& path,
+              uint64_t offset);
+
+  // Stops recording, and writes the manifests of the archives read so far.
+  bool WriteManifests();
+
+ private:
+  struct Manifest {
+    std::string lines;
+    std::unordered_set<base::FilePath::StringType> paths;
+  };
+
+  friend class base::NoDestructor<PrefetchRecorder>;
+
+  PrefetchRecorder();
+  ~PrefetchRecorder();
+
+  std::atomic<bool> recording_;
+  base::Lock lock_;
+  std::map<base::FilePath, Manifest> manifests_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefetchRecorder);
+};
+
+// The initialized archives of the process by path, shared by the JS bindings,
+// the URL loader and the readers on the thread pool, so that every archive is
+// mapped and its header parsed once. The map is split into shards with a lock
+// each, held only for a lookup, so threads resolving archives rarely wait on
+// each other. Archives that only the registry references are evicted once
+// they have not been looked up for a while. It is thread-safe.
+class ArchiveRegistry {
+ public:
+  static ArchiveRegistry* GetInstance();
+
+  // Returns the archive at |path|, opening and initializing it when it is not
+  // registered yet, or null if it can not be initialized. An archive is
+  // prefetched when it is registered, see Archive::Prefetch.
+  std::shared_ptr<Archive> GetOrCreate(const base::FilePath& path);
+
+  // Evicts the archives that only the registry references and which were not
+  // looked up for |idle_time|. Returns how many were.
+  size_t EvictIdle(base::TimeDelta idle_time);
+
+ private:
+  struct Entry {
+    std::shared_ptr<Archive> archive;
+    base::TimeTicks last_used;
+  };
+
+  struct Shard {
+    base::Lock lock;
+    std::unordered_map<base::FilePath::StringType, Entry> archives;
+    base::TimeTicks last_sweep;
+  };
+
+  static constexpr size_t kShardCount = 16;
+
+  friend class base::NoDestructor<ArchiveRegistry>;
+
+  ArchiveRegistry();
+  ~ArchiveRegistry();
+
+  Shard& GetShard(const base::FilePath& path);
+
+  // Moves the archives of |shard| idle since before |idle_since| to
+  // |evicted|, to be released once the lock of the shard is.
+  static void EvictLocked(Shard* shard,
+                          base::TimeTicks idle_since,
+                          std::vector<std::shared_ptr<Archive>>* evicted);
+
+  std::array<Shard, kShardCount> shards_;
+
+  DISALLOW_COPY_AND_ASSIGN(ArchiveRegistry);
+};
+
+// This class represents an asar package, and provides methods to read
+// information from it. It is thread-safe after |Init| has been called, as the
+// archives of the ArchiveRegistry are shared by all threads.
+class Archive {
+ public:
+  // Layouts of the content of encrypted entries, the value of
+  // "encryption.version" in the header.
+  enum EncryptionVersion : uint32_t {
+    // The whole entry is base64 text of AES-128-ECB ciphertext.
+    kEncryptionBase64 = 1,
+    // The entry is split into independently decryptable blocks, each stored
+    // as a random IV followed by the AES-128-CBC ciphertext of the block.
+    kEncryptionBlocks = 2,
+    // Like kEncryptionBlocks, but the blocks are AES-128-GCM ciphertext
+    // followed by the tag, under nonces derived from the nonce of the entry.
+    // Nothing is padded, so the position of every block is known.
+    kEncryptionGCM = 3,
+  };
+
+  // Compression of the blocks of kEncryptionBlocks and kEncryptionGCM
+  // entries, the value of "compression" in the header. Every block is
+  // compressed on its own before it is encrypted, so blocks stay independently
+  // readable, and the block table gives their stored sizes.
+  enum Compression : uint32_t {
+    kCompressionNone = 0,
+    kCompressionBrotli = 1,
+  };
+
+  struct FileInfo {
+    FileInfo()
+        : unpacked(false),
+          executable(false),
+          encrypted(false),
+          size(0),
+          len(0),
+          offset(0),
+          encryption_version(0),
+          block_size(0),
+          nonce(0),
+          entry_key(false),
+          compression(kCompressionNone),
+          decryptor(nullptr) {}
+    bool unpacked;
+    bool executable;
+    bool encrypted;
+    // Stored size of the entry.
+    uint32_t size;
+    // Plaintext size of an encrypted entry, after decompression.
+    uint32_t len;
+    uint64_t offset;
+    uint32_t encryption_version;
+    // Plaintext size of a block of the block formats, and for kEncryptionBlocks
+    // and compressed entries the offsets of the blocks relative to |offset|,
+    // with the end of the entry appended.
+    uint32_t block_size;
+    std::vector<uint64_t> block_offsets;
+    // Nonce of a kEncryptionGCM entry.
+    uint64_t nonce;
+    // The kEncryptionGCM entry is encrypted with a key of its own, see
+    // Decryptor::DeriveEntryDecryptor.
+    bool entry_key;
+    uint32_t compression;
+    // MIME type the entry was packed with, if any.
+    std::string mime_type;
+    // Decryptor of an entry with its own key, set by GetFileInfo. It is owned
+    // by the archive.
+    const Decryptor* decryptor;
+  };
+
+  struct Stats : public FileInfo {
+    Stats() : is_file(true), is_directory(false), is_link(false) {}
+    bool is_file;
+    bool is_directory;
+    bool is_link;
+  };
+
+  // What GetEntryTypes reports for a path.
+  enum EntryType : int32_t {
+    kEntryNone = -1,
+    kEntryFile = 0,
+    kEntryDirectory = 1,
+    kEntryLink = 2,
+  };
+
+  // Counters of the work done for this archive since it was opened.
+  struct Metrics {
+    uint32_t header_size = 0;
+    base::TimeDelta init_time;
+    uint64_t lookups = 0;
+    // Plaintext decrypted by ReadDecrypted and ReadDecryptedInParallel, and
+    // the time it took. Reads served from the DecryptedContentCache are only
+    // counted as hits.
+    uint64_t decrypted_bytes = 0;
+    base::TimeDelta decrypt_time;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t copied_out_files = 0;
+    base::TimeDelta copy_out_time;
+    // ReadCodeCache calls which found a cache, and which did not.
+    uint64_t code_cache_hits = 0;
+    uint64_t code_cache_misses = 0;
+  };
+
+  explicit Archive(const base::FilePath& path);
+  virtual ~Archive();
+
+  // Read and parse the header. When an overlay made for this archive by
+  // `asar overlay` is next to it, its header is used instead: entries it marks
+  // as "overlay" are read from the overlay, the others from the archive.
+  bool Init();
+
+  // Get the info of a file.
+  bool GetFileInfo(const base::FilePath& path, FileInfo* info);
+
+  // Fs.stat(path).
+  bool Stat(const base::FilePath& path, Stats* stats);
+
+  // The children of a directory, with the EntryType of each.
+  struct DirectoryListing {
+    std::vector<base::FilePath> names;
+    std::vector<int32_t> types;
+  };
+
+  // The EntryType of each of |paths| into |types|, which has room for all of
+  // them. Takes the lock once for the whole batch, for probing the candidate
+  // paths of module resolution.
+  void GetEntryTypes(const std::vector<base::FilePath>& paths, int32_t* types);
+
+  // Fs.readdir(path).
+  bool Readdir(const base::FilePath& path, std::vector<base::FilePath>* files);
+
+  // Returns the listing of the directory |path|, or null. Listings are built
+  // once per directory, and stay valid and unchanged as long as the archive.
+  const DirectoryListing* GetDirectoryListing(const base::FilePath& path);
+
+  // Fs.realpath(path).
+  bool Realpath(const base::FilePath& path, base::FilePath* realpath);
+
+  // Copy the file into a temporary file, and return the new path.
+  // For unpacked file, this method will return its real path.
+  // Encrypted files are decrypted into it. When the process is started with
+  // ELECTRON_ASAR_EXTRACT_CACHE set to a directory, the file is kept there
+  // instead, under a name given by GetCacheName, and later runs of the same
+  // build of the archive reuse it once it matches the SHA-256 of the
+  // plaintext kept next to it.
+  bool CopyFileOut(const base::FilePath& path, base::FilePath* out);
+
+  // Reads the V8 code cache of the module |path| into |data|. When the
+  // process is started with ELECTRON_ASAR_CODE_CACHE set to a directory, code
+  // caches are kept there under the name GetCacheName gives their entry,
+  // encrypted with the key of the archive. Fails when there is none yet, or
+  // it does not authenticate.
+  bool ReadCodeCache(const base::FilePath& path, std::vector<uint8_t>* data);
+
+  // Keeps |data| as the code cache of the module |path|. Blocks on the disk.
+  bool WriteCodeCache(const base::FilePath& path,
+                      const std::vector<uint8_t>& data);
+
+  // Decrypts the plaintext bytes [position, position + length) of the
+  // encrypted entry |info| into |out|. Only the blocks covering the range are
+  // decrypted, unless the entry is in the DecryptedContentCache. Entries small
+  // enough for it are put there when they are read whole.
+  bool ReadDecrypted(const FileInfo& info,
+                     uint64_t position,
+                     uint64_t length,
+                     char* out);
+
+  // Same with ReadDecrypted, but large ranges of kEncryptionBlocks and
+  // kEncryptionGCM entries are split across the thread pool, with the calling
+  // thread taking part. Blocks until the whole range is decrypted, so it is
+  // meant for threads that may block.
+  bool ReadDecryptedInParallel(const FileInfo& info,
+                               uint64_t position,
+                               uint64_t length,
+                               char* out);
+
+  // Where the prefetch manifest of the archive at |path| is kept.
+  static base::FilePath GetPrefetchManifestPath(const base::FilePath& path);
+
+  // Where the overlay of the archive at |path| is kept.
+  static base::FilePath GetOverlayPath(const base::FilePath& path);
+
+  // Returns the |length| bytes at |offset|, offsets past the end of the archive
+  // being in the overlay. Null if the range is not entirely in either.
+  const uint8_t* GetData(uint64_t offset, uint64_t length) const;
+
+  // Returns the file holding the byte at |offset|, and its offset there.
+  bool ResolveOffset(uint64_t offset,
+                     base::FilePath* file_path,
+                     uint64_t* file_offset) const;
+
+  // Warms up the entries listed in the prefetch manifest of |archive| on the
+  // thread pool: their pages are read ahead, and encrypted entries are
+  // decrypted into the DecryptedContentCache before they are asked for.
+  static void Prefetch(std::shared_ptr<Archive> archive);
+
+  Metrics GetMetrics() const;
+
+  base::MemoryMappedFile* file() { return &file_; }
+  base::FilePath path() const { return path_; }
+  // Identifies this archive in the process. An archive opened again at the
+  // same path, which may have been replaced or have a new overlay since, gets
+  // a new generation.
+  uint64_t generation() const { return generation_; }
+  const Decryptor* decryptor() const { return decryptor_.get(); }
+
+ private:
+  // Work shared by the workers of DecryptRangeInParallel.
+  struct ParallelDecryption;
+
+  // Metrics updated from any thread, times are in microseconds.
+  struct AtomicMetrics {
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> decrypted_bytes{0};
+    std::atomic<int64_t> decrypt_time{0};
+    std::atomic<uint64_t> cache_hits{0};
+    std::atomic<uint64_t> cache_misses{0};
+    std::atomic<uint64_t> copied_out_files{0};
+    std::atomic<int64_t> copy_out_time{0};
+    std::atomic<uint64_t> code_cache_hits{0};
+    std::atomic<uint64_t> code_cache_misses{0};
+  };
+
+  // Reads the size of the header of the archive mapped as |file|, and unless
+  // |json| is null, the JSON header.
+  bool ReadHeader(const base::MemoryMappedFile& file,
+                  const base::FilePath& path,
+                  uint32_t* header_size,
+                  std::unique_ptr<char[]>* json,
+                  size_t* json_size);
+
+  // GetFileInfo, without counting the lookup or recording it for the
+  // prefetch, for the lookups of the archive itself.
+  bool LookupFileInfo(const base::FilePath& path, FileInfo* info);
+
+  // Uses the header of the overlay, if there is one for this archive.
+  bool LoadOverlay();
+
+  // The offset of the packed entry |info| after the header of the archive, or
+  // of the overlay for the entries read from it, as prefetch manifests have
+  // it.
+  uint64_t GetEntryOffset(const FileInfo& info) const;
+
+  bool ReadDecrypted(const FileInfo& info,
+                     uint64_t position,
+                     uint64_t length,
+                     uint8_t* out,
+                     bool in_parallel);
+
+  // Adds a decryption of |bytes| of plaintext to the metrics.
+  void RecordDecryption(uint64_t bytes, base::TimeDelta time);
+
+  // Returns the plaintext of |info| from the DecryptedContentCache, decrypting
+  // it into the cache first if needed.
+  scoped_refptr<base::RefCountedBytes> GetCachedPlaintext(const FileInfo& info,
+                                                          bool in_parallel);
+
+  void RunPrefetch();
+
+  void RecordCopyFileOut(base::TimeDelta time);
+
+  // Where the code cache of |path| is kept, if code caches are kept.
+  bool GetCodeCachePath(const base::FilePath& path,
+                        base::FilePath* cache_path);
+
+  // Writes the plaintext of |info| to |dest|, a chunk at a time, and its
+  // SHA-256 to |digest| unless it is null.
+  bool WriteFileOut(const FileInfo& info, base::File* dest, uint8_t* digest);
+  // Whether the file at |path|, named after |info|, still hashes to the
+  // digest of the plaintext stored next to it when it was extracted. It is
+  // checked once per process, CopyFileOut remembering the files it returned.
+  bool IsFileOutCurrent(const FileInfo& info, const base::FilePath& path);
+  // The name the caches kept on disk give the packed entry |info|, which is
+  // derived from the digest of the headers the archive is read with and the
+  // offset and size of the entry. It identifies the entry without hashing
+  // it, what a file of that name holds is checked by IsFileOutCurrent.
+  std::string GetCacheName(const FileInfo& info);
+  // Extracts |info| into the extraction cache at |cache_dir|.
+  bool CopyFileOutToCache(const FileInfo& info,
+                          const base::FilePath& cache_dir,
+                          const base::FilePath::StringType& extension,
+                          base::FilePath* out);
+
+  // Returns the decryptor of the entry |info|, derived the first time an
+  // entry with its own key is looked up.
+  const Decryptor* GetDecryptor(const FileInfo& info);
+  const Decryptor* GetEntryDecryptor(uint64_t nonce);
+
+  // Decrypts the plaintext bytes [position, end) of |info| into |out|, the
+  // range having been checked by the caller.
+  bool DecryptRange(const FileInfo& info,
+                    uint64_t position,
+                    uint64_t end,
+                    uint8_t* out);
+  bool DecryptRangeInParallel(const FileInfo& info,
+                              uint64_t position,
+                              uint64_t end,
+                              uint8_t* out);
+  void RunParallelDecryption(ParallelDecryption* decryption,
+                             base::JobDelegate* delegate);
+
+  const base::FilePath path_;
+  const uint64_t generation_;
+  base::MemoryMappedFile file_;
+  uint32_t header_size_ = 0;
+  std::unique_ptr<base::MemoryMappedFile> overlay_file_;
+  // Offset of the entries of the overlay, after the archive and the header of
+  // the overlay.
+  uint64_t overlay_data_offset_ = 0;
+  std::unique_ptr<HeaderIndex> index_;
+  // Listings of the directories of |index_| by their index there.
+  std::unordered_map<uint32_t, std::unique_ptr<DirectoryListing>>
+      directory_listings_;
+  // Guards |index_|, which loads directories as they are accessed, and
+  // |directory_listings_|.
+  base::Lock index_lock_;
+  std::unique_ptr<Decryptor> decryptor_;
+  // Decryptors of the entries with their own key by nonce, which are never
+  // removed, so readers use them without the lock.
+  base::Lock entry_decryptors_lock_;
+  std::unordered_map<uint64_t, std::unique_ptr<Decryptor>> entry_decryptors_;
+  base::TimeDelta init_time_;
+  AtomicMetrics metrics_;
+  // The SHA-256 of the headers of the archive and overlay, computed the first
+  // time GetCacheName is called.
+  base::Lock header_digest_lock_;
+  bool header_digest_computed_ = false;
+  uint8_t header_digest_[32];
+
+  // Guards |external_files_| and |extracted_files_|. It is not held while a
+  // file is copied out, so two threads may copy out the same file at once.
+  base::Lock files_lock_;
+  // Cached external temporary files.
+  std::unordered_map<base::FilePath::StringType,
+                     std::unique_ptr<ScopedTemporaryFile>>
+      external_files_;
+  // Files extracted into the extraction cache, which outlive the process.
+  std::unordered_map<base::FilePath::StringType, base::FilePath>
+      extracted_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(Archive);
+};
+
+}  // namespace asar
+
+#endif  // SHELL_COMMON_ASAR_ARCHIVE_H_
@@ -0,0 +1,449 @@
+// Copyright (c) 2020 GitHub, Inc.
+// Use of this source code is governed by the MIT license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <openssl/aead.h>
+#include <openssl/cipher.h>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+
+#include "base/base64.h"
+#include "base/files/file_util.h"
+#include "base/files/scoped_temp_dir.h"
+#include "base/json/json_writer.h"
+#include "base/pickle.h"
+#include "base/rand_util.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/stringprintf.h"
+#include "base/test/task_environment.h"
+#include "base/timer/elapsed_timer.h"
+#include "base/values.h"
+#include "mojo/public/cpp/bindings/remote.h"
+#include "mojo/public/cpp/system/data_pipe_utils.h"
+#include "net/base/filename_util.h"
+#include "services/network/public/cpp/resource_request.h"
+#include "services/network/test/test_url_loader_client.h"
+#include "shell/browser/net/asar/asar_url_loader.h"
+#include "shell/common/asar/archive.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_result_reporter.h"
+
+// Benchmarks of the read paths of Archive, over synthetic archives written in
+// the layouts `asar pack` produces. Every result is printed as a *RESULT line
+// of perf_test::PerfResultReporter, and the run can also be saved with
+// --gtest_output=json, for CI to track.
+
+namespace asar {
+
+namespace {
+
+// The key archive.cc is built with.
+const char kPassphrase[] = "testtesttesttest";
+
+constexpr uint32_t kGCMBlockSize = 64 * 1024;
+constexpr size_t kFilesPerDirectory = 100;
+
+constexpr size_t kEntryCounts[] = {1000, 10000, 100000};
+constexpr size_t kFileSizes[] = {100, 64 * 1024, 1024 * 1024,
+                                 50 * 1024 * 1024};
+
+// Every measurement repeats its task for at least this long, and this many
+// times.
+constexpr base::TimeDelta kMinDuration =
+    base::TimeDelta::FromMilliseconds(200);
+constexpr int kMinRuns = 3;
+
+// Returns the mean time of a run of |task|.
+template <typename Task>
+base::TimeDelta TimeRuns(Task task) {
+  base::ElapsedTimer timer;
+  int runs = 0;
+  do {
+    task();
+    ++runs;
+  } while (runs < kMinRuns || timer.Elapsed() < kMinDuration);
+  return timer.Elapsed() / runs;
+}
+
+double BytesPerSecond(size_t bytes, base::TimeDelta time) {
+  return bytes / time.InSecondsF();
+}
+
+std::string SizeStory(size_t size) {
+  return base::StringPrintf("%zu_bytes", size);
+}
+
+enum class Encryption { kNone, kBase64, kGCM };
+
+const char* EncryptionName(Encryption encryption) {
+  switch (encryption) {
+    case Encryption::kNone:
+      return "plain";
+    case Encryption::kBase64:
+      return "base64";
+    case Encryption::kGCM:
+      return "gcm";
+  }
+  return "";
+}
+
+// Writes archives with a plain JSON header, whose entries are encrypted the
+// way lib/encrypt.js does.
+class ArchiveBuilder {
+ public:
+  ArchiveBuilder() : root_(base::Value::Type::DICTIONARY) {
+    root_.SetKey("files", base::Value(base::Value::Type::DICTIONARY));
+    MD5(reinterpret_cast<const uint8_t*>(kPassphrase), sizeof(kPassphrase) - 1,
+        key_);
+  }
+
+  // Adds the file |path|, '/' separated, with |content|.
+  void AddFile(const std::string& path,
+               const std::string& content,
+               Encryption encryption) {
+    base::Value node(base::Value::Type::DICTIONARY);
+    std::string stored;
+    switch (encryption) {
+      case Encryption::kNone:
+        stored = content;
+        break;
+      case Encryption::kBase64:
+        stored = EncryptBase64(content);
+        node.SetBoolKey("encrypted", true);
+        node.SetIntKey("len", static_cast<int>(content.size()));
+        break;
+      case Encryption::kGCM: {
+        uint64_t nonce = base::RandUint64();
+        stored = EncryptGCM(content, nonce);
+        base::Value info(base::Value::Type::DICTIONARY);
+        info.SetIntKey("version", Archive::kEncryptionGCM);
+        info.SetIntKey("blockSize", kGCMBlockSize);
+        info.SetStringKey(
+            "nonce", base::StringPrintf(
+                         "%016llx", static_cast<unsigned long long>(nonce)));
+        node.SetBoolKey("encrypted", true);
+        node.SetIntKey("len", static_cast<int>(content.size()));
+        node.SetKey("encryption", std::move(info));
+        break;
+      }
+    }
+    node.SetIntKey("size", static_cast<int>(stored.size()));
+    node.SetStringKey("offset", base::NumberToString(bodies_.size()));
+    bodies_ += stored;
+
+    base::Value* files = root_.FindKey("files");
+    size_t begin = 0;
+    for (size_t end = path.find('/'); end != std::string::npos;
+         begin = end + 1, end = path.find('/', begin)) {
+      std::string name = path.substr(begin, end - begin);
+      base::Value* dir = files->FindKey(name);
+      if (!dir) {
+        base::Value new_dir(base::Value::Type::DICTIONARY);
+        new_dir.SetKey("files", base::Value(base::Value::Type::DICTIONARY));
+        dir = files->SetKey(name, std::move(new_dir));
+      }
+      files = dir->FindKey("files");
+    }
+    files->SetKey(path.substr(begin), std::move(node));
+  }
+
+  bool Write(const base::FilePath& path) const {
+    std::string json;
+    if (!base::JSONWriter::Write(root_, &json))
+      return false;
+    base::Pickle header_pickle;
+    header_pickle.WriteString(json);
+    base::Pickle size_pickle;
+    size_pickle.WriteUInt32(header_pickle.size());
+
+    std::string archive(static_cast<const char*>(size_pickle.data()),
+                        size_pickle.size());
+    archive.append(static_cast<const char*>(header_pickle.data()),
+                   header_pickle.size());
+    archive += bodies_;
+    return base::WriteFile(path, archive);
+  }
+
+ private:
+  // Base64 text of the AES-128-ECB ciphertext.
+  std::string EncryptBase64(const std::string& content) const {
+    std::string ciphertext(content.size() + 16, '\0');
+    bssl::ScopedEVP_CIPHER_CTX ctx;
+    int size = 0, final_size = 0;
+    EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_ecb(), nullptr, key_, nullptr);
+    EVP_EncryptUpdate(ctx.get(), reinterpret_cast<uint8_t*>(&ciphertext[0]),
+                      &size, reinterpret_cast<const uint8_t*>(content.data()),
+                      content.size());
+    EVP_EncryptFinal_ex(ctx.get(),
+                        reinterpret_cast<uint8_t*>(&ciphertext[size]),
+                        &final_size);
+    ciphertext.resize(size + final_size);
+    std::string encoded;
+    base::Base64Encode(ciphertext, &encoded);
+    return encoded;
+  }
+
+  // Every block followed by its tag, under the nonce of the entry followed by
+  // the index of the block.
+  std::string EncryptGCM(const std::string& content, uint64_t nonce) const {
+    bssl::ScopedEVP_AEAD_CTX ctx;
+    EVP_AEAD_CTX_init(ctx.get(), EVP_aead_aes_128_gcm(), key_, sizeof(key_),
+                      EVP_AEAD_DEFAULT_TAG_LENGTH, nullptr);
+    std::string stored;
+    for (size_t start = 0, index = 0; start < content.size();
+         start += kGCMBlockSize, ++index) {
+      size_t plain_size =
+          std::min<size_t>(kGCMBlockSize, content.size() - start);
+      uint8_t block_nonce[12];
+      for (int i = 0; i < 8; ++i)
+        block_nonce[i] = static_cast<uint8_t>(nonce >> (56 - 8 * i));
+      for (int i = 0; i < 4; ++i)
+        block_nonce[8 + i] = static_cast<uint8_t>(index >> (24 - 8 * i));
+      std::string block(
+          plain_size + EVP_AEAD_max_overhead(EVP_aead_aes_128_gcm()), '\0');
+      size_t block_size = 0;
+      EVP_AEAD_CTX_seal(ctx.get(), reinterpret_cast<uint8_t*>(&block[0]),
+                        &block_size, block.size(), block_nonce,
+                        sizeof(block_nonce),
+                        reinterpret_cast<const uint8_t*>(&content[start]),
+                        plain_size, nullptr, 0);
+      block.resize(block_size);
+      stored += block;
+    }
+    return stored;
+  }
+
+  base::Value root_;
+  std::string bodies_;
+  uint8_t key_[MD5_DIGEST_LENGTH];
+};
+
+std::string FilePathFor(size_t index) {
+  return base::StringPrintf("dir%zu/file%zu.js", index / kFilesPerDirectory,
+                            index);
+}
+
+class AsarArchivePerfTest : public testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(temp_dir_.CreateUniqueTempDir()); }
+
+  base::FilePath WriteArchive(const ArchiveBuilder& builder,
+                              const std::string& name) {
+    base::FilePath path = temp_dir_.GetPath().AppendASCII(name + ".asar");
+    EXPECT_TRUE(builder.Write(path));
+    return path;
+  }
+
+  // An archive of |count| small encrypted files, as an app bundle would have.
+  base::FilePath WriteArchiveWithEntries(size_t count) {
+    ArchiveBuilder builder;
+    for (size_t i = 0; i < count; ++i)
+      builder.AddFile(FilePathFor(i), std::string(100, 'a'), Encryption::kGCM);
+    return WriteArchive(builder, base::StringPrintf("entries_%zu", count));
+  }
+
+  // An archive holding "file" of |size| bytes.
+  base::FilePath WriteArchiveWithFile(size_t size, Encryption encryption) {
+    ArchiveBuilder builder;
+    builder.AddFile("file", base::RandBytesAsString(size), encryption);
+    return WriteArchive(builder, base::StringPrintf("%s_%zu",
+                                                    EncryptionName(encryption),
+                                                    size));
+  }
+
+  base::test::TaskEnvironment task_environment_{
+      base::test::TaskEnvironment::MainThreadType::IO};
+  base::ScopedTempDir temp_dir_;
+};
+
+}  // namespace
+
+TEST_F(AsarArchivePerfTest, Init) {
+  for (size_t count : kEntryCounts) {
+    base::FilePath path = WriteArchiveWithEntries(count);
+    perf_test::PerfResultReporter reporter(
+        "AsarArchive.", base::StringPrintf("entries_%zu", count));
+    reporter.RegisterImportantMetric("init", "ms");
+    reporter.AddResult("init", TimeRuns([&] {
+                         Archive archive(path);
+                         ASSERT_TRUE(archive.Init());
+                       }));
+  }
+}
+
+// Resolving an archive which is already open, as every URL request and every
+// createArchive of a path does.
+TEST_F(AsarArchivePerfTest, Registry) {
+  constexpr int kLookups = 10000;
+  base::FilePath path = WriteArchiveWithEntries(kEntryCounts[0]);
+  perf_test::PerfResultReporter reporter("AsarArchiveRegistry.", "lookup");
+  reporter.RegisterImportantMetric("get_or_create", "ns");
+  std::shared_ptr<Archive> archive =
+      ArchiveRegistry::GetInstance()->GetOrCreate(path);
+  ASSERT_TRUE(archive);
+  base::TimeDelta time = TimeRuns([&] {
+    for (int i = 0; i < kLookups; ++i)
+      ArchiveRegistry::GetInstance()->GetOrCreate(path);
+  });
+  reporter.AddResult("get_or_create",
+                     time.InNanoseconds() / static_cast<double>(kLookups));
+}
+
+TEST_F(AsarArchivePerfTest, Lookup) {
+  for (size_t count : kEntryCounts) {
+    base::FilePath path = WriteArchiveWithEntries(count);
+    std::vector<base::FilePath> files, dirs;
+    for (size_t i = 0; i < count; ++i) {
+      // Visits the entries out of order, as require() does.
+      size_t index = (i * 7919) % count;
+      files.push_back(base::FilePath::FromUTF8Unsafe(FilePathFor(index)));
+    }
+    for (size_t i = 0; i < count; i += kFilesPerDirectory)
+      dirs.push_back(files[i].DirName());
+
+    perf_test::PerfResultReporter reporter(
+        "AsarArchive.", base::StringPrintf("entries_%zu", count));
+    reporter.RegisterImportantMetric("get_file_info_first", "ns");
+    reporter.RegisterImportantMetric("get_file_info", "ns");
+    reporter.RegisterImportantMetric("stat", "ns");
+    reporter.RegisterImportantMetric("get_entry_types", "ns");
+    reporter.RegisterImportantMetric("readdir", "ns");
+
+    // The first lookups also load the directories, which Init leaves to them.
+    Archive archive(path);
+    ASSERT_TRUE(archive.Init());
+    Archive::FileInfo info;
+    base::ElapsedTimer first_timer;
+    for (const base::FilePath& file : files)
+      ASSERT_TRUE(archive.GetFileInfo(file, &info));
+    reporter.AddResult("get_file_info_first",
+                       first_timer.Elapsed().InNanoseconds() /
+                           static_cast<double>(count));
+
+    base::TimeDelta time = TimeRuns([&] {
+      for (const base::FilePath& file : files)
+        archive.GetFileInfo(file, &info);
+    });
+    reporter.AddResult("get_file_info",
+                       time.InNanoseconds() / static_cast<double>(count));
+
+    Archive::Stats stats;
+    time = TimeRuns([&] {
+      for (const base::FilePath& file : files)
+        archive.Stat(file, &stats);
+    });
+    reporter.AddResult("stat",
+                       time.InNanoseconds() / static_cast<double>(count));
+
+    std::vector<int32_t> types(count);
+    time = TimeRuns([&] { archive.GetEntryTypes(files, types.data()); });
+    reporter.AddResult("get_entry_types",
+                       time.InNanoseconds() / static_cast<double>(count));
+
+    std::vector<base::FilePath> children;
+    time = TimeRuns([&] {
+      for (const base::FilePath& dir : dirs) {
+        children.clear();
+        archive.Readdir(dir, &children);
+      }
+    });
+    reporter.AddResult("readdir",
+                       time.InNanoseconds() / static_cast<double>(dirs.size()));
+  }
+}
+
+// Throughput of the decryption of whole entries, without the
+// DecryptedContentCache.
+TEST_F(AsarArchivePerfTest, Decrypt) {
+  DecryptedContentCache::GetInstance()->SetLimit(0);
+  for (Encryption encryption : {Encryption::kBase64, Encryption::kGCM}) {
+    for (size_t size : kFileSizes) {
+      Archive archive(WriteArchiveWithFile(size, encryption));
+      ASSERT_TRUE(archive.Init());
+      Archive::FileInfo info;
+      ASSERT_TRUE(archive.GetFileInfo(base::FilePath(FILE_PATH_LITERAL("file")),
+                                      &info));
+
+      perf_test::PerfResultReporter reporter(
+          base::StringPrintf("AsarArchive.%s.", EncryptionName(encryption)),
+          SizeStory(size));
+      reporter.RegisterImportantMetric("decrypt", "bytesPerSecond");
+      std::vector<char> out(size);
+      base::TimeDelta time = TimeRuns([&] {
+        ASSERT_TRUE(archive.ReadDecrypted(info, 0, size, out.data()));
+      });
+      reporter.AddResult("decrypt", BytesPerSecond(size, time));
+    }
+  }
+}
+
+// asar.readSync decrypts on the calling thread, asar.read on the thread pool.
+TEST_F(AsarArchivePerfTest, ReadSyncVsRead) {
+  DecryptedContentCache::GetInstance()->SetLimit(0);
+  for (size_t size : kFileSizes) {
+    Archive archive(WriteArchiveWithFile(size, Encryption::kGCM));
+    ASSERT_TRUE(archive.Init());
+    Archive::FileInfo info;
+    ASSERT_TRUE(
+        archive.GetFileInfo(base::FilePath(FILE_PATH_LITERAL("file")), &info));
+
+    perf_test::PerfResultReporter reporter("AsarArchive.", SizeStory(size));
+    reporter.RegisterImportantMetric("read_sync", "ms");
+    reporter.RegisterImportantMetric("read", "ms");
+    std::vector<char> out(size);
+    reporter.AddResult("read_sync", TimeRuns([&] {
+                         ASSERT_TRUE(
+                             archive.ReadDecrypted(info, 0, size, out.data()));
+                       }));
+    reporter.AddResult("read", TimeRuns([&] {
+                         ASSERT_TRUE(archive.ReadDecryptedInParallel(
+                             info, 0, size, out.data()));
+                       }));
+  }
+}
+
+// Time from the request to the response body, whose first bytes have been
+// read by then for sniffing, and to the end of the body.
+TEST_F(AsarArchivePerfTest, URLLoader) {
+  DecryptedContentCache::GetInstance()->SetLimit(0);
+  for (Encryption encryption : {Encryption::kNone, Encryption::kGCM}) {
+    for (size_t size : kFileSizes) {
+      base::FilePath path = WriteArchiveWithFile(size, encryption);
+      network::ResourceRequest request;
+      request.url = net::FilePathToFileURL(path.AppendASCII("file"));
+
+      perf_test::PerfResultReporter reporter(
+          base::StringPrintf("AsarURLLoader.%s.", EncryptionName(encryption)),
+          SizeStory(size));
+      reporter.RegisterImportantMetric("time_to_first_byte", "ms");
+      reporter.RegisterImportantMetric("load", "ms");
+      base::TimeDelta first_byte;
+      int runs = 0;
+      base::TimeDelta load = TimeRuns([&] {
+        ++runs;
+        base::ElapsedTimer timer;
+        mojo::Remote<network::mojom::URLLoader> loader;
+        network::TestURLLoaderClient client;
+        CreateAsarURLLoader(request, loader.BindNewPipeAndPassReceiver(),
+                            client.CreateRemote(), nullptr);
+        client.RunUntilResponseBodyArrived();
+        first_byte += timer.Elapsed();
+        std::string body;
+        ASSERT_TRUE(
+            mojo::BlockingCopyToString(client.response_body_release(), &body));
+        client.RunUntilComplete();
+        ASSERT_EQ(size, body.size());
+      });
+      reporter.AddResult("time_to_first_byte", first_byte / runs);
+      reporter.AddResult("load", load);
+    }
+  }
+}
+
+}  // namespace asar
@@ -0,0 +1,1114 @@
+// Copyright (c) 2020 GitHub, Inc.
+// Use of this source code is governed by the MIT license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <openssl/aead.h>
+#include <openssl/cipher.h>
+#include <openssl/evp.h>
+#include <openssl/hkdf.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "base/base64.h"
+#include "base/environment.h"
+#include "base/files/file_util.h"
+#include "base/files/scoped_temp_dir.h"
+#include "base/json/json_writer.h"
+#include "base/pickle.h"
+#include "base/rand_util.h"
+#include "base/stl_util.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_util.h"
+#include "base/strings/stringprintf.h"
+#include "base/test/task_environment.h"
+#include "base/values.h"
+#include "build/build_config.h"
+#include "shell/common/asar/archive.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/brotli/include/brotli/encode.h"
+
+// Correctness tests of Archive, over archives written here the way `asar
+// pack` and lib/encrypt.js write them, independently of the runtime.
+
+namespace asar {
+
+namespace {
+
+// The key archive.cc is built with.
+const char kPassphrase[] = "testtesttesttest";
+
+// Has to match kEntryKeyLabel in archive.cc and deriveEntryKey in
+// lib/header.js.
+const char kEntryKeyLabel[] = "asar-entry-key:";
+
+// Small blocks, so that small files span several of them.
+constexpr uint32_t kBlockSize = 1024;
+constexpr size_t kGCMTagSize = 16;
+
+// Reads are made into buffers followed by this many bytes of kGuardByte,
+// which no PKCS#7 padding byte equals, to catch writes past their end.
+constexpr size_t kGuardSize = 64;
+constexpr char kGuardByte = '\xa5';
+
+constexpr size_t kFileSizes[] = {0, 1, kBlockSize - 1, kBlockSize,
+                                 3 * kBlockSize + 17};
+
+enum class Encryption { kNone, kBase64, kBlocks, kGCM };
+
+const char* EncryptionName(Encryption encryption) {
+  switch (encryption) {
+    case Encryption::kNone:
+      return "plain";
+    case Encryption::kBase64:
+      return "base64";
+    case Encryption::kBlocks:
+      return "blocks";
+    case Encryption::kGCM:
+      return "gcm";
+  }
+  return "";
+}
+
+// How the JSON header of an archive is stored.
+enum class HeaderFormat { kPlain, kXor, kCTR };
+
+const char* HeaderFormatName(HeaderFormat format) {
+  switch (format) {
+    case HeaderFormat::kPlain:
+      return "plain";
+    case HeaderFormat::kXor:
+      return "xor";
+    case HeaderFormat::kCTR:
+      return "ctr";
+  }
+  return "";
+}
+
+struct FileOptions {
+  Encryption encryption = Encryption::kNone;
+  bool brotli = false;
+  // Encrypted with a key of its own, derived from the key of the archive.
+  bool entry_key = false;
+};
+
+// A packed file the binary index of an ArchiveWriter lists.
+struct IndexFile {
+  std::string name;
+  uint64_t offset;
+  uint32_t size;
+};
+
+void AppendUInt32(std::string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendUInt64(std::string* out, uint64_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// FNV-1a of a path, as HashPath in archive.cc.
+uint32_t HashPath(const std::string& path) {
+  uint32_t hash = 0x811c9dc5;
+  for (char c : path) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// Builds the binary index of lib/binary-header.js for plain |files| at the
+// root of an archive whose header is |header_size| bytes, without the footer.
+std::string BuildIndex(std::vector<IndexFile> files, uint32_t header_size) {
+  std::sort(files.begin(), files.end(),
+            [](const IndexFile& a, const IndexFile& b) {
+              return a.name < b.name;
+            });
+  uint32_t entry_count = files.size() + 1;
+  uint32_t bucket_count = 16;
+  while (bucket_count < entry_count * 2)
+    bucket_count *= 2;
+
+  std::string strings;
+  std::vector<uint32_t> buckets(bucket_count);
+  auto add_to_bucket = [&buckets, bucket_count](const std::string& path,
+                                                uint32_t index) {
+    uint32_t slot = HashPath(path) & (bucket_count - 1);
+    while (buckets[slot])
+      slot = (slot + 1) & (bucket_count - 1);
+    buckets[slot] = index + 1;
+  };
+
+  std::string entries;
+  auto add_entry = [&entries, &strings](const std::string& path,
+                                        uint64_t offset, uint32_t flags,
+                                        uint32_t size, uint32_t child_count) {
+    AppendUInt64(&entries, offset);
+    AppendUInt64(&entries, 0);  // nonce
+    AppendUInt32(&entries, strings.size());
+    AppendUInt32(&entries, path.size());
+    AppendUInt32(&entries, flags);
+    AppendUInt32(&entries, size);
+    for (int i = 0; i < 5; ++i)
+      AppendUInt32(&entries, 0);  // len, encryption and blocks
+    // The children of the root are the only ones.
+    AppendUInt32(&entries, 0);
+    AppendUInt32(&entries, child_count);
+    for (int i = 0; i < 3; ++i)
+      AppendUInt32(&entries, 0);  // link and compression
+    strings += path;
+  };
+
+  // The root directory, then its files in the order of their names.
+  add_entry("", 0, /* kDirectory */ 1, 0, files.size());
+  add_to_bucket("", 0);
+  std::string children;
+  for (size_t i = 0; i < files.size(); ++i) {
+    add_entry(files[i].name, files[i].offset, 0, files[i].size, 0);
+    add_to_bucket(files[i].name, i + 1);
+    AppendUInt32(&children, i + 1);
+  }
+
+  std::string index;
+  for (uint32_t value : {uint32_t{2}, entry_count, bucket_count,
+                         static_cast<uint32_t>(files.size()), uint32_t{0},
+                         static_cast<uint32_t>(strings.size()), header_size,
+                         uint32_t{0}})
+    AppendUInt32(&index, value);
+  index += entries;
+  index.append(reinterpret_cast<const char*>(buckets.data()),
+               buckets.size() * sizeof(uint32_t));
+  index += children;
+  index += strings;
+  return index;
+}
+
+// An archive whose header is the JSON text |header|, followed by |bodies|.
+// With a |magic|, the header was scrambled into |header| in the format it
+// names.
+std::string MakeArchive(const std::string& header,
+                        const std::string& bodies,
+                        const std::string& magic = std::string()) {
+  base::Pickle header_pickle;
+  header_pickle.WriteString(header);
+  base::Pickle size_pickle;
+  size_pickle.WriteUInt32(header_pickle.size());
+
+  std::string archive = magic;
+  archive.append(static_cast<const char*>(size_pickle.data()),
+                 size_pickle.size());
+  archive.append(static_cast<const char*>(header_pickle.data()),
+                 header_pickle.size());
+  return archive + bodies;
+}
+
+// Writes archives as `asar pack` does, with entries encrypted as
+// lib/encrypt.js does.
+class ArchiveWriter {
+ public:
+  ArchiveWriter() : root_(base::Value::Type::DICTIONARY) {
+    root_.SetKey("files", base::Value(base::Value::Type::DICTIONARY));
+    MD5(reinterpret_cast<const uint8_t*>(kPassphrase), sizeof(kPassphrase) - 1,
+        key_);
+  }
+
+  // Adds the file |path|, '/' separated, with |content|.
+  void AddFile(const std::string& path,
+               const std::string& content,
+               const FileOptions& options = FileOptions()) {
+    base::Value node(base::Value::Type::DICTIONARY);
+    std::string stored;
+    switch (options.encryption) {
+      case Encryption::kNone:
+        stored = content;
+        break;
+      case Encryption::kBase64:
+        stored = EncryptBase64(content);
+        break;
+      case Encryption::kBlocks: {
+        base::Value blocks(base::Value::Type::LIST);
+        for (size_t start = 0; start < content.size(); start += kBlockSize) {
+          std::string block = EncryptCBC(
+              Compress(content.substr(start, kBlockSize), options.brotli));
+          blocks.Append(base::Value(static_cast<int>(block.size())));
+          stored += block;
+        }
+        base::Value info(base::Value::Type::DICTIONARY);
+        info.SetIntKey("version", Archive::kEncryptionBlocks);
+        info.SetIntKey("blockSize", kBlockSize);
+        info.SetKey("blocks", std::move(blocks));
+        node.SetKey("encryption", std::move(info));
+        break;
+      }
+      case Encryption::kGCM: {
+        uint64_t nonce = base::RandUint64();
+        uint8_t key[MD5_DIGEST_LENGTH];
+        if (options.entry_key)
+          DeriveEntryKey(nonce, key);
+        else
+          memcpy(key, key_, sizeof(key));
+        base::Value blocks(base::Value::Type::LIST);
+        for (size_t start = 0, index = 0; start < content.size();
+             start += kBlockSize, ++index) {
+          std::string block = EncryptGCM(
+              key, nonce, index,
+              Compress(content.substr(start, kBlockSize), options.brotli));
+          blocks.Append(base::Value(static_cast<int>(block.size())));
+          stored += block;
+        }
+        base::Value info(base::Value::Type::DICTIONARY);
+        info.SetIntKey("version", Archive::kEncryptionGCM);
+        info.SetIntKey("blockSize", kBlockSize);
+        info.SetStringKey(
+            "nonce", base::StringPrintf(
+                         "%016llx", static_cast<unsigned long long>(nonce)));
+        if (options.entry_key)
+          info.SetBoolKey("entryKey", true);
+        // Only compressed blocks vary in size and need the table.
+        if (options.brotli)
+          info.SetKey("blocks", std::move(blocks));
+        node.SetKey("encryption", std::move(info));
+        break;
+      }
+    }
+    if (options.encryption != Encryption::kNone) {
+      node.SetBoolKey("encrypted", true);
+      node.SetIntKey("len", static_cast<int>(content.size()));
+    }
+    if (options.brotli)
+      node.SetStringKey("compression", "brotli");
+    if (overlay_)
+      node.SetBoolKey("overlay", true);
+    node.SetIntKey("size", static_cast<int>(stored.size()));
+    node.SetStringKey("offset", base::NumberToString(bodies_.size()));
+    bodies_ += stored;
+    AddNode(path, std::move(node));
+  }
+
+  // Adds the link |path| to |target|, both relative to the root.
+  void AddLink(const std::string& path, const std::string& target) {
+    base::Value node(base::Value::Type::DICTIONARY);
+    node.SetStringKey("link", target);
+    AddNode(path, std::move(node));
+  }
+
+  void set_header_format(HeaderFormat format) { header_format_ = format; }
+
+  // Appends the binary index of |files| in place of one of the header.
+  void SetIndex(std::vector<IndexFile> files) {
+    index_files_ = std::move(files);
+  }
+
+  // Adds the node of a file of another header, for overlays to keep the
+  // files of the archive they update.
+  void AddNode(const std::string& path, base::Value node) {
+    base::Value* files = root_.FindKey("files");
+    size_t begin = 0;
+    for (size_t end = path.find('/'); end != std::string::npos;
+         begin = end + 1, end = path.find('/', begin)) {
+      std::string name = path.substr(begin, end - begin);
+      base::Value* dir = files->FindKey(name);
+      if (!dir) {
+        base::Value new_dir(base::Value::Type::DICTIONARY);
+        new_dir.SetKey("files", base::Value(base::Value::Type::DICTIONARY));
+        dir = files->SetKey(name, std::move(new_dir));
+      }
+      files = dir->FindKey("files");
+    }
+    files->SetKey(path.substr(begin), std::move(node));
+  }
+
+  // Returns the node of the file |path| at the root.
+  const base::Value* FindNode(const std::string& path) const {
+    return root_.FindKey("files")->FindKey(path);
+  }
+
+  // Makes this the header of an overlay of the archive |base|, whose files
+  // are added from now on to the overlay.
+  void SetOverlayBase(const std::string& base) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(base.data()), GetHeaderSize(base),
+           digest);
+    root_.SetStringKey(
+        "base", base::ToLowerASCII(base::HexEncode(digest, sizeof(digest))));
+    overlay_ = true;
+  }
+
+  std::string Build() const {
+    std::string json;
+    if (!base::JSONWriter::Write(root_, &json))
+      return std::string();
+    std::string archive;
+    switch (header_format_) {
+      case HeaderFormat::kPlain:
+        archive = MakeArchive(json, bodies_);
+        break;
+      case HeaderFormat::kXor:
+        // The low byte of 579.
+        for (char& c : json)
+          c ^= 0x43;
+        archive = MakeArchive(json, bodies_, std::string("BAR\x02", 4));
+        break;
+      case HeaderFormat::kCTR:
+        archive = MakeArchive(EncryptCTR(json), bodies_,
+                              std::string("BAR\x03", 4));
+        break;
+    }
+    uint32_t header_size = GetHeaderSize(archive);
+
+    if (!index_files_.empty()) {
+      archive.resize((archive.size() + 7) / 8 * 8, '\0');
+      uint64_t index_offset = archive.size();
+      archive += BuildIndex(index_files_, header_size);
+      AppendUInt64(&archive, index_offset);
+      archive += "ASARIDX1";
+    }
+    return archive;
+  }
+
+  // The bytes of |archive| before the content of its files.
+  static uint32_t GetHeaderSize(const std::string& archive) {
+    size_t offset = archive.compare(0, 3, "BAR") == 0 ? 4 : 0;
+    uint32_t size = 0;
+    memcpy(&size, archive.data() + offset + sizeof(uint32_t), sizeof(size));
+    return offset + 8 + size;
+  }
+
+ private:
+  // Base64 text of the AES-128-ECB ciphertext.
+  std::string EncryptBase64(const std::string& content) const {
+    std::string ciphertext(content.size() + 16, '\0');
+    bssl::ScopedEVP_CIPHER_CTX ctx;
+    int size = 0, final_size = 0;
+    EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_ecb(), nullptr, key_, nullptr);
+    EVP_EncryptUpdate(ctx.get(), reinterpret_cast<uint8_t*>(&ciphertext[0]),
+                      &size, reinterpret_cast<const uint8_t*>(content.data()),
+                      content.size());
+    EVP_EncryptFinal_ex(ctx.get(),
+                        reinterpret_cast<uint8_t*>(&ciphertext[size]),
+                        &final_size);
+    ciphertext.resize(size + final_size);
+    std::string encoded;
+    base::Base64Encode(ciphertext, &encoded);
+    return encoded;
+  }
+
+  // A random IV followed by the AES-128-CBC ciphertext of |block|.
+  std::string EncryptCBC(const std::string& block) const {
+    std::string stored = base::RandBytesAsString(16);
+    std::string ciphertext(block.size() + 16, '\0');
+    bssl::ScopedEVP_CIPHER_CTX ctx;
+    int size = 0, final_size = 0;
+    EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_cbc(), nullptr, key_,
+                       reinterpret_cast<const uint8_t*>(stored.data()));
+    EVP_EncryptUpdate(ctx.get(), reinterpret_cast<uint8_t*>(&ciphertext[0]),
+                      &size, reinterpret_cast<const uint8_t*>(block.data()),
+                      block.size());
+    EVP_EncryptFinal_ex(ctx.get(),
+                        reinterpret_cast<uint8_t*>(&ciphertext[size]),
+                        &final_size);
+    ciphertext.resize(size + final_size);
+    return stored + ciphertext;
+  }
+
+  // A random IV followed by the AES-128-CTR ciphertext of |header|.
+  std::string EncryptCTR(const std::string& header) const {
+    std::string stored = base::RandBytesAsString(16);
+    std::string ciphertext(header.size(), '\0');
+    bssl::ScopedEVP_CIPHER_CTX ctx;
+    int size = 0;
+    EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_ctr(), nullptr, key_,
+                       reinterpret_cast<const uint8_t*>(stored.data()));
+    EVP_EncryptUpdate(ctx.get(), reinterpret_cast<uint8_t*>(&ciphertext[0]),
+                      &size, reinterpret_cast<const uint8_t*>(header.data()),
+                      header.size());
+    return stored + ciphertext;
+  }
+
+  // The ciphertext of |block| followed by the tag, under the nonce of the
+  // entry followed by the index of the block.
+  std::string EncryptGCM(const uint8_t* key,
+                         uint64_t nonce,
+                         uint32_t index,
+                         const std::string& block) const {
+    bssl::ScopedEVP_AEAD_CTX ctx;
+    EVP_AEAD_CTX_init(ctx.get(), EVP_aead_aes_128_gcm(), key,
+                      MD5_DIGEST_LENGTH, EVP_AEAD_DEFAULT_TAG_LENGTH, nullptr);
+    uint8_t block_nonce[12];
+    for (int i = 0; i < 8; ++i)
+      block_nonce[i] = static_cast<uint8_t>(nonce >> (56 - 8 * i));
+    for (int i = 0; i < 4; ++i)
+      block_nonce[8 + i] = static_cast<uint8_t>(index >> (24 - 8 * i));
+    std::string stored(block.size() + kGCMTagSize, '\0');
+    size_t stored_size = 0;
+    EVP_AEAD_CTX_seal(ctx.get(), reinterpret_cast<uint8_t*>(&stored[0]),
+                      &stored_size, stored.size(), block_nonce,
+                      sizeof(block_nonce),
+                      reinterpret_cast<const uint8_t*>(block.data()),
+                      block.size(), nullptr, 0);
+    stored.resize(stored_size);
+    return stored;
+  }
+
+  // HKDF-SHA256 of the key of the archive, without salt, with the label
+  // followed by the big-endian |nonce| as the info.
+  void DeriveEntryKey(uint64_t nonce, uint8_t* key) const {
+    std::string info = kEntryKeyLabel;
+    for (int i = 0; i < 8; ++i)
+      info += static_cast<char>(nonce >> (56 - 8 * i));
+    HKDF(key, MD5_DIGEST_LENGTH, EVP_sha256(), key_, sizeof(key_), nullptr, 0,
+         reinterpret_cast<const uint8_t*>(info.data()), info.size());
+  }
+
+  static std::string Compress(const std::string& block, bool brotli) {
+    if (!brotli)
+      return block;
+    std::string compressed(BrotliEncoderMaxCompressedSize(block.size()), '\0');
+    size_t size = compressed.size();
+    BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW,
+                          BROTLI_MODE_GENERIC, block.size(),
+                          reinterpret_cast<const uint8_t*>(block.data()),
+                          &size, reinterpret_cast<uint8_t*>(&compressed[0]));
+    compressed.resize(size);
+    return compressed;
+  }
+
+  base::Value root_;
+  std::string bodies_;
+  std::vector<IndexFile> index_files_;
+  HeaderFormat header_format_ = HeaderFormat::kPlain;
+  bool overlay_ = false;
+  uint8_t key_[MD5_DIGEST_LENGTH];
+};
+
+// Text that compresses well, unlike random bytes.
+std::string CompressibleContent(size_t size) {
+  std::string content;
+  while (content.size() < size)
+    content += base::StringPrintf("line %zu of the file\n", content.size());
+  content.resize(size);
+  return content;
+}
+
+class AsarArchiveTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    // Every read decrypts, unless a test turns the cache back on.
+    cache_limit_ = DecryptedContentCache::GetInstance()->GetStats().limit;
+    DecryptedContentCache::GetInstance()->SetLimit(0);
+  }
+
+  void TearDown() override {
+    DecryptedContentCache::GetInstance()->SetLimit(cache_limit_);
+  }
+
+  base::FilePath WriteArchive(const std::string& archive,
+                              const std::string& name) {
+    base::FilePath path = temp_dir_.GetPath().AppendASCII(name + ".asar");
+    EXPECT_TRUE(base::WriteFile(path, archive));
+    return path;
+  }
+
+  std::unique_ptr<Archive> OpenArchive(const std::string& archive,
+                                       const std::string& name) {
+    auto opened = std::make_unique<Archive>(WriteArchive(archive, name));
+    if (!opened->Init())
+      return nullptr;
+    return opened;
+  }
+
+  // Reads the bytes [position, position + length) of the plaintext of the
+  // file |path|, or fails. Nothing may be written past them.
+  static bool ReadFile(Archive* archive,
+                       const std::string& path,
+                       uint64_t position,
+                       uint64_t length,
+                       std::string* out,
+                       bool in_parallel = false) {
+    Archive::FileInfo info;
+    if (!archive->GetFileInfo(base::FilePath::FromUTF8Unsafe(path), &info))
+      return false;
+    std::string buffer(length + kGuardSize, kGuardByte);
+    bool read;
+    if (!info.encrypted) {
+      const uint8_t* data = archive->GetData(info.offset + position, length);
+      read = position + length <= info.size && (!length || data);
+      if (read && length)
+        memcpy(&buffer[0], data, length);
+    } else if (in_parallel) {
+      read = archive->ReadDecryptedInParallel(info, position, length,
+                                              &buffer[0]);
+    } else {
+      read = archive->ReadDecrypted(info, position, length, &buffer[0]);
+    }
+    EXPECT_EQ(std::string(kGuardSize, kGuardByte), buffer.substr(length))
+        << "written past the end of the read";
+    out->assign(buffer, 0, length);
+    return read;
+  }
+
+  static bool ReadWholeFile(Archive* archive,
+                            const std::string& path,
+                            std::string* out) {
+    Archive::FileInfo info;
+    return archive->GetFileInfo(base::FilePath::FromUTF8Unsafe(path), &info) &&
+           ReadFile(archive, path, 0, info.encrypted ? info.len : info.size,
+                    out);
+  }
+
+  base::test::TaskEnvironment task_environment_;
+  base::ScopedTempDir temp_dir_;
+  size_t cache_limit_ = 0;
+};
+
+}  // namespace
+
+// Every encryption version reads back what was packed, whole and by ranges
+// starting and ending inside blocks.
+TEST_F(AsarArchiveTest, RoundTrip) {
+  for (Encryption encryption : {Encryption::kNone, Encryption::kBase64,
+                                Encryption::kBlocks, Encryption::kGCM}) {
+    SCOPED_TRACE(EncryptionName(encryption));
+    ArchiveWriter writer;
+    std::vector<std::string> contents;
+    for (size_t size : kFileSizes) {
+      contents.push_back(base::RandBytesAsString(size));
+      FileOptions options;
+      options.encryption = encryption;
+      writer.AddFile(base::StringPrintf("dir/file%zu", size), contents.back(),
+                     options);
+    }
+    std::unique_ptr<Archive> archive =
+        OpenArchive(writer.Build(), EncryptionName(encryption));
+    ASSERT_TRUE(archive);
+
+    for (size_t i = 0; i < base::size(kFileSizes); ++i) {
+      size_t size = kFileSizes[i];
+      SCOPED_TRACE(size);
+      std::string path = base::StringPrintf("dir/file%zu", size);
+      Archive::FileInfo info;
+      ASSERT_TRUE(
+          archive->GetFileInfo(base::FilePath::FromUTF8Unsafe(path), &info));
+      EXPECT_EQ(encryption != Encryption::kNone, info.encrypted);
+
+      std::string out;
+      ASSERT_TRUE(ReadWholeFile(archive.get(), path, &out));
+      EXPECT_EQ(contents[i], out);
+      ASSERT_TRUE(ReadFile(archive.get(), path, 0, size, &out, true));
+      EXPECT_EQ(contents[i], out);
+      if (size < 2)
+        continue;
+      for (uint64_t position : {uint64_t{1}, uint64_t{size / 3}}) {
+        uint64_t length = size - position - 1;
+        ASSERT_TRUE(ReadFile(archive.get(), path, position, length, &out));
+        EXPECT_EQ(contents[i].substr(position, length), out);
+      }
+      EXPECT_FALSE(ReadFile(archive.get(), path, size - 1, 2, &out));
+    }
+  }
+}
+
+// Files of several 256 KiB chunks are split across workers, whole and by
+// ranges that start and end inside blocks, and a tampered block fails the
+// whole read.
+TEST_F(AsarArchiveTest, ParallelReads) {
+  for (Encryption encryption : {Encryption::kBlocks, Encryption::kGCM}) {
+    SCOPED_TRACE(EncryptionName(encryption));
+    std::string content = base::RandBytesAsString(1024 * kBlockSize + 123);
+    ArchiveWriter writer;
+    FileOptions options;
+    options.encryption = encryption;
+    writer.AddFile("file", content, options);
+    std::string packed = writer.Build();
+    std::unique_ptr<Archive> archive =
+        OpenArchive(packed, EncryptionName(encryption));
+    ASSERT_TRUE(archive);
+
+    std::string out;
+    ASSERT_TRUE(ReadFile(archive.get(), "file", 0, content.size(), &out, true));
+    EXPECT_EQ(content, out);
+    for (uint64_t position : {uint64_t{1}, uint64_t{300 * kBlockSize + 5}}) {
+      uint64_t length = content.size() - position - 7;
+      ASSERT_TRUE(
+          ReadFile(archive.get(), "file", position, length, &out, true));
+      EXPECT_EQ(content.substr(position, length), out);
+    }
+    EXPECT_FALSE(ReadFile(archive.get(), "file", 1, content.size(), &out,
+                          true));
+
+    // Flip a byte in the last block, which a worker other than the first
+    // decrypts.
+    packed[packed.size() - 20] ^= 1;
+    archive = OpenArchive(packed, "tampered");
+    ASSERT_TRUE(archive);
+    EXPECT_FALSE(
+        ReadFile(archive.get(), "file", 0, content.size(), &out, true));
+    ASSERT_TRUE(ReadFile(archive.get(), "file", 0, kBlockSize, &out, true));
+    EXPECT_EQ(content.substr(0, kBlockSize), out);
+  }
+}
+
+// Blocks of both block formats can be compressed with brotli before they are
+// encrypted.
+TEST_F(AsarArchiveTest, BrotliBlocks) {
+  for (Encryption encryption : {Encryption::kBlocks, Encryption::kGCM}) {
+    SCOPED_TRACE(EncryptionName(encryption));
+    std::string content = CompressibleContent(3 * kBlockSize + 17);
+    ArchiveWriter writer;
+    FileOptions options;
+    options.encryption = encryption;
+    options.brotli = true;
+    writer.AddFile("file.txt", content, options);
+    std::unique_ptr<Archive> archive =
+        OpenArchive(writer.Build(), EncryptionName(encryption));
+    ASSERT_TRUE(archive);
+
+    Archive::FileInfo info;
+    ASSERT_TRUE(archive->GetFileInfo(
+        base::FilePath(FILE_PATH_LITERAL("file.txt")), &info));
+    EXPECT_EQ(Archive::kCompressionBrotli, info.compression);
+    EXPECT_LT(info.size, info.len);
+
+    std::string out;
+    ASSERT_TRUE(ReadWholeFile(archive.get(), "file.txt", &out));
+    EXPECT_EQ(content, out);
+    ASSERT_TRUE(
+        ReadFile(archive.get(), "file.txt", kBlockSize - 5, kBlockSize, &out));
+    EXPECT_EQ(content.substr(kBlockSize - 5, kBlockSize), out);
+  }
+}
+
+// Every entry is found through the hash index, links are followed, and
+// nothing else is found.
+TEST_F(AsarArchiveTest, Lookups) {
+  ArchiveWriter writer;
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < 500; ++i) {
+    paths.push_back(
+        base::StringPrintf("dir%zu/sub%zu/file%zu.js", i % 7, i % 3, i));
+    writer.AddFile(paths.back(), paths.back());
+  }
+  writer.AddLink("link.js", "dir0/sub0/file0.js");
+  writer.AddLink("linked_dir", "dir1");
+  std::unique_ptr<Archive> archive = OpenArchive(writer.Build(), "lookups");
+  ASSERT_TRUE(archive);
+
+  std::string out;
+  for (const std::string& path : paths) {
+    ASSERT_TRUE(ReadWholeFile(archive.get(), path, &out)) << path;
+    EXPECT_EQ(path, out);
+  }
+  ASSERT_TRUE(ReadWholeFile(archive.get(), "link.js", &out));
+  EXPECT_EQ("dir0/sub0/file0.js", out);
+  ASSERT_TRUE(ReadWholeFile(archive.get(), "linked_dir/sub1/file1.js", &out));
+  EXPECT_EQ("dir1/sub1/file1.js", out);
+  base::FilePath realpath;
+  ASSERT_TRUE(archive->Realpath(base::FilePath(FILE_PATH_LITERAL("link.js")),
+                                &realpath));
+  EXPECT_EQ(base::FilePath(FILE_PATH_LITERAL("dir0/sub0/file0.js")), realpath);
+
+  for (const char* path : {"dir0", "dir0/sub0/file1.js", "dir0/sub0/file",
+                           "dir0/sub0/file0.js/x", "dir7", "file0.js"}) {
+    Archive::FileInfo info;
+    EXPECT_FALSE(
+        archive->GetFileInfo(base::FilePath::FromUTF8Unsafe(path), &info))
+        << path;
+  }
+
+  std::vector<base::FilePath> probes = {
+      base::FilePath(FILE_PATH_LITERAL("dir0")),
+      base::FilePath(FILE_PATH_LITERAL("dir0/sub0/file0.js")),
+      base::FilePath(FILE_PATH_LITERAL("link.js")),
+      base::FilePath(FILE_PATH_LITERAL("dir0/missing.js"))};
+  std::vector<int32_t> types(probes.size());
+  archive->GetEntryTypes(probes, types.data());
+  EXPECT_EQ((std::vector<int32_t>{Archive::kEntryDirectory,
+                                  Archive::kEntryFile, Archive::kEntryLink,
+                                  Archive::kEntryNone}),
+            types);
+}
+
+// Directories are only parsed once they are looked into, so a malformed one
+// is left empty without failing the archive or the other directories. Names
+// are listed in order, and the last of repeated names is kept.
+TEST_F(AsarArchiveTest, MalformedDirectoryIsLeftEmpty) {
+  std::unique_ptr<Archive> archive = OpenArchive(
+      MakeArchive(R"({"files":{"bad":{"files":{"x":{"size":1,"offset":"0"},)"
+                  R"("y":}},"good":{"files":{"b":{"size":1,"offset":"1"},)"
+                  R"("a":{"size":1,"offset":"0"},)"
+                  R"("a":{"size":2,"offset":"0"}}}}})",
+                  "ab"),
+      "malformed");
+  ASSERT_TRUE(archive);
+
+  std::string out;
+  ASSERT_TRUE(ReadWholeFile(archive.get(), "good/a", &out));
+  EXPECT_EQ("ab", out);
+  std::vector<base::FilePath> names;
+  ASSERT_TRUE(archive->Readdir(base::FilePath(FILE_PATH_LITERAL("good")),
+                               &names));
+  ASSERT_EQ(2u, names.size());
+  EXPECT_EQ(base::FilePath(FILE_PATH_LITERAL("a")), names[0]);
+  EXPECT_EQ(base::FilePath(FILE_PATH_LITERAL("b")), names[1]);
+
+  EXPECT_FALSE(ReadWholeFile(archive.get(), "bad/x", &out));
+  names.clear();
+  ASSERT_TRUE(archive->Readdir(base::FilePath(FILE_PATH_LITERAL("bad")),
+                               &names));
+  EXPECT_TRUE(names.empty());
+  ASSERT_TRUE(ReadWholeFile(archive.get(), "good/b", &out));
+  EXPECT_EQ("b", out);
+}
+
+// Headers scrambled by the legacy XOR or encrypted with AES-128-CTR behind
+// "BAR" and their format byte read like plain ones.
+TEST_F(AsarArchiveTest, ScrambledHeaders) {
+  for (HeaderFormat format : {HeaderFormat::kXor, HeaderFormat::kCTR}) {
+    SCOPED_TRACE(HeaderFormatName(format));
+    ArchiveWriter writer;
+    writer.set_header_format(format);
+    // Enough entries for the header to be unmasked by whole lanes and by
+    // bytes.
+    for (size_t i = 0; i < 37; ++i)
+      writer.AddFile(base::StringPrintf("dir/plain%zu.txt", i), "plain");
+    FileOptions options;
+    options.encryption = Encryption::kGCM;
+    writer.AddFile("dir/encrypted.txt", "encrypted", options);
+    std::string archive = writer.Build();
+    ASSERT_EQ(0, archive.compare(0, 3, "BAR"));
+    EXPECT_EQ(std::string::npos, archive.find("plain0.txt"));
+
+    std::unique_ptr<Archive> opened =
+        OpenArchive(archive, HeaderFormatName(format));
+    ASSERT_TRUE(opened);
+    std::string out;
+    for (size_t i = 0; i < 37; ++i) {
+      ASSERT_TRUE(ReadWholeFile(
+          opened.get(), base::StringPrintf("dir/plain%zu.txt", i), &out));
+      EXPECT_EQ("plain", out);
+    }
+    ASSERT_TRUE(ReadWholeFile(opened.get(), "dir/encrypted.txt", &out));
+    EXPECT_EQ("encrypted", out);
+  }
+}
+
+// A GCM block whose ciphertext or tag was changed, or which was moved, does
+// not authenticate, while the blocks around it still read.
+TEST_F(AsarArchiveTest, TamperedGCMBlocksAreRejected) {
+  std::string content = base::RandBytesAsString(3 * kBlockSize);
+  ArchiveWriter writer;
+  FileOptions options;
+  options.encryption = Encryption::kGCM;
+  writer.AddFile("file", content, options);
+  std::string archive = writer.Build();
+  size_t body = ArchiveWriter::GetHeaderSize(archive);
+  size_t stored_block_size = kBlockSize + kGCMTagSize;
+
+  std::string tampered_block = archive;
+  tampered_block[body + stored_block_size + 10] ^= 1;
+  std::string tampered_tag = archive;
+  tampered_tag[body + 3 * stored_block_size - 1] ^= 1;
+  std::string swapped = archive;
+  std::swap_ranges(swapped.begin() + body,
+                   swapped.begin() + body + stored_block_size,
+                   swapped.begin() + body + stored_block_size);
+
+  std::string out;
+  std::unique_ptr<Archive> opened = OpenArchive(tampered_block, "block");
+  ASSERT_TRUE(opened);
+  EXPECT_FALSE(ReadWholeFile(opened.get(), "file", &out));
+  EXPECT_FALSE(ReadFile(opened.get(), "file", kBlockSize + 1, 1, &out));
+  ASSERT_TRUE(ReadFile(opened.get(), "file", 0, kBlockSize, &out));
+  EXPECT_EQ(content.substr(0, kBlockSize), out);
+  ASSERT_TRUE(
+      ReadFile(opened.get(), "file", 2 * kBlockSize, kBlockSize, &out));
+  EXPECT_EQ(content.substr(2 * kBlockSize), out);
+
+  opened = OpenArchive(tampered_tag, "tag");
+  ASSERT_TRUE(opened);
+  EXPECT_FALSE(ReadFile(opened.get(), "file", 2 * kBlockSize, 1, &out));
+  ASSERT_TRUE(ReadFile(opened.get(), "file", 0, 2 * kBlockSize, &out));
+  EXPECT_EQ(content.substr(0, 2 * kBlockSize), out);
+
+  // The nonce of a block is bound to its index.
+  opened = OpenArchive(swapped, "swapped");
+  ASSERT_TRUE(opened);
+  EXPECT_FALSE(ReadFile(opened.get(), "file", 0, 1, &out));
+  EXPECT_FALSE(ReadFile(opened.get(), "file", kBlockSize, 1, &out));
+}
+
+// Entries with their own key read with the key HKDF derives for them, which
+// the key of the archive does not stand in for.
+TEST_F(AsarArchiveTest, EntryKeys) {
+  std::string content = base::RandBytesAsString(2 * kBlockSize + 1);
+  ArchiveWriter writer;
+  FileOptions options;
+  options.encryption = Encryption::kGCM;
+  options.entry_key = true;
+  writer.AddFile("own", content, options);
+  options.brotli = true;
+  writer.AddFile("own_compressed", content, options);
+  std::unique_ptr<Archive> archive = OpenArchive(writer.Build(), "entry_keys");
+  ASSERT_TRUE(archive);
+
+  for (const char* path : {"own", "own_compressed"}) {
+    SCOPED_TRACE(path);
+    std::string out;
+    ASSERT_TRUE(ReadWholeFile(archive.get(), path, &out));
+    EXPECT_EQ(content, out);
+  }
+
+  Archive::FileInfo info;
+  ASSERT_TRUE(
+      archive->GetFileInfo(base::FilePath(FILE_PATH_LITERAL("own")), &info));
+  ASSERT_TRUE(info.entry_key);
+  ASSERT_TRUE(info.decryptor);
+  EXPECT_NE(archive->decryptor(), info.decryptor);
+  std::vector<uint8_t> block(kBlockSize);
+  EXPECT_FALSE(archive->decryptor()->DecryptGCMBlock(
+      info.nonce, 0, archive->GetData(info.offset, info.size),
+      kBlockSize + kGCMTagSize, block.data(), block.size()));
+}
+
+// The files an overlay marks are read from it, the others from the archive,
+// and an overlay made for another build of the archive is ignored.
+TEST_F(AsarArchiveTest, Overlay) {
+  FileOptions options;
+  options.encryption = Encryption::kGCM;
+  ArchiveWriter writer;
+  writer.AddFile("kept", "kept in the archive", options);
+  writer.AddFile("replaced", "replaced by the overlay", options);
+  std::string archive = writer.Build();
+
+  ArchiveWriter overlay;
+  overlay.SetOverlayBase(archive);
+  overlay.AddNode("kept", writer.FindNode("kept")->Clone());
+  overlay.AddFile("replaced", "from the overlay", options);
+  overlay.AddFile("added", "added by the overlay");
+
+  base::FilePath path = WriteArchive(archive, "base");
+  ASSERT_TRUE(base::WriteFile(Archive::GetOverlayPath(path), overlay.Build()));
+  Archive opened(path);
+  ASSERT_TRUE(opened.Init());
+  std::string out;
+  ASSERT_TRUE(ReadWholeFile(&opened, "kept", &out));
+  EXPECT_EQ("kept in the archive", out);
+  ASSERT_TRUE(ReadWholeFile(&opened, "replaced", &out));
+  EXPECT_EQ("from the overlay", out);
+  ASSERT_TRUE(ReadWholeFile(&opened, "added", &out));
+  EXPECT_EQ("added by the overlay", out);
+
+  // The same overlay next to another build of the archive.
+  ArchiveWriter rebuilt;
+  rebuilt.AddFile("kept", "kept in the archive", options);
+  rebuilt.AddFile("replaced", "replaced by the overlay", options);
+  path = WriteArchive(rebuilt.Build(), "rebuilt");
+  ASSERT_TRUE(base::WriteFile(Archive::GetOverlayPath(path), overlay.Build()));
+  Archive stale(path);
+  ASSERT_TRUE(stale.Init());
+  ASSERT_TRUE(ReadWholeFile(&stale, "replaced", &out));
+  EXPECT_EQ("replaced by the overlay", out);
+  EXPECT_FALSE(ReadWholeFile(&stale, "added", &out));
+}
+
+// Reads of parts of an entry are served from the DecryptedContentCache once
+// the entry was read whole, but never put it there.
+TEST_F(AsarArchiveTest, OnlyWholeReadsFillTheCache) {
+  DecryptedContentCache* cache = DecryptedContentCache::GetInstance();
+  cache->SetLimit(cache_limit_);
+  cache->Clear();
+  std::string content = base::RandBytesAsString(3 * kBlockSize);
+  ArchiveWriter writer;
+  FileOptions options;
+  options.encryption = Encryption::kGCM;
+  writer.AddFile("file", content, options);
+  std::unique_ptr<Archive> archive = OpenArchive(writer.Build(), "cache");
+  ASSERT_TRUE(archive);
+
+  std::string out;
+  ASSERT_TRUE(ReadFile(archive.get(), "file", 10, 100, &out));
+  EXPECT_EQ(0u, cache->GetStats().entry_count);
+  EXPECT_EQ(100u, archive->GetMetrics().decrypted_bytes);
+
+  ASSERT_TRUE(ReadWholeFile(archive.get(), "file", &out));
+  EXPECT_EQ(1u, cache->GetStats().entry_count);
+  ASSERT_TRUE(ReadFile(archive.get(), "file", 10, 100, &out));
+  EXPECT_EQ(content.substr(10, 100), out);
+  ASSERT_TRUE(ReadWholeFile(archive.get(), "file", &out));
+  EXPECT_EQ(content, out);
+  EXPECT_EQ(100u + content.size(), archive->GetMetrics().decrypted_bytes);
+
+  // The same path opened again is another archive to the cache.
+  std::unique_ptr<Archive> reopened = OpenArchive(writer.Build(), "cache");
+  ASSERT_TRUE(reopened);
+  ASSERT_TRUE(ReadFile(reopened.get(), "file", 10, 100, &out));
+  EXPECT_EQ(100u, reopened->GetMetrics().decrypted_bytes);
+  cache->Clear();
+}
+
+#if defined(ARCH_CPU_LITTLE_ENDIAN)
+
+// A file of the extraction cache is reused by later archives of the same build
+// only while it still holds the plaintext it was extracted with.
+TEST_F(AsarArchiveTest, ExtractionCacheChecksContent) {
+  base::FilePath cache_dir = temp_dir_.GetPath().AppendASCII("extracted");
+  std::unique_ptr<base::Environment> env = base::Environment::Create();
+  ASSERT_TRUE(
+      env->SetVar("ELECTRON_ASAR_EXTRACT_CACHE", cache_dir.AsUTF8Unsafe()));
+  std::string content = base::RandBytesAsString(3 * kBlockSize + 17);
+  ArchiveWriter writer;
+  FileOptions options;
+  options.encryption = Encryption::kGCM;
+  writer.AddFile("file.node", content, options);
+  base::FilePath archive_path = WriteArchive(writer.Build(), "archive");
+  const base::FilePath path(FILE_PATH_LITERAL("file.node"));
+
+  base::FilePath extracted;
+  {
+    Archive archive(archive_path);
+    ASSERT_TRUE(archive.Init());
+    ASSERT_TRUE(archive.CopyFileOut(path, &extracted));
+  }
+  EXPECT_EQ(cache_dir, extracted.DirName());
+  std::string out;
+  ASSERT_TRUE(base::ReadFileToString(extracted, &out));
+  EXPECT_EQ(content, out);
+
+  // Replaced by bytes of the same size, then also without its digest.
+  std::string garbage(content.size(), 'x');
+  for (bool keep_digest : {true, false}) {
+    SCOPED_TRACE(keep_digest);
+    if (!keep_digest)
+      ASSERT_TRUE(base::DeleteFile(
+          extracted.AddExtension(FILE_PATH_LITERAL("sha256"))));
+    ASSERT_EQ(static_cast<int>(garbage.size()),
+              base::WriteFile(extracted, garbage.data(), garbage.size()));
+    Archive archive(archive_path);
+    ASSERT_TRUE(archive.Init());
+    base::FilePath reused;
+    ASSERT_TRUE(archive.CopyFileOut(path, &reused));
+    EXPECT_EQ(extracted, reused);
+    ASSERT_TRUE(base::ReadFileToString(reused, &out));
+    EXPECT_EQ(content, out);
+  }
+  env->UnSetVar("ELECTRON_ASAR_EXTRACT_CACHE");
+}
+
+// The binary index is used in place of the JSON header when it is valid, and
+// lists another file than the JSON header here to tell which one was read.
+class AsarBinaryIndexTest : public AsarArchiveTest {
+ protected:
+  void SetUp() override {
+    AsarArchiveTest::SetUp();
+    ArchiveWriter writer;
+    writer.AddFile("json_only", "content");
+    writer.SetIndex({{"index_only", 0, 7}});
+    archive_ = writer.Build();
+  }
+
+  // Whether |archive| was read through its binary index.
+  bool UsesIndex(const std::string& archive, const std::string& name) {
+    std::unique_ptr<Archive> opened = OpenArchive(archive, name);
+    EXPECT_TRUE(opened);
+    if (!opened)
+      return false;
+    std::string index_out, json_out;
+    bool index_only = ReadWholeFile(opened.get(), "index_only", &index_out);
+    bool json_only = ReadWholeFile(opened.get(), "json_only", &json_out);
+    EXPECT_NE(index_only, json_only);
+    EXPECT_EQ("content", index_only ? index_out : json_out);
+    return index_only;
+  }
+
+  // Offset of the index in |archive|, as its footer gives it.
+  static size_t GetIndexOffset(const std::string& archive) {
+    uint64_t index_offset = 0;
+    memcpy(&index_offset, archive.data() + archive.size() - 16,
+           sizeof(index_offset));
+    return index_offset;
+  }
+
+  // Sets the field |field| of the BinaryHeader of the index of |archive|.
+  static void SetHeaderField(std::string* archive,
+                             size_t field,
+                             uint32_t value) {
+    memcpy(&(*archive)[GetIndexOffset(*archive) + field * sizeof(uint32_t)],
+           &value, sizeof(value));
+  }
+
+  std::string archive_;
+};
+
+TEST_F(AsarBinaryIndexTest, ValidIndex) {
+  EXPECT_TRUE(UsesIndex(archive_, "valid"));
+}
+
+// An index missing bytes after its footer was moved, or whose counts make it
+// larger than it is, is rejected for the JSON header.
+TEST_F(AsarBinaryIndexTest, TruncatedIndex) {
+  std::string truncated = archive_;
+  truncated.erase(truncated.size() - 16 - 4, 4);
+  EXPECT_FALSE(UsesIndex(truncated, "truncated"));
+
+  // Down to the fields before the sections.
+  truncated = archive_;
+  size_t index_offset = GetIndexOffset(truncated);
+  truncated.erase(index_offset + 16, truncated.size() - 16 - index_offset - 16);
+  EXPECT_FALSE(UsesIndex(truncated, "truncated_header"));
+}
+
+TEST_F(AsarBinaryIndexTest, OversizedIndex) {
+  // Bytes the sections do not account for.
+  std::string padded = archive_;
+  padded.insert(padded.size() - 16, 8, '\0');
+  EXPECT_FALSE(UsesIndex(padded, "padded"));
+
+  // entry_count, bucket_count, child_count, block_offset_count and
+  // strings_size, by one and by as much as they can hold.
+  for (size_t field = 1; field <= 5; ++field) {
+    SCOPED_TRACE(field);
+    uint32_t value = 0;
+    memcpy(&value, &archive_[GetIndexOffset(archive_) + field * 4],
+           sizeof(value));
+    for (uint32_t oversized : {value + 1, uint32_t{0xffffffff}}) {
+      std::string archive = archive_;
+      SetHeaderField(&archive, field, oversized);
+      EXPECT_FALSE(UsesIndex(archive, base::StringPrintf(
+                                          "oversized_%zu_%u", field,
+                                          oversized)));
+    }
+  }
+}
+
+// An index of the right size whose contents do not hold together, or which
+// belongs to another header, is rejected as well.
+TEST_F(AsarBinaryIndexTest, InvalidIndex) {
+  // The header_size field.
+  std::string archive = archive_;
+  SetHeaderField(&archive, 6, ArchiveWriter::GetHeaderSize(archive) + 1);
+  EXPECT_FALSE(UsesIndex(archive, "header_size"));
+
+  // The only child of the root, after the fields, 2 entries and 16 buckets.
+  archive = archive_;
+  uint32_t child = 2;
+  memcpy(&archive[GetIndexOffset(archive) + 32 + 2 * 72 + 16 * 4], &child,
+         sizeof(child));
+  EXPECT_FALSE(UsesIndex(archive, "child"));
+
+  // A footer pointing inside the header.
+  archive = archive_;
+  uint64_t index_offset = 8;
+  memcpy(&archive[archive.size() - 16], &index_offset, sizeof(index_offset));
+  EXPECT_FALSE(UsesIndex(archive, "footer"));
+}
+
+#endif  // defined(ARCH_CPU_LITTLE_ENDIAN)
+
+}  // namespace asar
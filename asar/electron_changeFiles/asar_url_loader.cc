@@ -4,19 +4,26 @@
 
 #include "shell/browser/net/asar/asar_url_loader.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "base/containers/circular_deque.h"
+#include "base/files/file.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/weak_ptr.h"
+#include "base/metrics/histogram_macros.h"
 #include "base/strings/stringprintf.h"
 #include "base/task/post_task.h"
 #include "base/task/thread_pool.h"
+#include "base/trace_event/trace_event.h"
 #include "content/public/browser/file_url_loader.h"
 #include "mojo/public/cpp/bindings/receiver.h"
 #include "mojo/public/cpp/bindings/remote.h"
-#include "mojo/public/cpp/system/data_pipe_producer.h"
-#include "mojo/public/cpp/system/file_data_source.h"
+#include "mojo/public/cpp/system/data_pipe.h"
+#include "mojo/public/cpp/system/simple_watcher.h"
 #include "net/base/filename_util.h"
 #include "net/base/mime_sniffer.h"
 #include "net/base/mime_util.h"
@@ -26,67 +33,214 @@
 #include "shell/common/asar/archive.h"
 #include "shell/common/asar/asar_util.h"
 
-#include <openssl/evp.h>
-#include <openssl/md5.h>
-typedef std::vector<uint8_t> byte_array;
-byte_array base64Decode(char data[], int len)
-{
-    byte_array res;
-    res.resize(len);
-    len = EVP_DecodeBlock(&res[0], reinterpret_cast<unsigned char*>(data), len);
-    res.resize(len);
-    return res;
-}
-std::vector<unsigned char> aesdecrypt(std::vector<char> buffer, uint32_t len) {
-    std::string g_key = "testtesttesttest";
-    std::vector<unsigned char> decData(len);
-    byte_array out = base64Decode(&buffer[0], buffer.size());
-    unsigned char* encData = reinterpret_cast<unsigned char *>(&out[0]);
-    int outlen = 0;
-    unsigned char key[16] = { 0 };
-    std::copy(g_key.begin(), g_key.end(), key);
-    MD5((unsigned char*)g_key.c_str(), g_key.length(), key);
-
-    //解密
-    int decLen = 0;
-    EVP_CIPHER_CTX *ctx2;
-    ctx2 = EVP_CIPHER_CTX_new();
-    EVP_CipherInit_ex(ctx2, EVP_aes_128_ecb(), NULL, key, nullptr, 0);
-    EVP_CipherUpdate(ctx2, &decData[0], &outlen, encData, out.size());
-    decLen = outlen;
-    EVP_CipherFinal_ex(ctx2, &decData[0] + outlen, &outlen);
-    decLen += outlen;
-    EVP_CIPHER_CTX_free(ctx2);
-    return decData;
-}
-
 namespace asar {
 
 namespace {
 
-net::Error ConvertMojoResultToNetError(MojoResult result) {
-  switch (result) {
-    case MOJO_RESULT_OK:
-      return net::OK;
-    case MOJO_RESULT_NOT_FOUND:
-      return net::ERR_FILE_NOT_FOUND;
-    case MOJO_RESULT_PERMISSION_DENIED:
-      return net::ERR_ACCESS_DENIED;
-    case MOJO_RESULT_RESOURCE_EXHAUSTED:
-      return net::ERR_INSUFFICIENT_RESOURCES;
-    case MOJO_RESULT_ABORTED:
-      return net::ERR_ABORTED;
-    default:
-      return net::ERR_FAILED;
+constexpr size_t kDefaultFileUrlPipeSize = 65536;
+
+// Bytes of the body read, and decrypted, by a single task.
+constexpr uint64_t kChunkSize = 256 * 1024;
+
+// Chunks read ahead of the pipe at most. They are read in parallel on the
+// thread pool, which keeps the decryption of large encrypted entries spread
+// over several cores.
+constexpr size_t kMaxChunksInFlight = 4;
+
+// Pipe size for entries larger than the default pipe, leaving room for a chunk
+// to be written while the renderer reads the previous one.
+constexpr size_t kLargeFileUrlPipeSize = 2 * kChunkSize;
+
+// Reads the content of an entry from any thread, plaintext and unpacked
+// entries from their own |base::File|, encrypted ones decrypted by the
+// |Archive|. Positions are relative to the start of the content.
+class EntryReader : public base::RefCountedThreadSafe<EntryReader> {
+ public:
+  EntryReader(std::shared_ptr<Archive> archive,
+              const Archive::FileInfo& info,
+              base::File file,
+              uint64_t file_offset)
+      : archive_(std::move(archive)),
+        info_(info),
+        file_(std::move(file)),
+        file_offset_(file_offset) {}
+
+  uint64_t size() const { return info_.encrypted ? info_.len : info_.size; }
+
+  // Returns the end of the chunk starting at |position|, before |end|. Chunks
+  // of block entries end on block boundaries, so that no block is decrypted
+  // for two chunks.
+  uint64_t GetChunkEnd(uint64_t position, uint64_t end) const {
+    uint64_t chunk_end = std::min(end, position + kChunkSize);
+    if (info_.encrypted && info_.block_size && chunk_end < end) {
+      uint64_t aligned_end = chunk_end / info_.block_size * info_.block_size;
+      if (aligned_end > position)
+        chunk_end = aligned_end;
+    }
+    return chunk_end;
   }
+
+  bool Read(uint64_t position, uint64_t length, char* out) {
+    if (info_.encrypted)
+      return archive_->ReadDecrypted(info_, position, length, out);
+    // Note that while the |Archive| already opens a |base::File|, we still
+    // need our own here, as it might be accessed by multiple requests at the
+    // same time.
+    int size = static_cast<int>(length);
+    return file_.Read(file_offset_ + position, out, size) == size;
+  }
+
+ private:
+  friend class base::RefCountedThreadSafe<EntryReader>;
+
+  ~EntryReader() = default;
+
+  std::shared_ptr<Archive> archive_;
+  const Archive::FileInfo info_;
+  base::File file_;
+  const uint64_t file_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(EntryReader);
+};
+
+// Reads |length| bytes at |position| of |reader|, on the thread pool. Null if
+// they could not be read.
+std::unique_ptr<std::vector<char>> ReadChunk(scoped_refptr<EntryReader> reader,
+                                             uint64_t position,
+                                             uint64_t length) {
+  TRACE_EVENT1("electron", "AsarURLLoader::ReadChunk", "length", length);
+  auto data = std::make_unique<std::vector<char>>(length);
+  if (!reader->Read(position, length, data->data()))
+    return nullptr;
+  return data;
 }
 
-constexpr size_t kDefaultFileUrlPipeSize = 65536;
+// Writes the bytes [start, end) of an entry to a data pipe, as a pipeline: up
+// to kMaxChunksInFlight chunks are read, and decrypted, on the thread pool
+// while the ones before them are written to the pipe as it drains. The pipe is
+// written on the sequence of the writer, which never blocks on a read.
+class BodyWriter {
+ public:
+  using CompletionCallback = base::OnceCallback<void(MojoResult)>;
+
+  BodyWriter(mojo::ScopedDataPipeProducerHandle producer,
+             scoped_refptr<EntryReader> reader,
+             uint64_t start,
+             uint64_t end)
+      : producer_(std::move(producer)),
+        reader_(std::move(reader)),
+        next_position_(start),
+        end_(end),
+        watcher_(FROM_HERE, mojo::SimpleWatcher::ArmingPolicy::MANUAL) {}
+
+  // |on_first_write| runs once the first bytes are in the pipe, |callback|
+  // once all of them are, or on failure. The writer can be deleted from
+  // |callback|.
+  void Start(base::OnceClosure on_first_write, CompletionCallback callback) {
+    on_first_write_ = std::move(on_first_write);
+    callback_ = std::move(callback);
+    watcher_.Watch(producer_.get(), MOJO_HANDLE_SIGNAL_WRITABLE,
+                   MOJO_WATCH_CONDITION_SATISFIED,
+                   base::BindRepeating(&BodyWriter::OnPipeWritable,
+                                       base::Unretained(this)));
+    ReadChunks();
+  }
+
+ private:
+  struct Chunk {
+    std::unique_ptr<std::vector<char>> data;
+    size_t bytes_written = 0;
+  };
+
+  void ReadChunks() {
+    while (chunks_.size() < kMaxChunksInFlight && next_position_ < end_) {
+      uint64_t chunk_end = reader_->GetChunkEnd(next_position_, end_);
+      chunks_.emplace_back();
+      base::ThreadPool::PostTaskAndReplyWithResult(
+          FROM_HERE, {base::MayBlock(), base::TaskPriority::USER_VISIBLE},
+          base::BindOnce(&ReadChunk, reader_, next_position_,
+                         chunk_end - next_position_),
+          base::BindOnce(&BodyWriter::OnChunkRead, weak_factory_.GetWeakPtr(),
+                         first_chunk_id_ + chunks_.size() - 1));
+      next_position_ = chunk_end;
+    }
+  }
 
-// Because this makes things simpler.
-static_assert(kDefaultFileUrlPipeSize >= net::kMaxBytesToSniff,
-              "Default file data pipe size must be at least as large as a MIME-"
-              "type sniffing buffer.");
+  // Chunks are read in parallel, so they may complete out of order: a chunk
+  // waits in |chunks_| until the ones before it are written.
+  void OnChunkRead(uint64_t id, std::unique_ptr<std::vector<char>> data) {
+    if (!data) {
+      Finish(MOJO_RESULT_DATA_LOSS);
+      return;
+    }
+    chunks_[id - first_chunk_id_].data = std::move(data);
+    WriteChunks();
+  }
+
+  void OnPipeWritable(MojoResult result, const mojo::HandleSignalsState&) {
+    if (result != MOJO_RESULT_OK) {
+      Finish(result);
+      return;
+    }
+    WriteChunks();
+  }
+
+  void WriteChunks() {
+    while (!chunks_.empty() && chunks_.front().data) {
+      Chunk& chunk = chunks_.front();
+      uint32_t size =
+          static_cast<uint32_t>(chunk.data->size() - chunk.bytes_written);
+      MojoResult result = producer_->WriteData(
+          chunk.data->data() + chunk.bytes_written, &size,
+          MOJO_WRITE_DATA_FLAG_NONE);
+      if (result == MOJO_RESULT_SHOULD_WAIT) {
+        watcher_.ArmOrNotify();
+        return;
+      }
+      if (result != MOJO_RESULT_OK) {
+        Finish(result);
+        return;
+      }
+      if (on_first_write_)
+        std::move(on_first_write_).Run();
+      chunk.bytes_written += size;
+      if (chunk.bytes_written < chunk.data->size())
+        continue;
+      chunks_.pop_front();
+      first_chunk_id_++;
+      ReadChunks();
+    }
+    if (chunks_.empty() && next_position_ == end_)
+      Finish(MOJO_RESULT_OK);
+  }
+
+  void Finish(MojoResult result) {
+    watcher_.Cancel();
+    producer_.reset();
+    // Might delete this.
+    std::move(callback_).Run(result);
+  }
+
+  mojo::ScopedDataPipeProducerHandle producer_;
+  scoped_refptr<EntryReader> reader_;
+
+  // Start of the next chunk to read, and end of the body.
+  uint64_t next_position_;
+  const uint64_t end_;
+
+  // Chunks being read or not completely written yet, in the order of the
+  // body, the first one having the id |first_chunk_id_|.
+  base::circular_deque<Chunk> chunks_;
+  uint64_t first_chunk_id_ = 0;
+
+  mojo::SimpleWatcher watcher_;
+  base::OnceClosure on_first_write_;
+  CompletionCallback callback_;
+
+  base::WeakPtrFactory<BodyWriter> weak_factory_{this};
+
+  DISALLOW_COPY_AND_ASSIGN(BodyWriter);
+};
 
 // Modified from the |FileURLLoader| in |file_url_loader_factory.cc|, to serve
 // asar files instead of normal files.
@@ -124,10 +278,12 @@ class AsarURLLoader : public network::mojom::URLLoader {
              mojo::PendingReceiver<network::mojom::URLLoader> loader,
              mojo::PendingRemote<network::mojom::URLLoaderClient> client,
              scoped_refptr<net::HttpResponseHeaders> extra_response_headers) {
-    auto head = network::mojom::URLResponseHead::New();
-    head->request_start = base::TimeTicks::Now();
-    head->response_start = base::TimeTicks::Now();
-    head->headers = extra_response_headers;
+    TRACE_EVENT0("electron", "AsarURLLoader::Start");
+    request_start_ = base::TimeTicks::Now();
+    head_ = network::mojom::URLResponseHead::New();
+    head_->request_start = request_start_;
+    head_->response_start = base::TimeTicks::Now();
+    head_->headers = extra_response_headers;
 
     base::FilePath path;
     if (!net::FileURLToFilePath(request.url, &path)) {
@@ -154,239 +310,142 @@ class AsarURLLoader : public network::mojom::URLLoader {
     receiver_.set_disconnect_handler(base::BindOnce(
         &AsarURLLoader::OnConnectionError, base::Unretained(this)));
 
-    // Parse asar archive.
-    std::shared_ptr<Archive> archive = GetOrCreateAsarArchive(asar_path);
+    // Parse asar archive, or share the one the process has already opened.
+    std::shared_ptr<Archive> archive =
+        ArchiveRegistry::GetInstance()->GetOrCreate(asar_path);
     Archive::FileInfo info;
     if (!archive || !archive->GetFileInfo(relative_path, &info)) {
       OnClientComplete(net::ERR_FILE_NOT_FOUND);
       return;
     }
 
-    // For unpacked path, read like normal file.
-    base::FilePath real_path;
+    // For unpacked path, read like normal file. Entries updated by an overlay
+    // are read from the overlay file, at their offset in it.
+    base::FilePath file_path;
+    uint64_t file_offset = 0;
+    base::File file;
     if (info.unpacked) {
-      archive->CopyFileOut(relative_path, &real_path);
-      info.offset = 0;
+      archive->CopyFileOut(relative_path, &file_path);
+    } else if (!info.encrypted &&
+               !archive->ResolveOffset(info.offset, &file_path, &file_offset)) {
+      OnClientComplete(net::ERR_FILE_NOT_FOUND);
+      return;
     }
-
-    if (info.encrypted) {
-      mojo::ScopedDataPipeProducerHandle producer_handle;
-      mojo::ScopedDataPipeConsumerHandle consumer_handle;
-      if (mojo::CreateDataPipe(kDefaultFileUrlPipeSize, producer_handle,
-                              consumer_handle) != MOJO_RESULT_OK) {
-        OnClientComplete(net::ERR_FAILED);
+    if (!file_path.empty()) {
+      file.Initialize(file_path, base::File::FLAG_OPEN | base::File::FLAG_READ);
+      if (!file.IsValid()) {
+        OnClientComplete(net::ERR_FILE_NOT_FOUND);
         return;
       }
+    }
+    reader_ = base::MakeRefCounted<EntryReader>(archive, info, std::move(file),
+                                                file_offset);
+    uint64_t content_size = reader_->size();
+
+    uint32_t pipe_size = kDefaultFileUrlPipeSize;
+    if (content_size > kDefaultFileUrlPipeSize)
+      pipe_size = kLargeFileUrlPipeSize;
+    if (mojo::CreateDataPipe(pipe_size, producer_handle_, consumer_handle_) !=
+        MOJO_RESULT_OK) {
+      OnClientComplete(net::ERR_FAILED);
+      return;
+    }
 
-      // Note that while the |Archive| already opens a |base::File|, we still need
-      // to create a new |base::File| here, as it might be accessed by multiple
-      // requests at the same time.
-      base::File file(info.unpacked ? real_path : archive->path(),
-                      base::File::FLAG_OPEN | base::File::FLAG_READ);
-      auto file_data_source =
-          std::make_unique<mojo::FileDataSource>(std::move(file));
-      mojo::DataPipeProducer::DataSource* data_source = file_data_source.get();
-
-      // std::vector<char> initial_read_buffer(net::kMaxBytesToSniff);
-      std::vector<char> initial_read_buffer(info.size);
-
-      auto read_result =
-          data_source->Read(info.offset, base::span<char>(initial_read_buffer));
-      if (read_result.result != MOJO_RESULT_OK) {
-        OnClientComplete(ConvertMojoResultToNetError(read_result.result));
-        return;
-      }
-      std::vector<unsigned char> decData = aesdecrypt(initial_read_buffer, info.len);
-
-      std::string range_header;
-      net::HttpByteRange byte_range;
-      if (request.headers.GetHeader(net::HttpRequestHeaders::kRange,
-                                    &range_header)) {
-        // Handle a simple Range header for a single range.
-        std::vector<net::HttpByteRange> ranges;
-        bool fail = false;
-        if (net::HttpUtil::ParseRangeHeader(range_header, &ranges) &&
-            ranges.size() == 1) {
-          byte_range = ranges[0];
-          if (!byte_range.ComputeBounds(info.size))
-            fail = true;
-        } else {
+    std::string range_header;
+    net::HttpByteRange byte_range;
+    if (request.headers.GetHeader(net::HttpRequestHeaders::kRange,
+                                  &range_header)) {
+      // Handle a simple Range header for a single range.
+      std::vector<net::HttpByteRange> ranges;
+      bool fail = false;
+      if (net::HttpUtil::ParseRangeHeader(range_header, &ranges) &&
+          ranges.size() == 1) {
+        byte_range = ranges[0];
+        if (!byte_range.ComputeBounds(content_size))
           fail = true;
-        }
-
-        if (fail) {
-          OnClientComplete(net::ERR_REQUEST_RANGE_NOT_SATISFIABLE);
-          return;
-        }
-      }
-
-      uint64_t first_byte_to_send = 0;
-      uint64_t total_bytes_to_send = info.len;
-
-      if (byte_range.IsValid()) {
-        first_byte_to_send = byte_range.first_byte_position();
-        total_bytes_to_send =
-            byte_range.last_byte_position() - first_byte_to_send + 1;
-      }
-
-      total_bytes_written_ = total_bytes_to_send;
-
-      head->content_length = base::saturated_cast<int64_t>(total_bytes_to_send);
-
-      uint32_t write_size = static_cast<uint32_t>(total_bytes_to_send);
-      const uint32_t expected_write_size = write_size;
-      
-      MojoResult result =
-            producer_handle->WriteData(&decData[first_byte_to_send],
-                                      &write_size, MOJO_WRITE_DATA_FLAG_NONE);
-      if (result != MOJO_RESULT_OK || write_size != expected_write_size) {
-        OnFileWritten(result);
-        return;
-      }
-      first_byte_to_send = read_result.bytes_read;
-      total_bytes_to_send -= write_size;
-
-      if (!net::GetMimeTypeFromFile(path, &head->mime_type)) {
-        std::string new_type;
-        net::SniffMimeType(
-            base::StringPiece(initial_read_buffer.data(), read_result.bytes_read),
-            request.url, head->mime_type,
-            net::ForceSniffFileUrlsForHtml::kDisabled, &new_type);
-        head->mime_type.assign(new_type);
-        head->did_mime_sniff = true;
-      }
-      if (head->headers) {
-        head->headers->AddHeader(net::HttpRequestHeaders::kContentType,
-                                head->mime_type.c_str());
-      }
-      client_->OnReceiveResponse(std::move(head));
-      client_->OnStartLoadingResponseBody(std::move(consumer_handle));
-
-      if (total_bytes_to_send == 0) {
-        // There's definitely no more data, so we're already done.
-        OnFileWritten(MOJO_RESULT_OK);
-        return;
-      }
-
-    } else {
-      mojo::ScopedDataPipeProducerHandle producer_handle;
-      mojo::ScopedDataPipeConsumerHandle consumer_handle;
-      if (mojo::CreateDataPipe(kDefaultFileUrlPipeSize, producer_handle,
-                              consumer_handle) != MOJO_RESULT_OK) {
-        OnClientComplete(net::ERR_FAILED);
-        return;
+      } else {
+        fail = true;
       }
 
-      // Note that while the |Archive| already opens a |base::File|, we still need
-      // to create a new |base::File| here, as it might be accessed by multiple
-      // requests at the same time.
-      base::File file(info.unpacked ? real_path : archive->path(),
-                      base::File::FLAG_OPEN | base::File::FLAG_READ);
-      auto file_data_source =
-          std::make_unique<mojo::FileDataSource>(std::move(file));
-      mojo::DataPipeProducer::DataSource* data_source = file_data_source.get();
-
-      std::vector<char> initial_read_buffer(net::kMaxBytesToSniff);
-      auto read_result =
-          data_source->Read(info.offset, base::span<char>(initial_read_buffer));
-      if (read_result.result != MOJO_RESULT_OK) {
-        OnClientComplete(ConvertMojoResultToNetError(read_result.result));
+      if (fail) {
+        OnClientComplete(net::ERR_REQUEST_RANGE_NOT_SATISFIABLE);
         return;
       }
+    }
 
-      std::string range_header;
-      net::HttpByteRange byte_range;
-      if (request.headers.GetHeader(net::HttpRequestHeaders::kRange,
-                                    &range_header)) {
-        // Handle a simple Range header for a single range.
-        std::vector<net::HttpByteRange> ranges;
-        bool fail = false;
-        if (net::HttpUtil::ParseRangeHeader(range_header, &ranges) &&
-            ranges.size() == 1) {
-          byte_range = ranges[0];
-          if (!byte_range.ComputeBounds(info.size))
-            fail = true;
-        } else {
-          fail = true;
-        }
-
-        if (fail) {
-          OnClientComplete(net::ERR_REQUEST_RANGE_NOT_SATISFIABLE);
-          return;
-        }
-      }
+    first_byte_to_send_ = 0;
+    total_bytes_written_ = content_size;
 
-      uint64_t first_byte_to_send = 0;
-      uint64_t total_bytes_to_send = info.size;
+    if (byte_range.IsValid()) {
+      first_byte_to_send_ = byte_range.first_byte_position();
+      total_bytes_written_ =
+          byte_range.last_byte_position() - first_byte_to_send_ + 1;
+    }
 
-      if (byte_range.IsValid()) {
-        first_byte_to_send = byte_range.first_byte_position();
-        total_bytes_to_send =
-            byte_range.last_byte_position() - first_byte_to_send + 1;
-      }
+    head_->content_length = base::saturated_cast<int64_t>(total_bytes_written_);
 
-      total_bytes_written_ = total_bytes_to_send;
-
-      head->content_length = base::saturated_cast<int64_t>(total_bytes_to_send);
-
-      if (first_byte_to_send < read_result.bytes_read) {
-        // Write any data we read for MIME sniffing, constraining by range where
-        // applicable. This will always fit in the pipe (see assertion near
-        // |kDefaultFileUrlPipeSize| definition).
-        uint32_t write_size = std::min(
-            static_cast<uint32_t>(read_result.bytes_read - first_byte_to_send),
-            static_cast<uint32_t>(total_bytes_to_send));
-        const uint32_t expected_write_size = write_size;
-        MojoResult result =
-            producer_handle->WriteData(&initial_read_buffer[first_byte_to_send],
-                                      &write_size, MOJO_WRITE_DATA_FLAG_NONE);
-        if (result != MOJO_RESULT_OK || write_size != expected_write_size) {
-          OnFileWritten(result);
-          return;
-        }
-
-        // Discount the bytes we just sent from the total range.
-        first_byte_to_send = read_result.bytes_read;
-        total_bytes_to_send -= write_size;
-      }
+    // Entries packed with their MIME type, and most others by their
+    // extension, get it right away, and so does the response. The rest are
+    // sniffed from the first kMaxBytesToSniff bytes of their content, read and
+    // decrypted on the thread pool like the rest of the body.
+    if (net::ParseMimeTypeWithoutParameter(info.mime_type, nullptr, nullptr)) {
+      head_->mime_type = info.mime_type;
+      SendResponse();
+      return;
+    }
+    if (net::GetMimeTypeFromFile(path, &head_->mime_type)) {
+      SendResponse();
+      return;
+    }
+    url_ = request.url;
+    base::ThreadPool::PostTaskAndReplyWithResult(
+        FROM_HERE, {base::MayBlock(), base::TaskPriority::USER_VISIBLE},
+        base::BindOnce(&ReadChunk, reader_, 0,
+                       std::min(static_cast<uint64_t>(net::kMaxBytesToSniff),
+                                content_size)),
+        base::BindOnce(&AsarURLLoader::OnSniffBufferRead,
+                       weak_factory_.GetWeakPtr()));
+  }
 
-      if (!net::GetMimeTypeFromFile(path, &head->mime_type)) {
-        std::string new_type;
-        net::SniffMimeType(
-            base::StringPiece(initial_read_buffer.data(), read_result.bytes_read),
-            request.url, head->mime_type,
-            net::ForceSniffFileUrlsForHtml::kDisabled, &new_type);
-        head->mime_type.assign(new_type);
-        head->did_mime_sniff = true;
-      }
-      if (head->headers) {
-        head->headers->AddHeader(net::HttpRequestHeaders::kContentType,
-                                head->mime_type.c_str());
-      }
-      client_->OnReceiveResponse(std::move(head));
-      client_->OnStartLoadingResponseBody(std::move(consumer_handle));
+  void OnSniffBufferRead(std::unique_ptr<std::vector<char>> data) {
+    if (!data) {
+      OnClientComplete(net::ERR_FAILED);
+      return;
+    }
+    std::string new_type;
+    net::SniffMimeType(base::StringPiece(data->data(), data->size()), url_,
+                       head_->mime_type,
+                       net::ForceSniffFileUrlsForHtml::kDisabled, &new_type);
+    head_->mime_type.assign(new_type);
+    head_->did_mime_sniff = true;
+    SendResponse();
+  }
 
-      if (total_bytes_to_send == 0) {
-        // There's definitely no more data, so we're already done.
-        OnFileWritten(MOJO_RESULT_OK);
-        return;
-      }
+  void SendResponse() {
+    if (head_->headers) {
+      head_->headers->AddHeader(net::HttpRequestHeaders::kContentType,
+                                head_->mime_type.c_str());
+    }
+    client_->OnReceiveResponse(std::move(head_));
+    client_->OnStartLoadingResponseBody(std::move(consumer_handle_));
 
-      // In case of a range request, seek to the appropriate position before
-      // sending the remaining bytes asynchronously. Under normal conditions
-      // (i.e., no range request) this Seek is effectively a no-op.
-      //
-      // Note that in Electron we also need to add file offset.
-      file_data_source->SetRange(
-          first_byte_to_send + info.offset,
-          first_byte_to_send + info.offset + total_bytes_to_send);
-
-      data_producer_ =
-          std::make_unique<mojo::DataPipeProducer>(std::move(producer_handle));
-      data_producer_->Write(
-          std::move(file_data_source),
-          base::BindOnce(&AsarURLLoader::OnFileWritten, base::Unretained(this)));
+    if (total_bytes_written_ == 0) {
+      // There's definitely no more data, so we're already done.
+      OnFileWritten(MOJO_RESULT_OK);
+      return;
     }
+
+    body_writer_ = std::make_unique<BodyWriter>(
+        std::move(producer_handle_), std::move(reader_), first_byte_to_send_,
+        first_byte_to_send_ + total_bytes_written_);
+    body_writer_->Start(
+        base::BindOnce(
+            [](base::TimeTicks request_start) {
+              UMA_HISTOGRAM_TIMES("Electron.Asar.URLLoader.TimeToFirstByte",
+                                  base::TimeTicks::Now() - request_start);
+            },
+            request_start_),
+        base::BindOnce(&AsarURLLoader::OnFileWritten, base::Unretained(this)));
   }
 
   void OnConnectionError() {
@@ -408,7 +467,7 @@ class AsarURLLoader : public network::mojom::URLLoader {
   void OnFileWritten(MojoResult result) {
     // All the data has been written now. Close the data pipe. The consumer will
     // be notified that there will be no more data to read from now.
-    data_producer_.reset();
+    body_writer_.reset();
 
     if (result == MOJO_RESULT_OK) {
       network::URLLoaderCompletionStatus status(net::OK);
@@ -423,7 +482,16 @@ class AsarURLLoader : public network::mojom::URLLoader {
     MaybeDeleteSelf();
   }
 
-  std::unique_ptr<mojo::DataPipeProducer> data_producer_;
+  // State of the response until it is sent, and then the writer of its body.
+  base::TimeTicks request_start_;
+  GURL url_;
+  network::mojom::URLResponseHeadPtr head_;
+  scoped_refptr<EntryReader> reader_;
+  mojo::ScopedDataPipeProducerHandle producer_handle_;
+  mojo::ScopedDataPipeConsumerHandle consumer_handle_;
+  uint64_t first_byte_to_send_ = 0;
+  std::unique_ptr<BodyWriter> body_writer_;
+
   mojo::Receiver<network::mojom::URLLoader> receiver_{this};
   mojo::Remote<network::mojom::URLLoaderClient> client_;
 
@@ -434,6 +502,8 @@ class AsarURLLoader : public network::mojom::URLLoader {
   // to the URLLoaderClients (eg SimpleURLLoader).
   size_t total_bytes_written_ = 0;
 
+  base::WeakPtrFactory<AsarURLLoader> weak_factory_{this};
+
   DISALLOW_COPY_AND_ASSIGN(AsarURLLoader);
 };
 
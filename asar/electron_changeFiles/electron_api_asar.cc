@@ -2,9 +2,15 @@
 // Use of this source code is governed by the MIT license that can be
 // found in the LICENSE file.
 
+#include <memory>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "base/numerics/safe_conversions.h"
 #include "base/numerics/safe_math.h"
+#include "base/task/thread_pool.h"
+#include "base/trace_event/trace_event.h"
 #include "gin/handle.h"
 #include "gin/object_template_builder.h"
 #include "gin/wrappable.h"
@@ -19,19 +25,32 @@
 #include "shell/common/node_includes.h"
 #include "shell/common/node_util.h"
 
-#include <string>
-#include <openssl/evp.h>
-#include <openssl/md5.h>
-typedef std::vector<uint8_t> byte_array;
-
 namespace {
 
+// Allocates a backing store for content that is about to be written in full,
+// which saves the zero-filling pass of v8::ArrayBuffer::New.
+std::unique_ptr<v8::BackingStore> NewUninitializedBackingStore(
+    v8::Isolate* isolate,
+    size_t length) {
+  v8::ArrayBuffer::Allocator* allocator = isolate->GetArrayBufferAllocator();
+  void* data = allocator->AllocateUninitialized(length);
+  if (!data && length)
+    return nullptr;
+  return v8::ArrayBuffer::NewBackingStore(
+      data, length,
+      [](void* data, size_t length, void* allocator) {
+        static_cast<v8::ArrayBuffer::Allocator*>(allocator)->Free(data, length);
+      },
+      allocator);
+}
+
 class Archive : public gin::Wrappable<Archive> {
  public:
   static gin::Handle<Archive> Create(v8::Isolate* isolate,
                                      const base::FilePath& path) {
-    auto archive = std::make_unique<asar::Archive>(path);
-    if (!archive->Init())
+    std::shared_ptr<asar::Archive> archive =
+        asar::ArchiveRegistry::GetInstance()->GetOrCreate(path);
+    if (!archive)
       return gin::Handle<Archive>();
     return gin::CreateHandle(isolate, new Archive(isolate, std::move(archive)));
   }
@@ -42,24 +61,36 @@ class Archive : public gin::Wrappable<Archive> {
       v8::Isolate* isolate) override {
     return gin::ObjectTemplateBuilder(isolate)
         .SetProperty("path", &Archive::GetPath)
+        .SetProperty("generation", &Archive::GetGeneration)
         .SetMethod("getFileInfo", &Archive::GetFileInfo)
         .SetMethod("stat", &Archive::Stat)
+        .SetMethod("statBatch", &Archive::StatBatch)
         .SetMethod("readdir", &Archive::Readdir)
+        .SetMethod("readdirTypes", &Archive::ReaddirTypes)
         .SetMethod("realpath", &Archive::Realpath)
         .SetMethod("copyFileOut", &Archive::CopyFileOut)
+        .SetMethod("getStats", &Archive::GetStats)
+        .SetMethod("readCodeCache", &Archive::ReadCodeCache)
+        .SetMethod("writeCodeCache", &Archive::WriteCodeCache)
         .SetMethod("read", &Archive::Read)
-        .SetMethod("readSync", &Archive::ReadSync);
+        .SetMethod("readSync", &Archive::ReadSync)
+        .SetMethod("readFileDecrypted", &Archive::ReadFileDecrypted)
+        .SetMethod("readFileDecryptedSync", &Archive::ReadFileDecryptedSync);
   }
 
   const char* GetTypeName() override { return "Archive"; }
 
  protected:
-  Archive(v8::Isolate* isolate, std::unique_ptr<asar::Archive> archive)
+  Archive(v8::Isolate* isolate, std::shared_ptr<asar::Archive> archive)
       : archive_(std::move(archive)) {}
 
   // Returns the path of the file.
   base::FilePath GetPath() { return archive_->path(); }
 
+  // Returns the generation of the archive, which changes when the archive is
+  // opened again, with the overlay it has then.
+  uint64_t GetGeneration() { return archive_->generation(); }
+
   // Reads the offset and size of file.
   v8::Local<v8::Value> GetFileInfo(v8::Isolate* isolate,
                                    const base::FilePath& path) {
@@ -72,6 +103,8 @@ class Archive : public gin::Wrappable<Archive> {
     dict.Set("offset", info.offset);
     dict.Set("encrypted", info.encrypted);
     dict.Set("len", info.len);
+    dict.Set("encryptionVersion", info.encryption_version);
+    dict.Set("compression", info.compression);
     return dict.GetHandle();
   }
 
@@ -89,13 +122,44 @@ class Archive : public gin::Wrappable<Archive> {
     return dict.GetHandle();
   }
 
-  // Returns all files under a directory.
+  // Returns the type of each of |paths| as an Int32Array, in one call for the
+  // many paths module resolution probes: -1 when the path does not exist, 0
+  // for a file, 1 for a directory and 2 for a link.
+  v8::Local<v8::Value> StatBatch(v8::Isolate* isolate,
+                                 const std::vector<base::FilePath>& paths) {
+    if (!archive_)
+      return v8::False(isolate);
+    auto backing_store =
+        NewUninitializedBackingStore(isolate, paths.size() * sizeof(int32_t));
+    if (!backing_store)
+      return v8::False(isolate);
+    archive_->GetEntryTypes(paths,
+                            static_cast<int32_t*>(backing_store->Data()));
+    v8::Local<v8::ArrayBuffer> buffer =
+        v8::ArrayBuffer::New(isolate, std::move(backing_store));
+    return v8::Int32Array::New(buffer, 0, paths.size());
+  }
+
+  // Returns all files under a directory, as a frozen array which is built
+  // once per directory.
   v8::Local<v8::Value> Readdir(v8::Isolate* isolate,
                                const base::FilePath& path) {
-    std::vector<base::FilePath> files;
-    if (!archive_ || !archive_->Readdir(path, &files))
+    const asar::Archive::DirectoryListing* listing =
+        archive_ ? archive_->GetDirectoryListing(path) : nullptr;
+    if (!listing)
       return v8::False(isolate);
-    return gin::ConvertToV8(isolate, files);
+    return GetFrozenArray(isolate, &listings_[listing].names, listing->names);
+  }
+
+  // Returns the types of the files of Readdir, in the same order, as a frozen
+  // array of the values of asar::Archive::EntryType.
+  v8::Local<v8::Value> ReaddirTypes(v8::Isolate* isolate,
+                                    const base::FilePath& path) {
+    const asar::Archive::DirectoryListing* listing =
+        archive_ ? archive_->GetDirectoryListing(path) : nullptr;
+    if (!listing)
+      return v8::False(isolate);
+    return GetFrozenArray(isolate, &listings_[listing].types, listing->types);
   }
 
   // Returns the path of file with symbol link resolved.
@@ -107,6 +171,58 @@ class Archive : public gin::Wrappable<Archive> {
     return gin::ConvertToV8(isolate, realpath);
   }
 
+  // Returns the counters of the work done for the archive, times in
+  // milliseconds.
+  v8::Local<v8::Value> GetStats(v8::Isolate* isolate) {
+    if (!archive_)
+      return v8::False(isolate);
+    asar::Archive::Metrics metrics = archive_->GetMetrics();
+    gin_helper::Dictionary dict(isolate, v8::Object::New(isolate));
+    dict.Set("headerSize", metrics.header_size);
+    dict.Set("initTime", metrics.init_time.InMillisecondsF());
+    dict.Set("lookups", metrics.lookups);
+    dict.Set("decryptedBytes", metrics.decrypted_bytes);
+    dict.Set("decryptTime", metrics.decrypt_time.InMillisecondsF());
+    dict.Set("cacheHits", metrics.cache_hits);
+    dict.Set("cacheMisses", metrics.cache_misses);
+    dict.Set("copiedOutFiles", metrics.copied_out_files);
+    dict.Set("copyOutTime", metrics.copy_out_time.InMillisecondsF());
+    dict.Set("codeCacheHits", metrics.code_cache_hits);
+    dict.Set("codeCacheMisses", metrics.code_cache_misses);
+    return dict.GetHandle();
+  }
+
+  // Returns the V8 code cache kept for the module |path|, or false.
+  v8::Local<v8::Value> ReadCodeCache(v8::Isolate* isolate,
+                                     const base::FilePath& path) {
+    std::vector<uint8_t> data;
+    if (!archive_ || !archive_->ReadCodeCache(path, &data))
+      return v8::False(isolate);
+    auto backing_store = NewUninitializedBackingStore(isolate, data.size());
+    if (!backing_store)
+      return v8::False(isolate);
+    memcpy(backing_store->Data(), data.data(), data.size());
+    return v8::ArrayBuffer::New(isolate, std::move(backing_store));
+  }
+
+  // Keeps the code cache |data| of the module |path|, it is encrypted and
+  // written on the thread pool.
+  void WriteCodeCache(const base::FilePath& path, v8::Local<v8::Value> data) {
+    if (!archive_ || !data->IsArrayBufferView())
+      return;
+    v8::Local<v8::ArrayBufferView> view = data.As<v8::ArrayBufferView>();
+    std::vector<uint8_t> bytes(view->ByteLength());
+    view->CopyContents(bytes.data(), bytes.size());
+    base::ThreadPool::PostTask(
+        FROM_HERE, {base::MayBlock(), base::TaskPriority::BEST_EFFORT},
+        base::BindOnce(
+            [](std::shared_ptr<asar::Archive> archive,
+               const base::FilePath& path, const std::vector<uint8_t>& data) {
+              archive->WriteCodeCache(path, data);
+            },
+            archive_, path, std::move(bytes)));
+  }
+
   // Copy the file out into a temporary file and returns the new path.
   v8::Local<v8::Value> CopyFileOut(v8::Isolate* isolate,
                                    const base::FilePath& path) {
@@ -119,17 +235,58 @@ class Archive : public gin::Wrappable<Archive> {
   v8::Local<v8::ArrayBuffer> ReadSync(gin_helper::ErrorThrower thrower,
                                       uint64_t offset,
                                       uint64_t length) {
-    base::CheckedNumeric<uint64_t> safe_offset(offset);
-    base::CheckedNumeric<uint64_t> safe_end = safe_offset + length;
-    if (!safe_end.IsValid() ||
-        safe_end.ValueOrDie() > archive_->file()->length()) {
+    const uint8_t* data = archive_->GetData(offset, length);
+    if (!data) {
       thrower.ThrowError("Out of bounds read");
       return v8::Local<v8::ArrayBuffer>();
     }
-    auto array_buffer = v8::ArrayBuffer::New(thrower.isolate(), length);
-    auto backing_store = array_buffer->GetBackingStore();
-    memcpy(backing_store->Data(), archive_->file()->data() + offset, length);
-    return array_buffer;
+    auto backing_store = NewUninitializedBackingStore(thrower.isolate(), length);
+    if (!backing_store) {
+      thrower.ThrowError("Failed to allocate buffer");
+      return v8::Local<v8::ArrayBuffer>();
+    }
+    memcpy(backing_store->Data(), data, length);
+    return v8::ArrayBuffer::New(thrower.isolate(), std::move(backing_store));
+  }
+
+  // Returns the whole plaintext of an encrypted file, decrypted straight out
+  // of the mapped archive.
+  v8::Local<v8::ArrayBuffer> ReadFileDecryptedSync(
+      gin_helper::ErrorThrower thrower,
+      const base::FilePath& path) {
+    asar::Archive::FileInfo info;
+    if (!GetEncryptedFileInfo(path, &info)) {
+      thrower.ThrowError("Not an encrypted file");
+      return v8::Local<v8::ArrayBuffer>();
+    }
+    return DecryptToArrayBuffer(thrower, info, 0, info.len);
+  }
+
+  // Same with ReadFileDecryptedSync, but decrypts on the thread pool.
+  v8::Local<v8::Promise> ReadFileDecrypted(v8::Isolate* isolate,
+                                           const base::FilePath& path) {
+    gin_helper::Promise<v8::Local<v8::ArrayBuffer>> promise(isolate);
+    v8::Local<v8::Promise> handle = promise.GetHandle();
+
+    asar::Archive::FileInfo info;
+    if (!GetEncryptedFileInfo(path, &info)) {
+      promise.RejectWithErrorMessage("Not an encrypted file");
+      return handle;
+    }
+
+    auto backing_store = NewUninitializedBackingStore(isolate, info.len);
+    if (!backing_store) {
+      promise.RejectWithErrorMessage("Failed to allocate buffer");
+      return handle;
+    }
+    base::ThreadPool::PostTaskAndReplyWithResult(
+        FROM_HERE, {base::MayBlock(), base::TaskPriority::USER_VISIBLE},
+        base::BindOnce(&Archive::ReadOnIO, isolate, archive_,
+                       std::move(backing_store), uint64_t{0}, info.len,
+                       std::make_unique<asar::Archive::FileInfo>(info)),
+        base::BindOnce(&Archive::ResolveReadOnUI, std::move(promise)));
+
+    return handle;
   }
 
   v8::Local<v8::Promise> Read(v8::Isolate* isolate,
@@ -138,38 +295,102 @@ class Archive : public gin::Wrappable<Archive> {
     gin_helper::Promise<v8::Local<v8::ArrayBuffer>> promise(isolate);
     v8::Local<v8::Promise> handle = promise.GetHandle();
 
-    base::CheckedNumeric<uint64_t> safe_offset(offset);
-    base::CheckedNumeric<uint64_t> safe_end = safe_offset + length;
-    if (!safe_end.IsValid() ||
-        safe_end.ValueOrDie() > archive_->file()->length()) {
+    if (!archive_->GetData(offset, length)) {
       promise.RejectWithErrorMessage("Out of bounds read");
       return handle;
     }
 
-    auto backing_store = v8::ArrayBuffer::NewBackingStore(isolate, length);
+    auto backing_store = NewUninitializedBackingStore(isolate, length);
+    if (!backing_store) {
+      promise.RejectWithErrorMessage("Failed to allocate buffer");
+      return handle;
+    }
     base::ThreadPool::PostTaskAndReplyWithResult(
         FROM_HERE, {base::MayBlock(), base::TaskPriority::USER_VISIBLE},
         base::BindOnce(&Archive::ReadOnIO, isolate, archive_,
-                       std::move(backing_store), offset, length),
+                       std::move(backing_store), offset, length, nullptr),
         base::BindOnce(&Archive::ResolveReadOnUI, std::move(promise)));
 
     return handle;
   }
 
  private:
+  // The arrays Readdir and ReaddirTypes have returned for a directory.
+  struct CachedListing {
+    v8::Global<v8::Array> names;
+    v8::Global<v8::Array> types;
+  };
+
+  // Returns |*cached|, converting |values| into it the first time.
+  template <typename T>
+  static v8::Local<v8::Array> GetFrozenArray(v8::Isolate* isolate,
+                                             v8::Global<v8::Array>* cached,
+                                             const std::vector<T>& values) {
+    if (cached->IsEmpty()) {
+      v8::Local<v8::Array> array =
+          gin::ConvertToV8(isolate, values).As<v8::Array>();
+      array
+          ->SetIntegrityLevel(isolate->GetCurrentContext(),
+                              v8::IntegrityLevel::kFrozen)
+          .Check();
+      cached->Reset(isolate, array);
+    }
+    return cached->Get(isolate);
+  }
+
+  bool GetEncryptedFileInfo(const base::FilePath& path,
+                            asar::Archive::FileInfo* info) {
+    return archive_ && archive_->GetFileInfo(path, info) && info->encrypted &&
+           !info->unpacked;
+  }
+
+  v8::Local<v8::ArrayBuffer> DecryptToArrayBuffer(
+      gin_helper::ErrorThrower thrower,
+      const asar::Archive::FileInfo& info,
+      uint64_t position,
+      uint64_t length) {
+    auto backing_store = NewUninitializedBackingStore(thrower.isolate(), length);
+    if (!backing_store) {
+      thrower.ThrowError("Failed to allocate buffer");
+      return v8::Local<v8::ArrayBuffer>();
+    }
+    if (!archive_->ReadDecrypted(info, position, length,
+                                 static_cast<char*>(backing_store->Data()))) {
+      thrower.ThrowError("Failed to decrypt");
+      return v8::Local<v8::ArrayBuffer>();
+    }
+    return v8::ArrayBuffer::New(thrower.isolate(), std::move(backing_store));
+  }
+
+  // Copies the bytes [offset, offset + length) of the archive and its overlay,
+  // or when |decrypt| is set, decrypts that range of the plaintext of the
+  // encrypted file it describes across the thread pool, so the JS thread only
+  // receives the result.
   static std::unique_ptr<v8::BackingStore> ReadOnIO(
       v8::Isolate* isolate,
       std::shared_ptr<asar::Archive> archive,
       std::unique_ptr<v8::BackingStore> backing_store,
       uint64_t offset,
-      uint64_t length) {
-    memcpy(backing_store->Data(), archive->file()->data() + offset, length);
+      uint64_t length,
+      std::unique_ptr<asar::Archive::FileInfo> decrypt) {
+    if (decrypt) {
+      if (!archive->ReadDecryptedInParallel(
+              *decrypt, offset, length,
+              static_cast<char*>(backing_store->Data())))
+        return nullptr;
+      return backing_store;
+    }
+    memcpy(backing_store->Data(), archive->GetData(offset, length), length);
     return backing_store;
   }
 
   static void ResolveReadOnUI(
       gin_helper::Promise<v8::Local<v8::ArrayBuffer>> promise,
       std::unique_ptr<v8::BackingStore> backing_store) {
+    if (!backing_store) {
+      promise.RejectWithErrorMessage("Failed to decrypt");
+      return;
+    }
     v8::HandleScope scope(promise.isolate());
     v8::Context::Scope context_scope(promise.GetContext());
     auto array_buffer =
@@ -178,6 +399,9 @@ class Archive : public gin::Wrappable<Archive> {
   }
 
   std::shared_ptr<asar::Archive> archive_;
+  // Listings are kept by the archive as long as it is open.
+  std::unordered_map<const asar::Archive::DirectoryListing*, CachedListing>
+      listings_;
 
   DISALLOW_COPY_AND_ASSIGN(Archive);
 };
@@ -209,45 +433,60 @@ v8::Local<v8::Value> SplitPath(v8::Isolate* isolate,
   return dict.GetHandle();
 }
 
-v8::Local<v8::ArrayBuffer> DecodeBuffer(v8::Isolate* isolate,
-                                  v8::Local<v8::Value> buffer, int len) {
-  v8::Local<v8::ArrayBuffer> _buffer =
-      v8::Local<v8::ArrayBuffer>::Cast(buffer);
-
-  //base64解密
-  int size = _buffer->ByteLength();
-  byte_array out;
-  out.resize(size);
-  size = EVP_DecodeBlock(&out[0], 
-      reinterpret_cast<unsigned char*>((char*)_buffer->GetContents().Data()), 
-      size);
-  out.resize(size);
-  unsigned char encData[out.size()];
-  memcpy(encData, &out[0], out.size());
-
-  //aes-128-ecb解密
-  std::string g_key = "testtesttesttest";
-  unsigned char key[16] = { 0 };
-  int outlen = 0;
-  unsigned char decData[len];
-  std::copy(g_key.begin(), g_key.end(), key);
-  MD5((unsigned char*)g_key.c_str(), g_key.length(), key);
-  //解密
-  int decLen = 0;
-  EVP_CIPHER_CTX *ctx2;
-  ctx2 = EVP_CIPHER_CTX_new();
-  EVP_CipherInit_ex(ctx2, EVP_aes_128_ecb(), NULL, key, nullptr, 0);
-  while (decLen < len) {
-    EVP_CipherUpdate(ctx2, decData + decLen, &outlen, encData, out.size()-decLen);
-    decLen += outlen;
-    EVP_CipherFinal_ex(ctx2, decData + decLen + outlen, &outlen);
-    decLen += outlen;
+v8::Local<v8::ArrayBuffer> DecodeBuffer(gin_helper::ErrorThrower thrower,
+                                        v8::Local<v8::Value> buffer,
+                                        int len) {
+  if (!buffer->IsArrayBuffer() || len < 0) {
+    thrower.ThrowTypeError("Bad arguments");
+    return v8::Local<v8::ArrayBuffer>();
+  }
+  std::shared_ptr<v8::BackingStore> encoded =
+      buffer.As<v8::ArrayBuffer>()->GetBackingStore();
+
+  // base64 text of aes-128-ecb ciphertext. It is decoded straight into the
+  // single allocation handed to JS and decrypted there in place, using the
+  // cipher contexts the calling thread keeps for the default key.
+  auto backing_store = NewUninitializedBackingStore(thrower.isolate(), len);
+  if (!backing_store) {
+    thrower.ThrowError("Failed to allocate buffer");
+    return v8::Local<v8::ArrayBuffer>();
   }
-  EVP_CIPHER_CTX_free(ctx2);
-  auto array_buffer = v8::ArrayBuffer::New(isolate, len);
-  auto backing_store = array_buffer->GetBackingStore();
-  memcpy(backing_store->Data(), decData, len);
-  return array_buffer;
+  TRACE_EVENT1("electron", "DecodeBuffer", "length", len);
+  const asar::Decryptor& decryptor = asar::Decryptor::GetDefault();
+  if (!decryptor.DecryptBase64Range(
+          static_cast<const uint8_t*>(encoded->Data()), encoded->ByteLength(),
+          0, len, static_cast<uint8_t*>(backing_store->Data()))) {
+    thrower.ThrowError("Failed to decrypt");
+    return v8::Local<v8::ArrayBuffer>();
+  }
+  return v8::ArrayBuffer::New(thrower.isolate(), std::move(backing_store));
+}
+
+// Returns the counters of the process-wide cache of decrypted entries.
+v8::Local<v8::Value> GetDecryptedCacheStats(v8::Isolate* isolate) {
+  asar::DecryptedContentCache::Stats stats =
+      asar::DecryptedContentCache::GetInstance()->GetStats();
+  gin_helper::Dictionary dict = gin::Dictionary::CreateEmpty(isolate);
+  dict.Set("hits", stats.hits);
+  dict.Set("misses", stats.misses);
+  dict.Set("evictions", stats.evictions);
+  dict.Set("entryCount", static_cast<uint64_t>(stats.entry_count));
+  dict.Set("size", static_cast<uint64_t>(stats.size));
+  dict.Set("limit", static_cast<uint64_t>(stats.limit));
+  return dict.GetHandle();
+}
+
+// Sets the bytes of plaintext the cache of decrypted entries may hold in this
+// process, 0 disables it.
+void SetDecryptedCacheLimit(uint64_t limit) {
+  asar::DecryptedContentCache::GetInstance()->SetLimit(
+      base::saturated_cast<size_t>(limit));
+}
+
+// Ends the recording of the entries read at startup, and saves them as the
+// prefetch manifests of their archives.
+bool WritePrefetchManifests() {
+  return asar::PrefetchRecorder::GetInstance()->WriteManifests();
 }
 
 void Initialize(v8::Local<v8::Object> exports,
@@ -259,6 +498,9 @@ void Initialize(v8::Local<v8::Object> exports,
   dict.SetMethod("splitPath", &SplitPath);
   dict.SetMethod("initAsarSupport", &InitAsarSupport);
   dict.SetMethod("decodeBuffer", &DecodeBuffer);
+  dict.SetMethod("getDecryptedCacheStats", &GetDecryptedCacheStats);
+  dict.SetMethod("setDecryptedCacheLimit", &SetDecryptedCacheLimit);
+  dict.SetMethod("writePrefetchManifests", &WritePrefetchManifests);
 }
 
 }  // namespace
@@ -46,6 +46,13 @@ const getOrCreateArchive = (archivePath: string) => {
   return newArchive;
 };
 
+// Reads the content of a packed file, encrypted files are decrypted straight
+// out of the archive.
+const readPackedFile = (archive: NodeJS.AsarArchive, filePath: string, info: NodeJS.AsarFileInfo) => {
+  if (info.encrypted !== true) return archive.readSync(info.offset, info.size);
+  return archive.readFileDecryptedSync(filePath);
+};
+
 const asarRe = /\.asar/i;
 
 // Separate asar package's path from full path.
@@ -542,20 +549,20 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     }
 
     logASARAccess(asarPath, filePath, info.offset);
-    let arrayBuffer: ArrayBuffer | string;
-    try {
-      arrayBuffer = archive.readSync(info.offset, info.size);
-      if (info.encrypted === true) {
-        arrayBuffer = asar.decodeBuffer(arrayBuffer, info.len);
-      } 
-    } catch (err) {
+    // Encrypted files are decrypted on the thread pool as well, the callback
+    // only receives the plaintext.
+    const read = info.encrypted === true
+      ? archive.readFileDecrypted(filePath)
+      : archive.read(info.offset, info.size);
+    read.then((arrayBuffer) => {
+      const buffer = Buffer.from(arrayBuffer);
+      callback(null, encoding ? buffer.toString(encoding) : buffer);
+    }, (err) => {
       const error: AsarErrorObject = new Error(`EINVAL, ${err.message} while reading ${filePath} in ${asarPath}`);
       error.code = 'EINVAL';
       error.errno = -22;
-      throw error;
-    }
-    const buffer = Buffer.from(arrayBuffer);
-    callback(null, encoding ? buffer.toString(encoding) : buffer);
+      callback(error);
+    });
   };
 
   fs.promises.readFile = util.promisify(fs.readFile);
@@ -591,10 +598,7 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     logASARAccess(asarPath, filePath, info.offset);
     let arrayBuffer: ArrayBuffer | string;
     try {
-      arrayBuffer = archive.readSync(info.offset, info.size);
-      if (info.encrypted === true) {
-        arrayBuffer = asar.decodeBuffer(arrayBuffer, info.len);
-      } 
+      arrayBuffer = readPackedFile(archive, filePath, info);
     } catch (err) {
       const error: AsarErrorObject = new Error(`EINVAL, ${err.message} while reading ${filePath} in ${asarPath}`);
       error.code = 'EINVAL';
@@ -605,6 +609,14 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     return encoding ? buffer.toString(encoding) : buffer;
   };
 
+  // The Dirent types of the entry types archive.readdirTypes returns, in the
+  // order of their values.
+  const direntTypes = [
+    fs.constants.UV_DIRENT_FILE,
+    fs.constants.UV_DIRENT_DIR,
+    fs.constants.UV_DIRENT_LINK
+  ];
+
   const { readdir } = fs;
   fs.readdir = function (pathArgument: string, options: { encoding?: string | null; withFileTypes?: boolean } = {}, callback?: Function) {
     const pathInfo = splitPath(pathArgument);
@@ -630,28 +642,24 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     }
 
     if (options.withFileTypes) {
+      const types = archive.readdirTypes(filePath);
       const dirents = [];
-      for (const file of files) {
-        const childPath = path.join(filePath, file);
-        const stats = archive.stat(childPath);
-        if (!stats) {
+      for (let i = 0; i < files.length; i++) {
+        const direntType = direntTypes[types[i]];
+        if (direntType === undefined) {
+          const childPath = path.join(filePath, files[i]);
           const error = createError(AsarError.NOT_FOUND, { asarPath, filePath: childPath });
           nextTick(callback!, [error]);
           return;
         }
-        if (stats.isFile) {
-          dirents.push(new fs.Dirent(file, fs.constants.UV_DIRENT_FILE));
-        } else if (stats.isDirectory) {
-          dirents.push(new fs.Dirent(file, fs.constants.UV_DIRENT_DIR));
-        } else if (stats.isLink) {
-          dirents.push(new fs.Dirent(file, fs.constants.UV_DIRENT_LINK));
-        }
+        dirents.push(new fs.Dirent(files[i], direntType));
       }
       nextTick(callback!, [null, dirents]);
       return;
     }
 
-    nextTick(callback!, [null, files]);
+    // The listing is shared by every call and frozen.
+    nextTick(callback!, [null, files.slice()]);
   };
 
   fs.promises.readdir = util.promisify(fs.readdir);
@@ -675,25 +683,21 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     }
 
     if (options && (options as ReaddirSyncOptions).withFileTypes) {
+      const types = archive.readdirTypes(filePath);
       const dirents = [];
-      for (const file of files) {
-        const childPath = path.join(filePath, file);
-        const stats = archive.stat(childPath);
-        if (!stats) {
+      for (let i = 0; i < files.length; i++) {
+        const direntType = direntTypes[types[i]];
+        if (direntType === undefined) {
+          const childPath = path.join(filePath, files[i]);
           throw createError(AsarError.NOT_FOUND, { asarPath, filePath: childPath });
         }
-        if (stats.isFile) {
-          dirents.push(new fs.Dirent(file, fs.constants.UV_DIRENT_FILE));
-        } else if (stats.isDirectory) {
-          dirents.push(new fs.Dirent(file, fs.constants.UV_DIRENT_DIR));
-        } else if (stats.isLink) {
-          dirents.push(new fs.Dirent(file, fs.constants.UV_DIRENT_LINK));
-        }
+        dirents.push(new fs.Dirent(files[i], direntType));
       }
       return dirents;
     }
 
-    return files;
+    // The listing is shared by every call and frozen.
+    return files.slice();
   };
 
   const { internalModuleReadJSON } = internalBinding('fs');
@@ -717,10 +721,7 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     logASARAccess(asarPath, filePath, info.offset);
     let arrayBuffer: ArrayBuffer | String;
     try {
-      arrayBuffer = archive.readSync(info.offset, info.size);
-      if (info.encrypted === true) {
-       arrayBuffer = asar.decodeBuffer(arrayBuffer, info.len);
-      } 
+      arrayBuffer = readPackedFile(archive, filePath, info);
     } catch (err) {
       const error: AsarErrorObject = new Error(`EINVAL, ${err.message} while reading ${filePath} in ${asarPath}`);
       error.code = 'EINVAL';
@@ -729,10 +730,28 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     }
     const buffer = Buffer.from(arrayBuffer);
     const str = buffer.toString('utf8');
-    console.log('cca',str)
     return [str, str.length > 0];
   };
 
+  // Module resolution stats a path, then the path with each extension, and
+  // the index file of the path as a directory. The first probe of a path in
+  // an archive looks them all up in a single statBatch call, the following
+  // probes are answered from this cache of entry types. It is keyed by the
+  // generation of the archive, so an archive opened again, which may have
+  // been replaced or given a new overlay since, is probed again.
+  const moduleStatCache = new Map<string, number>();
+  const moduleStatCacheLimit = 10000;
+
+  const getModuleStatCandidates = (filePath: string) => {
+    const extensions = Object.keys(Module._extensions);
+    const indexPath = path.join(filePath, 'index');
+    return [
+      filePath,
+      ...extensions.map(extension => filePath + extension),
+      ...extensions.map(extension => indexPath + extension)
+    ];
+  };
+
   const { internalModuleStat } = internalBinding('fs');
   internalBinding('fs').internalModuleStat = (pathArgument: string) => {
     const pathInfo = splitPath(pathArgument);
@@ -743,13 +762,73 @@ export const wrapFsWithAsar = (fs: Record<string, any>) => {
     const archive = getOrCreateArchive(asarPath);
     if (!archive) return -34;
 
+    const { generation } = archive;
+    let type = moduleStatCache.get(`${generation}\0${filePath}`);
+    if (type === undefined) {
+      // -ENOENT
+      const candidates = getModuleStatCandidates(filePath);
+      const types = archive.statBatch(candidates);
+      if (!types) return -34;
+
+      if (moduleStatCache.size + candidates.length > moduleStatCacheLimit) {
+        moduleStatCache.clear();
+      }
+      candidates.forEach((candidate, i) => {
+        moduleStatCache.set(`${generation}\0${candidate}`, types[i]);
+      });
+      type = types[0];
+    }
+
     // -ENOENT
-    const stats = archive.stat(filePath);
-    if (!stats) return -34;
+    if (type === -1) return -34;
 
-    return (stats.isDirectory) ? 1 : 0;
+    return (type === 1) ? 1 : 0;
   };
 
+  // With ELECTRON_ASAR_CODE_CACHE set, modules in archives are compiled with
+  // the V8 code cache the archive keeps for them, and the cache is made the
+  // first time they run, so it also covers the functions they call while
+  // being loaded. The source is still read, V8 needs it to compile the
+  // functions the cache does not cover. Node compiles modules without a way
+  // to pass it a cache, so this compiles and runs them as its _compile does,
+  // with its own require() and import(). Its _compile is used instead when it
+  // does more than that: checking modules against a policy manifest, or
+  // pausing the inspector on the entry point with --inspect-brk.
+  if (process.env.ELECTRON_ASAR_CODE_CACHE &&
+      !__non_webpack_require__('internal/options').getOptionValue('--inspect-brk')) {
+    const vm = require('vm');
+    const { pathToFileURL } = require('url');
+    const { makeRequireFunction } = __non_webpack_require__('internal/modules/cjs/helpers');
+    const policy = __non_webpack_require__('internal/process/policy');
+    const esmLoader = __non_webpack_require__('internal/process/esm_loader');
+
+    const { _compile } = Module.prototype;
+    Module.prototype._compile = function (content: string, filename: string) {
+      const pathInfo = splitPath(filename);
+      if (!pathInfo.isAsar || policy.manifest) return _compile.apply(this, arguments);
+      const { asarPath, filePath } = pathInfo;
+
+      const archive = getOrCreateArchive(asarPath);
+      if (!archive) return _compile.apply(this, arguments);
+
+      const cachedData = archive.readCodeCache(filePath);
+      const script = new vm.Script(Module.wrap(content), {
+        filename,
+        cachedData: cachedData ? Buffer.from(cachedData) : undefined,
+        // import() in the module resolves from the module, as in Node.
+        importModuleDynamically: (specifier: string) =>
+          esmLoader.ESMLoader.import(specifier, pathToFileURL(filename).href)
+      });
+      const compiledWrapper = script.runInThisContext({ displayErrors: true });
+      const result = compiledWrapper.call(this.exports, this.exports,
+        makeRequireFunction(this), this, filename, path.dirname(filename));
+      if (!cachedData || script.cachedDataRejected) {
+        archive.writeCodeCache(filePath, script.createCachedData());
+      }
+      return result;
+    };
+  }
+
   // Calling mkdir for directory inside asar archive should throw ENOTDIR
   // error, but on Windows it throws ENOENT.
   if (process.platform === 'win32') {